@@ -0,0 +1,323 @@
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "archive.hpp"
+
+static const char block_magic[4] = {'D', 'W', 'A', '1'};
+static const size_t flush_rows = 4096;
+
+const std::vector<std::pair<std::string, ArchiveBlock::type>> archive_columns =
+    {{"key", ArchiveBlock::String},
+     {"drmaa", ArchiveBlock::String},
+     {"status", ArchiveBlock::String},
+     {"job_name", ArchiveBlock::String},
+     {"job_category", ArchiveBlock::String},
+     {"finished_at", ArchiveBlock::Integer},
+     {"exit_status", ArchiveBlock::Integer},
+     {"signal", ArchiveBlock::String},
+     {"aborted", ArchiveBlock::Integer}};
+
+static void putU32(std::string &output, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    output += (char)((value >> (8 * i)) & 0xFF);
+  }
+}
+
+static bool getU32(FILE *file, uint32_t &value) {
+  unsigned char buffer[4];
+  if (fread(buffer, 1, 4, file) != 4) {
+    return false;
+  }
+  value = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) |
+          ((uint32_t)buffer[3] << 24);
+  return true;
+}
+
+static void putVarint(std::string &output, uint64_t value) {
+  while (value >= 0x80) {
+    output += (char)((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  output += (char)value;
+}
+
+static bool getVarint(const std::string &input, size_t &offset,
+                      uint64_t &value) {
+  value = 0;
+  for (int shift = 0; offset < input.size() && shift < 64; shift += 7) {
+    unsigned char byte = input[offset++];
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void putString(std::string &output, const std::string &value) {
+  putVarint(output, value.size());
+  output += value;
+}
+
+static void putInteger(std::string &output, int64_t value) {
+  putVarint(output, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+// The length of the whole blocks at the start of a segment, skipping over
+// their data; anything after that was cut short by a crash
+static long completeLength(FILE *file) {
+  if (fseek(file, 0, SEEK_END) != 0) {
+    return 0;
+  }
+  auto size = ftell(file);
+  rewind(file);
+  long complete = 0;
+  char magic[sizeof(block_magic)];
+  uint32_t row_count;
+  uint32_t column_count;
+  while (fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+         memcmp(magic, block_magic, sizeof(magic)) == 0 &&
+         getU32(file, row_count) && getU32(file, column_count)) {
+    auto whole = true;
+    for (uint32_t c = 0; c < column_count && whole; c++) {
+      int name_length = fgetc(file);
+      uint32_t raw_length;
+      uint32_t compressed_length;
+      whole = name_length != EOF &&
+              fseek(file, name_length + 1, SEEK_CUR) == 0 &&
+              getU32(file, raw_length) && getU32(file, compressed_length) &&
+              fseek(file, compressed_length, SEEK_CUR) == 0;
+    }
+    if (!whole || ftell(file) > size) {
+      break;
+    }
+    complete = ftell(file);
+  }
+  return complete;
+}
+
+static std::string dayOf(int64_t timestamp) {
+  time_t t = timestamp;
+  struct tm parts;
+  gmtime_r(&t, &parts);
+  char buffer[16];
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d", &parts);
+  return buffer;
+}
+
+ArchiveWriter::ArchiveWriter(const std::string &directory_)
+    : directory(directory_), written(0) {
+  mkdir(directory.c_str(), 0755);
+}
+
+ArchiveWriter::~ArchiveWriter() { flush(); }
+
+void ArchiveWriter::append(const ArchiveRecord &record) {
+  bool full;
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    pending.push_back(record);
+    full = pending.size() >= flush_rows;
+  }
+  if (full) {
+    flush();
+  }
+}
+
+void ArchiveWriter::flush() {
+  std::unique_lock<std::mutex> guard(lock);
+  // Segments are rotated daily based on when the job finished
+  std::map<std::string, std::vector<ArchiveRecord>> days;
+  for (auto &record : pending) {
+    days[dayOf(record.finished_at)].push_back(record);
+  }
+  for (auto &day : days) {
+    writeBlock(day.first, day.second);
+  }
+  pending.clear();
+}
+
+size_t ArchiveWriter::archived() const { return written; }
+
+void ArchiveWriter::writeBlock(const std::string &day,
+                               const std::vector<ArchiveRecord> &records) {
+  std::map<std::string, std::string> raw;
+  for (auto &record : records) {
+    putString(raw["key"], record.key);
+    putString(raw["drmaa"], record.drmaa);
+    putString(raw["status"], record.status);
+    putString(raw["job_name"], record.job_name);
+    putString(raw["job_category"], record.job_category);
+    putInteger(raw["finished_at"], record.finished_at);
+    putInteger(raw["exit_status"], record.exit_status);
+    putString(raw["signal"], record.signal);
+    putInteger(raw["aborted"], record.aborted ? 1 : 0);
+  }
+
+  std::string block(block_magic, sizeof(block_magic));
+  putU32(block, records.size());
+  putU32(block, archive_columns.size());
+  for (auto &column : archive_columns) {
+    auto &data = raw[column.first];
+    uLongf compressed_length = compressBound(data.size());
+    std::string compressed(compressed_length, '\0');
+    if (compress2((Bytef *)&compressed[0], &compressed_length,
+                  (const Bytef *)data.data(), data.size(),
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+      std::cerr << "Failed to compress archive column " << column.first
+                << "; dropping " << records.size() << " records" << std::endl;
+      return;
+    }
+    block += (char)column.first.size();
+    block += column.first;
+    block += (char)column.second;
+    putU32(block, data.size());
+    putU32(block, compressed_length);
+    block.append(compressed, 0, compressed_length);
+  }
+
+  auto path = directory + "/jobs-" + day + ".dwa";
+  if (checked.insert(path).second) {
+    // Readers stop at the first bad block, so anything appended after one
+    // left by a crash would be lost too
+    auto existing = fopen(path.c_str(), "r+b");
+    if (existing != nullptr) {
+      auto complete = completeLength(existing);
+      fseek(existing, 0, SEEK_END);
+      auto size = ftell(existing);
+      if (complete < size) {
+        std::cerr << "Dropping " << size - complete
+                  << " bytes of a block cut short at the end of " << path
+                  << std::endl;
+        if (ftruncate(fileno(existing), complete) != 0) {
+          std::cerr << "Failed to truncate archive " << path << std::endl;
+        }
+      }
+      fclose(existing);
+    }
+  }
+  auto file = fopen(path.c_str(), "ab");
+  if (file == nullptr) {
+    std::cerr << "Failed to open archive " << path << "; dropping "
+              << records.size() << " records" << std::endl;
+    return;
+  }
+  fseek(file, 0, SEEK_END);
+  auto start = ftell(file);
+  if (fwrite(block.data(), 1, block.size(), file) != block.size() ||
+      fflush(file) != 0) {
+    std::cerr << "Failed to write archive " << path << std::endl;
+    // Don't leave part of it for the next block to follow
+    if (ftruncate(fileno(file), start) != 0) {
+      std::cerr << "Failed to truncate archive " << path << std::endl;
+    }
+  } else {
+    written += records.size();
+  }
+  fclose(file);
+}
+
+size_t ArchiveBlock::rows() const { return row_count; }
+
+bool ArchiveBlock::has(const std::string &column) const {
+  return string_columns.count(column) > 0 || integer_columns.count(column) > 0;
+}
+
+bool ArchiveBlock::isString(const std::string &column) const {
+  return string_columns.count(column) > 0;
+}
+
+const std::vector<std::string> &
+ArchiveBlock::strings(const std::string &column) const {
+  return string_columns.at(column);
+}
+
+const std::vector<int64_t> &
+ArchiveBlock::integers(const std::string &column) const {
+  return integer_columns.at(column);
+}
+
+ArchiveReader::ArchiveReader(const std::string &path,
+                             const std::set<std::string> &columns_)
+    : file(fopen(path.c_str(), "rb")), columns(columns_) {}
+
+ArchiveReader::~ArchiveReader() {
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+bool ArchiveReader::good() const { return file != nullptr; }
+
+bool ArchiveReader::next(ArchiveBlock &block) {
+  if (file == nullptr) {
+    return false;
+  }
+  char magic[sizeof(block_magic)];
+  uint32_t row_count;
+  uint32_t column_count;
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      std::string(magic, sizeof(magic)) !=
+          std::string(block_magic, sizeof(block_magic)) ||
+      !getU32(file, row_count) || !getU32(file, column_count)) {
+    return false;
+  }
+  block.row_count = row_count;
+  block.string_columns.clear();
+  block.integer_columns.clear();
+
+  for (uint32_t c = 0; c < column_count; c++) {
+    int name_length = fgetc(file);
+    if (name_length == EOF) {
+      return false;
+    }
+    std::string name(name_length, '\0');
+    int type = EOF;
+    uint32_t raw_length;
+    uint32_t compressed_length;
+    if (fread(&name[0], 1, name_length, file) != (size_t)name_length ||
+        (type = fgetc(file)) == EOF || !getU32(file, raw_length) ||
+        !getU32(file, compressed_length)) {
+      return false;
+    }
+    if (!columns.empty() && columns.count(name) == 0) {
+      if (fseek(file, compressed_length, SEEK_CUR) != 0) {
+        return false;
+      }
+      continue;
+    }
+
+    std::string compressed(compressed_length, '\0');
+    std::string data(raw_length, '\0');
+    uLongf data_length = raw_length;
+    if (fread(&compressed[0], 1, compressed_length, file) !=
+            compressed_length ||
+        uncompress((Bytef *)&data[0], &data_length,
+                   (const Bytef *)compressed.data(),
+                   compressed_length) != Z_OK) {
+      return false;
+    }
+
+    size_t offset = 0;
+    uint64_t value;
+    if (type == ArchiveBlock::String) {
+      auto &output = block.string_columns[name];
+      while (output.size() < row_count && getVarint(data, offset, value) &&
+             offset + value <= data.size()) {
+        output.push_back(data.substr(offset, value));
+        offset += value;
+      }
+      output.resize(row_count);
+    } else {
+      auto &output = block.integer_columns[name];
+      while (output.size() < row_count && getVarint(data, offset, value)) {
+        output.push_back((int64_t)(value >> 1) ^ -(int64_t)(value & 1));
+      }
+      output.resize(row_count);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// Archive segments hold finished jobs in a compressed, column-oriented form
+// so they can be analysed without touching the live database.
+//
+// A segment is a file per day named jobs-YYYY-MM-DD.dwa containing any number
+// of blocks, only ever appended to. Each block is:
+//
+//   "DWA1" row count (u32) column count (u32)
+//   for each column:
+//     name length (u8) name type (u8) raw length (u32) compressed length (u32)
+//     zlib compressed data
+//
+// Integers are little-endian. String columns are a varint length followed by
+// the bytes for each row; integer columns are zig-zag varints. A reader can
+// skip any column it doesn't want without decompressing it. A block cut short
+// by a crash is ignored, and cut off before anything more is appended.
+
+struct ArchiveRecord {
+  std::string key;
+  std::string drmaa;
+  std::string status;
+  std::string job_name;
+  std::string job_category;
+  int64_t finished_at;
+  // -1 if the job did not exit normally or it was never reported
+  int64_t exit_status;
+  std::string signal;
+  bool aborted;
+};
+
+class ArchiveWriter {
+public:
+  explicit ArchiveWriter(const std::string &directory);
+  ~ArchiveWriter();
+
+  void append(const ArchiveRecord &record);
+  void flush();
+
+  size_t archived() const;
+
+private:
+  void writeBlock(const std::string &day,
+                  const std::vector<ArchiveRecord> &records);
+
+  std::string directory;
+  std::mutex lock;
+  std::vector<ArchiveRecord> pending;
+  // Segments whose ends have been checked for a block cut short
+  std::set<std::string> checked;
+  std::atomic<size_t> written;
+};
+
+class ArchiveBlock {
+public:
+  enum type { String = 0, Integer = 1 };
+
+  size_t rows() const;
+  bool has(const std::string &column) const;
+  bool isString(const std::string &column) const;
+  const std::vector<std::string> &strings(const std::string &column) const;
+  const std::vector<int64_t> &integers(const std::string &column) const;
+
+private:
+  friend class ArchiveReader;
+  size_t row_count;
+  std::map<std::string, std::vector<std::string>> string_columns;
+  std::map<std::string, std::vector<int64_t>> integer_columns;
+};
+
+class ArchiveReader {
+public:
+  // Only the named columns are decompressed; if empty, all columns are
+  ArchiveReader(const std::string &path, const std::set<std::string> &columns);
+  ~ArchiveReader();
+
+  bool good() const;
+  bool next(ArchiveBlock &block);
+
+private:
+  FILE *file;
+  std::set<std::string> columns;
+};
+
+extern const std::vector<std::pair<std::string, ArchiveBlock::type>>
+    archive_columns;
@@ -0,0 +1,197 @@
+#include <unordered_map>
+#include "arrayjobs.hpp"
+#include "drmaapp.hpp"
+
+static const size_t no_field = (size_t)-1;
+// The wrapper script is passed to the shell as a single argument, and Linux
+// won't exec anything with an argument longer than 128 KiB
+static const size_t max_script = 128 * 1024 - 1;
+
+static const std::vector<std::string> &values(const JobRequest &job,
+                                              const std::string &name) {
+  static const std::vector<std::string> none;
+  auto it = job.v_attributes().find(name);
+  return it == job.v_attributes().end() ? none : it->second;
+}
+
+// Everything that has to match for two submissions to share an array job
+static std::string shape(const JobRequest &job) {
+  std::string output;
+  for (auto &attr : job.attributes()) {
+    if (attr.first == drmaa::job_name) {
+      continue;
+    }
+    output += attr.first + '\0' + attr.second + '\0';
+  }
+  for (auto &attr : job.v_attributes()) {
+    output += attr.first + '\1';
+    if (attr.first == drmaa::v_argv || attr.first == drmaa::v_env) {
+      output += std::to_string(attr.second.size()) + '\0';
+      continue;
+    }
+    for (auto &value : attr.second) {
+      output += value + '\0';
+    }
+  }
+  return output;
+}
+
+// Find the one element of the argument list or environment where two
+// submissions of the same shape differ, counting through the arguments and
+// then the environment. Returns false if they differ in more than one.
+static bool difference(const JobRequest &a, const JobRequest &b,
+                       size_t &field) {
+  field = no_field;
+  size_t position = 0;
+  for (auto name : {&drmaa::v_argv, &drmaa::v_env}) {
+    auto &left = values(a, *name);
+    auto &right = values(b, *name);
+    for (size_t i = 0; i < left.size(); i++, position++) {
+      if (left[i] != right[i]) {
+        if (field != no_field) {
+          return false;
+        }
+        field = position;
+      }
+    }
+  }
+  return true;
+}
+
+static std::string quote(const std::string &value) {
+  std::string output = "'";
+  for (auto c : value) {
+    if (c == '\'') {
+      output += "'\\''";
+    } else {
+      output += c;
+    }
+  }
+  return output + "'";
+}
+
+// Room the fixed parts of the wrapper script take up: the case and its
+// fallback, the command and the arguments that don't vary
+static size_t scriptSize(const JobRequest &job,
+                         const std::string &task_variable) {
+  auto size = 3 * task_variable.size() + 128 +
+              quote(job.attributes().at(drmaa::remote_command)).size();
+  for (auto &arg : values(job, drmaa::v_argv)) {
+    size += quote(arg).size() + 1;
+  }
+  return size;
+}
+
+// Room one task's line of the case takes up
+static size_t taskSize(const JobRequest &job, size_t field) {
+  auto &argv = values(job, drmaa::v_argv);
+  auto &value = field < argv.size()
+                    ? argv[field]
+                    : values(job, drmaa::v_env)[field - argv.size()];
+  return quote(value).size() + 48;
+}
+
+// Build a job that runs the original command with each task's value of the
+// field that varies, chosen by a case on the task id
+static JobRequest wrap(const std::vector<const JobRequest *> &jobs,
+                       const std::vector<size_t> &members, size_t field,
+                       const std::string &task_variable) {
+  auto &first = *jobs[members[0]];
+  JobRequest output = first;
+  if (field == no_field) {
+    // Only the names differ, so every task is the same
+    return output;
+  }
+  auto argv = values(first, drmaa::v_argv);
+  auto env = values(first, drmaa::v_env);
+  auto in_env = field >= argv.size();
+  auto index = in_env ? field - argv.size() : field;
+
+  std::string script = "case \"$" + task_variable + "\" in\n";
+  for (size_t task = 0; task < members.size(); task++) {
+    auto &varying =
+        values(*jobs[members[task]], in_env ? drmaa::v_env : drmaa::v_argv);
+    script += std::to_string(task + 1) +
+              ") drmaaws_value=" + quote(varying[index]) + " ;;\n";
+  }
+  script += "*) echo \"drmaaws: no task $" + task_variable +
+            " in this array\" >&2; exit 1 ;;\nesac\nexec ";
+  if (in_env) {
+    script += "env \"$drmaaws_value\" ";
+    env.erase(env.begin() + index);
+  }
+  script += quote(first.attributes().at(drmaa::remote_command));
+  for (size_t i = 0; i < argv.size(); i++) {
+    script += " ";
+    script += !in_env && i == index ? "\"$drmaaws_value\"" : quote(argv[i]);
+  }
+
+  output.attributes()[drmaa::remote_command] = "/bin/sh";
+  output.v_attributes()[drmaa::v_argv] = {"-c", script};
+  if (env.empty()) {
+    output.v_attributes().erase(drmaa::v_env);
+  } else {
+    output.v_attributes()[drmaa::v_env] = env;
+  }
+  return output;
+}
+
+std::vector<ArrayJob> coalesce(const std::vector<const JobRequest *> &jobs,
+                               size_t max_tasks,
+                               const std::string &task_variable) {
+  std::vector<ArrayJob> output;
+  // Submissions by shape, with the shapes in the order they were first seen
+  std::unordered_map<std::string, std::vector<size_t>> shapes;
+  std::vector<std::string> order;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (jobs[i]->attributes().count(drmaa::remote_command) == 0) {
+      output.push_back({*jobs[i], {i}});
+      continue;
+    }
+    auto key = shape(*jobs[i]);
+    auto &similar = shapes[key];
+    if (similar.empty()) {
+      order.push_back(key);
+    }
+    similar.push_back(i);
+  }
+
+  for (auto &key : order) {
+    auto &similar = shapes[key];
+    std::vector<bool> taken(similar.size(), false);
+    for (size_t a = 0; a < similar.size(); a++) {
+      if (taken[a]) {
+        continue;
+      }
+      std::vector<size_t> members{similar[a]};
+      auto field = no_field;
+      auto size = scriptSize(*jobs[similar[a]], task_variable);
+      for (size_t b = a + 1; b < similar.size() && members.size() < max_tasks;
+           b++) {
+        size_t differs;
+        if (taken[b] ||
+            !difference(*jobs[similar[a]], *jobs[similar[b]], differs) ||
+            (differs != no_field && field != no_field && differs != field)) {
+          continue;
+        }
+        if (differs != no_field) {
+          // Once something varies, every task needs its own line; anything
+          // that would make the script too long starts an array of its own
+          auto added = taskSize(*jobs[similar[b]], differs);
+          if (field == no_field) {
+            added += members.size() * taskSize(*jobs[similar[a]], differs);
+          }
+          if (size + added > max_script) {
+            continue;
+          }
+          size += added;
+          field = differs;
+        }
+        taken[b] = true;
+        members.push_back(similar[b]);
+      }
+      output.push_back({wrap(jobs, members, field, task_variable), members});
+    }
+  }
+  return output;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "jobrequest.hpp"
+
+// Submissions that can go to DRMAA together as one array job
+struct ArrayJob {
+  // What to submit. For more than one member, this runs a wrapper that picks
+  // out each task's part by its task id.
+  JobRequest shape;
+  // Positions of the submissions that make up the array, in task order
+  std::vector<size_t> members;
+};
+
+// Group submissions that are the same apart from their job name and one element
+// of their argument list or environment into array jobs of at most max_tasks
+// tasks, numbered from 1. task_variable is the environment variable that holds
+// the task id. Submissions that can't be grouped come back on their own.
+std::vector<ArrayJob> coalesce(const std::vector<const JobRequest *> &jobs,
+                               size_t max_tasks,
+                               const std::string &task_variable);
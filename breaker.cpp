@@ -0,0 +1,68 @@
+#include <iostream>
+#include "breaker.hpp"
+
+CircuitBreaker::CircuitBreaker(const std::string &name_, size_t threshold_,
+                               std::chrono::milliseconds slow_,
+                               std::chrono::milliseconds probe_interval_,
+                               const std::function<bool()> &check_,
+                               const std::function<void()> &recovered_)
+    : name(name_), threshold(threshold_), slow(slow_),
+      probe_interval(probe_interval_), check(check_), recovered(recovered_),
+      open(false), opened(0), failures(0), stopping(false),
+      prober(&CircuitBreaker::probe, this) {}
+
+CircuitBreaker::~CircuitBreaker() {
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  prober.join();
+}
+
+bool CircuitBreaker::closed() const { return !open; }
+
+size_t CircuitBreaker::trips() const { return opened; }
+
+void CircuitBreaker::record(std::chrono::steady_clock::time_point started,
+                            bool reachable) {
+  auto took = std::chrono::steady_clock::now() - started;
+  std::unique_lock<std::mutex> guard(lock);
+  if (reachable && took < slow) {
+    failures = 0;
+    return;
+  }
+  if (++failures < threshold || open) {
+    return;
+  }
+  open = true;
+  opened++;
+  std::cerr << name << " has failed " << failures
+            << " times in a row; answering from the cache until it recovers"
+            << std::endl;
+  wake.notify_all();
+}
+
+void CircuitBreaker::probe() {
+  std::unique_lock<std::mutex> guard(lock);
+  while (!stopping) {
+    if (!open) {
+      wake.wait(guard, [this] { return stopping || open; });
+      continue;
+    }
+    if (wake.wait_for(guard, probe_interval, [this] { return stopping; })) {
+      return;
+    }
+    guard.unlock();
+    auto healthy = check();
+    guard.lock();
+    if (healthy) {
+      open = false;
+      failures = 0;
+      std::cerr << name << " has recovered" << std::endl;
+      guard.unlock();
+      recovered();
+      guard.lock();
+    }
+  }
+}
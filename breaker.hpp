@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Stops calls to something that keeps failing or being slow, so callers can
+// fall back to what they already know instead of waiting on it. After a run of
+// failures the breaker opens, and a background thread probes until the probe
+// succeeds, then closes it again.
+class CircuitBreaker {
+public:
+  // The name is what's being called, for logging
+  CircuitBreaker(const std::string &name, size_t threshold,
+                 std::chrono::milliseconds slow,
+                 std::chrono::milliseconds probe_interval,
+                 const std::function<bool()> &probe,
+                 const std::function<void()> &recovered);
+  ~CircuitBreaker();
+
+  // Whether calls should be made
+  bool closed() const;
+  // Report how a call that started at the given time went
+  void record(std::chrono::steady_clock::time_point started, bool reachable);
+  // How many times the breaker has opened
+  size_t trips() const;
+
+private:
+  void probe();
+
+  std::string name;
+  size_t threshold;
+  std::chrono::milliseconds slow;
+  std::chrono::milliseconds probe_interval;
+  std::function<bool()> check;
+  std::function<void()> recovered;
+  std::atomic<bool> open;
+  std::atomic<size_t> opened;
+  // Consecutive failed or slow calls
+  size_t failures;
+  bool stopping;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::thread prober;
+};
@@ -0,0 +1,218 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include "capture.hpp"
+
+static const char capture_magic[4] = {'D', 'W', 'C', '1'};
+
+static void putInt(std::string &output, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    output += (char)((value >> (8 * i)) & 0xFF);
+  }
+}
+
+static uint64_t getInt(const std::string &input, size_t offset, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)(unsigned char)input[offset + i] << (8 * i);
+  }
+  return value;
+}
+
+static void putVarint(std::string &output, uint64_t value) {
+  while (value >= 0x80) {
+    output += (char)((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  output += (char)value;
+}
+
+static bool getVarint(const std::string &input, size_t &offset,
+                      uint64_t &value) {
+  value = 0;
+  for (int shift = 0; offset < input.size() && shift < 64; shift += 7) {
+    unsigned char byte = input[offset++];
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void putString(std::string &output, const std::string &value) {
+  putVarint(output, value.size());
+  output += value;
+}
+
+static bool getString(const std::string &input, size_t &offset,
+                      std::string &value) {
+  uint64_t length;
+  if (!getVarint(input, offset, length) || length > input.size() - offset) {
+    return false;
+  }
+  value = input.substr(offset, length);
+  offset += length;
+  return true;
+}
+
+static size_t sizeOf(const CaptureRecord &record) {
+  auto size = record.method.size() + record.resource.size() +
+              record.body.size() + 32;
+  for (auto &header : record.headers) {
+    size += header.first.size() + header.second.size() + 4;
+  }
+  return size;
+}
+
+static void encode(std::string &output, const CaptureRecord &record) {
+  std::string fields;
+  putInt(fields, record.arrival, 8);
+  putInt(fields, record.latency, 4);
+  putInt(fields, record.status, 2);
+  putString(fields, record.method);
+  putString(fields, record.resource);
+  putVarint(fields, record.headers.size());
+  for (auto &header : record.headers) {
+    putString(fields, header.first);
+    putString(fields, header.second);
+  }
+  putString(fields, record.body);
+  putInt(output, fields.size(), 4);
+  output += fields;
+}
+
+CaptureWriter::CaptureWriter(const std::string &path)
+    : limit(64 << 20), pending_bytes(0), stopping(false), written(0),
+      lost(0) {
+  // It holds request bodies and their signatures, so it's only for us to read
+  auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  file = fd < 0 ? nullptr : fdopen(fd, "ab");
+  if (file == nullptr) {
+    auto error = errno;
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw std::runtime_error("Can't open capture file " + path + ": " +
+                             strerror(error));
+  }
+  fseek(file, 0, SEEK_END);
+  if (ftell(file) == 0) {
+    fwrite(capture_magic, 1, sizeof(capture_magic), file);
+    fflush(file);
+  }
+  auto buffer = getenv("DRMAAWS_CAPTURE_BUFFER");
+  if (buffer != nullptr && atol(buffer) > 0) {
+    limit = atol(buffer);
+  }
+  writer = std::thread(&CaptureWriter::write, this);
+}
+
+CaptureWriter::~CaptureWriter() {
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    stopping = true;
+  }
+  ready.notify_one();
+  writer.join();
+  fclose(file);
+}
+
+void CaptureWriter::append(CaptureRecord &&record) {
+  auto size = sizeOf(record);
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    if (pending_bytes + size > limit) {
+      lost++;
+      return;
+    }
+    pending_bytes += size;
+    pending.push_back(std::move(record));
+  }
+  ready.notify_one();
+}
+
+size_t CaptureWriter::captured() const { return written; }
+
+size_t CaptureWriter::dropped() const { return lost; }
+
+void CaptureWriter::write() {
+  std::deque<CaptureRecord> batch;
+  std::string output;
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    ready.wait(guard, [this] { return stopping || !pending.empty(); });
+    if (pending.empty()) {
+      return;
+    }
+    // Encode and write whatever has built up in one go, without the lock
+    batch.swap(pending);
+    pending_bytes = 0;
+    guard.unlock();
+    output.clear();
+    for (auto &record : batch) {
+      encode(output, record);
+    }
+    fwrite(output.data(), 1, output.size(), file);
+    fflush(file);
+    written += batch.size();
+    batch.clear();
+    guard.lock();
+  }
+}
+
+CaptureReader::CaptureReader(const std::string &path) {
+  file = fopen(path.c_str(), "rb");
+  char magic[sizeof(capture_magic)];
+  if (file != nullptr &&
+      (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+       memcmp(magic, capture_magic, sizeof(magic)) != 0)) {
+    fclose(file);
+    file = nullptr;
+  }
+}
+
+CaptureReader::~CaptureReader() {
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+bool CaptureReader::good() const { return file != nullptr; }
+
+bool CaptureReader::next(CaptureRecord &record) {
+  if (file == nullptr) {
+    return false;
+  }
+  std::string input(4, '\0');
+  if (fread(&input[0], 1, 4, file) != 4) {
+    return false;
+  }
+  input.resize(getInt(input, 0, 4));
+  if (input.size() < 14 ||
+      fread(&input[0], 1, input.size(), file) != input.size()) {
+    return false;
+  }
+  record.arrival = getInt(input, 0, 8);
+  record.latency = getInt(input, 8, 4);
+  record.status = getInt(input, 12, 2);
+  size_t offset = 14;
+  uint64_t count;
+  if (!getString(input, offset, record.method) ||
+      !getString(input, offset, record.resource) ||
+      !getVarint(input, offset, count)) {
+    return false;
+  }
+  record.headers.clear();
+  for (uint64_t i = 0; i < count; i++) {
+    std::string name, value;
+    if (!getString(input, offset, name) || !getString(input, offset, value)) {
+      return false;
+    }
+    record.headers.emplace_back(std::move(name), std::move(value));
+  }
+  return getString(input, offset, record.body);
+}
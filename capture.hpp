@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A capture file records the requests a server was sent, so the same load can
+// be replayed against another one later.
+//
+// The file starts with "DWC1" and is followed by any number of records, only
+// ever appended to. Each record is:
+//
+//   record length (u32) arrival (i64) latency (u32) status (u16)
+//   method, resource, header count, header names and values, body
+//
+// Integers are little-endian. Arrival is in microseconds since the epoch and
+// latency is in microseconds. Strings and the header count are varints, each
+// string followed by its bytes. A record cut short by a crash is ignored.
+
+struct CaptureRecord {
+  int64_t arrival;
+  uint32_t latency;
+  uint16_t status;
+  std::string method;
+  // The path and query string
+  std::string resource;
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::string body;
+};
+
+// Appends records on a thread of its own, so the request threads only queue
+// them. If the disk can't keep up, records are dropped rather than holding up
+// requests.
+class CaptureWriter {
+public:
+  // Throws std::runtime_error if the file can't be opened
+  explicit CaptureWriter(const std::string &path);
+  ~CaptureWriter();
+
+  void append(CaptureRecord &&record);
+
+  size_t captured() const;
+  size_t dropped() const;
+
+private:
+  void write();
+
+  FILE *file;
+  // The most bytes of records to hold waiting to be written
+  size_t limit;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<CaptureRecord> pending;
+  size_t pending_bytes;
+  bool stopping;
+  std::atomic<size_t> written;
+  std::atomic<size_t> lost;
+  std::thread writer;
+};
+
+class CaptureReader {
+public:
+  explicit CaptureReader(const std::string &path);
+  ~CaptureReader();
+
+  bool good() const;
+  bool next(CaptureRecord &record);
+
+private:
+  FILE *file;
+};
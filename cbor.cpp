@@ -0,0 +1,235 @@
+#include <cstring>
+#include "cbor.hpp"
+
+enum major_type {
+  UnsignedType = 0,
+  NegativeType = 1,
+  BytesType = 2,
+  TextType = 3,
+  ArrayType = 4,
+  MapType = 5,
+  SimpleType = 7
+};
+
+static const int indefinite = 31;
+static const uint8_t break_code = 0xFF;
+
+CborError::CborError(const std::string &what) : std::runtime_error(what) {}
+
+namespace {
+class Reader {
+public:
+  explicit Reader(const std::string &data_) : data(data_), offset(0) {}
+
+  bool atEnd() const { return offset == data.size(); }
+
+  // Whether the next byte ends an indefinite length item, consuming it if so
+  bool atBreak() {
+    if (offset < data.size() && (uint8_t)data[offset] == break_code) {
+      offset++;
+      return true;
+    }
+    return false;
+  }
+
+  // Read the start of an item, returning its major type. For strings, arrays
+  // and maps, length is -1 if the length is indefinite.
+  int head(int64_t &length) {
+    auto initial = byte();
+    auto info = initial & 0x1F;
+    if (info < 24) {
+      length = info;
+    } else if (info <= 27) {
+      uint64_t value = 0;
+      for (int i = 0; i < 1 << (info - 24); i++) {
+        value = value << 8 | byte();
+      }
+      if (value > data.size()) {
+        // Nothing that long can fit in what's left
+        throw CborError("CBOR length is too large.");
+      }
+      length = value;
+    } else if (info == indefinite) {
+      length = -1;
+    } else {
+      throw CborError("Invalid CBOR.");
+    }
+    return initial >> 5;
+  }
+
+  std::string text() {
+    int64_t length;
+    if (head(length) != TextType) {
+      throw CborError("Element in array is not a string.");
+    }
+    if (length >= 0) {
+      return take(length);
+    }
+    // Indefinite length strings are a series of definite length chunks
+    std::string value;
+    while (!atBreak()) {
+      int64_t chunk;
+      if (head(chunk) != TextType || chunk < 0) {
+        throw CborError("Invalid CBOR string.");
+      }
+      value += take(chunk);
+    }
+    return value;
+  }
+
+  // The next item's major type, without reading it
+  int peek() const {
+    if (offset >= data.size()) {
+      throw CborError("CBOR is cut short.");
+    }
+    return (uint8_t)data[offset] >> 5;
+  }
+
+private:
+  uint8_t byte() {
+    if (offset >= data.size()) {
+      throw CborError("CBOR is cut short.");
+    }
+    return data[offset++];
+  }
+
+  std::string take(int64_t length) {
+    if ((uint64_t)length > data.size() - offset) {
+      throw CborError("CBOR is cut short.");
+    }
+    auto value = data.substr(offset, length);
+    offset += length;
+    return value;
+  }
+
+  const std::string &data;
+  size_t offset;
+};
+}
+
+// Read an array of strings whose head has already been read
+static std::vector<std::string> readArray(Reader &reader, int64_t length) {
+  std::vector<std::string> items;
+  for (int64_t i = 0; length < 0 ? !reader.atBreak() : i < length; i++) {
+    items.push_back(reader.text());
+  }
+  return items;
+}
+
+void readJob(const std::string &data, JobRequest &job) {
+  Reader reader(data);
+  int64_t length;
+  if (reader.head(length) != MapType) {
+    throw CborError("Request is not a CBOR map.");
+  }
+  for (int64_t i = 0; length < 0 ? !reader.atBreak() : i < length; i++) {
+    if (reader.peek() != TextType) {
+      throw CborError("Attribute name is not a string.");
+    }
+    auto name = reader.text();
+    switch (reader.peek()) {
+    case TextType:
+      job.attributes()[name] = reader.text();
+      break;
+    case ArrayType: {
+      int64_t items;
+      reader.head(items);
+      job.v_attributes()[name] = readArray(reader, items);
+      break;
+    }
+    default:
+      throw CborError("Argument must be array or string.");
+    }
+  }
+  if (!reader.atEnd()) {
+    throw CborError("Unexpected data after CBOR map.");
+  }
+}
+
+std::vector<std::string> readStrings(const std::string &data) {
+  Reader reader(data);
+  int64_t length;
+  if (reader.head(length) != ArrayType) {
+    throw CborError("Request is not a CBOR array.");
+  }
+  auto items = readArray(reader, length);
+  if (!reader.atEnd()) {
+    throw CborError("Unexpected data after CBOR array.");
+  }
+  return items;
+}
+
+std::string writeJob(const JobRequest &job) {
+  CborWriter writer;
+  writer.map(job.attributes().size() + job.v_attributes().size());
+  for (auto &attribute : job.attributes()) {
+    writer.text(attribute.first).text(attribute.second);
+  }
+  for (auto &attribute : job.v_attributes()) {
+    writer.text(attribute.first).array(attribute.second.size());
+    for (auto &item : attribute.second) {
+      writer.text(item);
+    }
+  }
+  return writer.str();
+}
+
+void CborWriter::head(int type, uint64_t value) {
+  auto initial = (char)(type << 5);
+  if (value < 24) {
+    output += (char)(initial | value);
+    return;
+  }
+  // Additional information 24 to 27 say the value follows in 1 to 8 bytes
+  int size = 0;
+  while (size < 3 && value >> (8 << size) != 0) {
+    size++;
+  }
+  output += (char)(initial | (24 + size));
+  for (int i = (1 << size) - 1; i >= 0; i--) {
+    output += (char)(value >> (8 * i));
+  }
+}
+
+CborWriter &CborWriter::map(size_t size) {
+  head(MapType, size);
+  return *this;
+}
+
+CborWriter &CborWriter::array(size_t size) {
+  head(ArrayType, size);
+  return *this;
+}
+
+CborWriter &CborWriter::text(const std::string &value) {
+  head(TextType, value.size());
+  output += value;
+  return *this;
+}
+
+CborWriter &CborWriter::number(double value) {
+  // Whole numbers go as integers, which is how most clients will want them
+  if (value >= -9.2e18 && value <= 9.2e18 && value == (double)(int64_t)value) {
+    auto whole = (int64_t)value;
+    if (whole >= 0) {
+      head(UnsignedType, whole);
+    } else {
+      head(NegativeType, -1 - whole);
+    }
+    return *this;
+  }
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  output += (char)(SimpleType << 5 | 27);
+  for (int i = 7; i >= 0; i--) {
+    output += (char)(bits >> (8 * i));
+  }
+  return *this;
+}
+
+CborWriter &CborWriter::null() {
+  output += (char)0xF6;
+  return *this;
+}
+
+const std::string &CborWriter::str() const { return output; }
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "jobrequest.hpp"
+
+// Just enough CBOR (RFC 7049) for clients that would rather not produce and
+// parse JSON: the same shapes the JSON API uses, as text strings, arrays,
+// maps, numbers and null. Both definite and indefinite lengths are read;
+// definite lengths are written.
+
+class CborError : public std::runtime_error {
+public:
+  explicit CborError(const std::string &what);
+};
+
+// A job, as a map from attribute names to text strings or arrays of them.
+// Throws CborError if the data isn't one.
+void readJob(const std::string &data, JobRequest &job);
+// An array of text strings
+std::vector<std::string> readStrings(const std::string &data);
+// The other way round from readJob
+std::string writeJob(const JobRequest &job);
+
+class CborWriter {
+public:
+  CborWriter &map(size_t size);
+  CborWriter &array(size_t size);
+  CborWriter &text(const std::string &value);
+  CborWriter &number(double value);
+  CborWriter &null();
+
+  const std::string &str() const;
+
+private:
+  void head(int type, uint64_t value);
+
+  std::string output;
+};
@@ -0,0 +1,182 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include "clusters.hpp"
+#include "drmaa.h"
+
+const std::string cluster_attribute = "drmaaws_cluster";
+
+// How long to leave a cluster alone after it couldn't be reached
+static const std::chrono::seconds unreachable_for(30);
+
+// How much each submission moves the average time to submit
+static const double latency_weight = 0.2;
+
+Clusters::Clusters(const std::shared_ptr<drmaa::session> &session)
+    : policy(Depth) {
+  clusters.push_back({"", session, 0, 0, {}});
+}
+
+Clusters::Clusters(const std::string &list) throw(drmaa::exception)
+    : policy(Depth) {
+  auto policy_name = getenv("DRMAAWS_CLUSTER_POLICY");
+  if (policy_name != nullptr && strcmp(policy_name, "latency") == 0) {
+    policy = Latency;
+  }
+  std::stringstream input(list);
+  std::string entry;
+  while (std::getline(input, entry, ',')) {
+    auto equals = entry.find('=');
+    auto name = entry.substr(0, equals);
+    auto contact =
+        equals == std::string::npos ? "" : entry.substr(equals + 1);
+    if (name.empty() || name.find(':') != std::string::npos ||
+        find(name) != nullptr) {
+      throw drmaa::exception(DRMAA_ERRNO_INVALID_ARGUMENT,
+                             ("Bad cluster name: " + name).c_str());
+    }
+    std::cerr << "Starting DRMAA worker for cluster " << name << std::endl;
+    clusters.push_back({name, drmaa::session::spawn(contact), 0, 0, {}});
+  }
+  if (clusters.empty()) {
+    throw drmaa::exception(DRMAA_ERRNO_INVALID_ARGUMENT, "No clusters given");
+  }
+}
+
+Clusters::Cluster *Clusters::find(const std::string &name) {
+  for (auto &cluster : clusters) {
+    if (cluster.name == name) {
+      return &cluster;
+    }
+  }
+  return nullptr;
+}
+
+std::string Clusters::place(const JobRequest &job) throw(drmaa::exception) {
+  std::unique_lock<std::mutex> guard(lock);
+  auto named = job.attributes().find(cluster_attribute);
+  if (named != job.attributes().end()) {
+    if (find(named->second) == nullptr) {
+      throw drmaa::exception(DRMAA_ERRNO_INVALID_ATTRIBUTE_VALUE,
+                             ("Unknown cluster " + named->second).c_str());
+    }
+    return named->second;
+  }
+  // If they're all unreachable, then we may as well try the best of them
+  auto now = std::chrono::steady_clock::now();
+  Cluster *best = nullptr;
+  bool best_reachable = false;
+  for (auto &cluster : clusters) {
+    auto reachable = cluster.unreachable_until <= now;
+    bool better;
+    if (best == nullptr || reachable != best_reachable) {
+      better = best == nullptr || reachable;
+    } else if (policy == Depth) {
+      better = cluster.depth < best->depth;
+    } else {
+      better = cluster.submit_seconds < best->submit_seconds;
+    }
+    if (better) {
+      best = &cluster;
+      best_reachable = reachable;
+    }
+  }
+  return best->name;
+}
+
+std::shared_ptr<drmaa::session> Clusters::session(const std::string &cluster) {
+  std::unique_lock<std::mutex> guard(lock);
+  auto found = find(cluster);
+  return found == nullptr ? nullptr : found->session;
+}
+
+std::string Clusters::qualify(const std::string &cluster,
+                              const std::string &drmaa_id) const {
+  return cluster == clusters[0].name ? drmaa_id : cluster + ":" + drmaa_id;
+}
+
+std::string Clusters::owner(const std::string &qualified,
+                            std::string &drmaa_id) const {
+  auto colon = qualified.find(':');
+  if (colon != std::string::npos) {
+    auto name = qualified.substr(0, colon);
+    for (auto &cluster : clusters) {
+      if (cluster.name == name) {
+        drmaa_id = qualified.substr(colon + 1);
+        return name;
+      }
+    }
+  }
+  drmaa_id = qualified;
+  return clusters[0].name;
+}
+
+drmaa::job Clusters::job(const std::string &qualified) throw(drmaa::exception) {
+  std::string drmaa_id;
+  auto cluster = session(owner(qualified, drmaa_id));
+  if (!cluster) {
+    throw drmaa::exception(DRMAA_ERRNO_INVALID_JOB, nullptr);
+  }
+  return drmaa::job(cluster, drmaa_id);
+}
+
+void Clusters::submitted(const std::string &cluster, size_t count,
+                         double seconds) {
+  std::unique_lock<std::mutex> guard(lock);
+  auto found = find(cluster);
+  if (found == nullptr) {
+    return;
+  }
+  found->depth += count;
+  auto &average = found->submit_seconds;
+  average = average == 0
+                ? seconds
+                : latency_weight * seconds + (1 - latency_weight) * average;
+}
+
+void Clusters::finished(const std::string &qualified) {
+  std::string drmaa_id;
+  auto cluster = owner(qualified, drmaa_id);
+  std::unique_lock<std::mutex> guard(lock);
+  auto found = find(cluster);
+  // Jobs from before a restart weren't counted
+  if (found != nullptr && found->depth > 0) {
+    found->depth--;
+  }
+}
+
+void Clusters::unreachable(const std::string &cluster) {
+  std::unique_lock<std::mutex> guard(lock);
+  auto found = find(cluster);
+  if (found != nullptr) {
+    found->unreachable_until =
+        std::chrono::steady_clock::now() + unreachable_for;
+  }
+}
+
+std::vector<ClusterStats> Clusters::stats() {
+  std::vector<ClusterStats> output;
+  std::unique_lock<std::mutex> guard(lock);
+  for (auto &cluster : clusters) {
+    output.push_back({cluster.name, cluster.depth, cluster.submit_seconds});
+  }
+  return output;
+}
+
+bool Clusters::reachable(const std::string &cluster) {
+  auto found = session(cluster);
+  if (!found) {
+    return false;
+  }
+  // Any answer at all about a job that doesn't exist means the DRM is there
+  try {
+    drmaa::job probe(found, "0");
+    *probe;
+  } catch (drmaa::exception &e) {
+    if (e.unreachable()) {
+      return false;
+    }
+  }
+  return true;
+}
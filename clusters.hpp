@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "drmaapp.hpp"
+#include "jobrequest.hpp"
+
+struct ClusterStats {
+  std::string name;
+  // Jobs submitted there that haven't finished yet
+  size_t depth;
+  // Average time to submit a job there, in seconds
+  double submit_seconds;
+};
+
+// The DRMs we can send jobs to, each with a session of its own. Job ids from
+// every cluster but the first are qualified as cluster:id, so ids already
+// stored from a single cluster keep working when more are added after it.
+class Clusters {
+public:
+  // Just the one cluster, named "", with a session already open
+  explicit Clusters(const std::shared_ptr<drmaa::session> &session);
+  // Start a worker for each cluster in a list like a=contact,b=contact. An
+  // empty contact means the DRM's default. Must be called before any other
+  // threads are started.
+  explicit Clusters(const std::string &list) throw(drmaa::exception);
+
+  // Pick a cluster for a job: the one named by its drmaaws_cluster attribute,
+  // or else by the placement policy, avoiding any that were unreachable
+  // recently
+  std::string place(const JobRequest &job) throw(drmaa::exception);
+  std::shared_ptr<drmaa::session> session(const std::string &cluster);
+  std::string qualify(const std::string &cluster,
+                      const std::string &drmaa_id) const;
+  // Which cluster a qualified id is from, and its id there
+  std::string owner(const std::string &qualified, std::string &drmaa_id) const;
+  drmaa::job job(const std::string &qualified) throw(drmaa::exception);
+
+  void submitted(const std::string &cluster, size_t count, double seconds);
+  void finished(const std::string &qualified);
+  void unreachable(const std::string &cluster);
+  std::vector<ClusterStats> stats();
+  // Whether a cluster answers at all
+  bool reachable(const std::string &cluster);
+
+private:
+  struct Cluster {
+    std::string name;
+    std::shared_ptr<drmaa::session> session;
+    size_t depth;
+    // Moving average of the time taken to submit
+    double submit_seconds;
+    std::chrono::steady_clock::time_point unreachable_until;
+  };
+
+  // Returns nullptr if there's no such cluster
+  Cluster *find(const std::string &name);
+
+  std::vector<Cluster> clusters;
+  enum { Depth, Latency } policy;
+  std::mutex lock;
+};
+
+extern const std::string cluster_attribute;
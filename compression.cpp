@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#include "compression.hpp"
+
+static const size_t buffer_size = 64 * 1024;
+// zlib's window size, plus 16 for a gzip header and trailer
+static const int gzip_window = 15 + 16;
+
+enum { Continue, Flush, End };
+
+const char *encodingName(Encoding encoding) {
+  switch (encoding) {
+  case Encoding::Gzip:
+    return "gzip";
+  case Encoding::Zstd:
+    return "zstd";
+  default:
+    return "identity";
+  }
+}
+
+Encoding negotiate(const std::string &accept) {
+  // Take whichever the client likes best, preferring zstd on a tie since it
+  // is cheaper for both of us
+  auto best = Encoding::Identity;
+  double best_quality = 0;
+  std::istringstream items(accept);
+  std::string item;
+  while (std::getline(items, item, ',')) {
+    auto semicolon = item.find(';');
+    auto name = item.substr(0, semicolon);
+    name.erase(0, name.find_first_not_of(" \t"));
+    name.erase(name.find_last_not_of(" \t") + 1);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    double quality = 1;
+    if (semicolon != std::string::npos) {
+      auto q = item.find("q=", semicolon);
+      if (q != std::string::npos) {
+        quality = atof(item.c_str() + q + 2);
+      }
+    }
+    auto encoding = Encoding::Identity;
+    if (name == "gzip" || name == "x-gzip") {
+      encoding = Encoding::Gzip;
+#ifdef WITH_ZSTD
+    } else if (name == "zstd") {
+      encoding = Encoding::Zstd;
+#endif
+    } else {
+      continue;
+    }
+    if (quality <= 0) {
+      continue;
+    }
+    if (quality > best_quality ||
+        (quality == best_quality && encoding == Encoding::Zstd)) {
+      best = encoding;
+      best_quality = quality;
+    }
+  }
+  return best;
+}
+
+bool isZstd(const std::string &body) {
+  return body.size() >= 4 && body.compare(0, 4, "\x28\xB5\x2F\xFD") == 0;
+}
+
+static std::string inflateBody(const std::string &input, size_t limit) {
+  z_stream stream{};
+  if (inflateInit2(&stream, gzip_window) != Z_OK) {
+    throw std::runtime_error("Cannot start decompressing.");
+  }
+  stream.next_in = (Bytef *)input.data();
+  stream.avail_in = input.size();
+  std::string output;
+  std::vector<char> buffer(buffer_size);
+  int result;
+  do {
+    stream.next_out = (Bytef *)buffer.data();
+    stream.avail_out = buffer.size();
+    result = inflate(&stream, Z_NO_FLUSH);
+    if (result == Z_BUF_ERROR && stream.avail_in == 0) {
+      // It stopped short
+      break;
+    }
+    if (result != Z_OK && result != Z_STREAM_END) {
+      inflateEnd(&stream);
+      throw std::runtime_error("Body is not valid gzip.");
+    }
+    output.append(buffer.data(), buffer.size() - stream.avail_out);
+    if (output.size() > limit) {
+      inflateEnd(&stream);
+      throw std::length_error("Body is too large.");
+    }
+  } while (result != Z_STREAM_END);
+  inflateEnd(&stream);
+  if (result != Z_STREAM_END) {
+    throw std::runtime_error("Body is not valid gzip.");
+  }
+  return output;
+}
+
+#ifdef WITH_ZSTD
+static std::string decompressZstd(const std::string &input, size_t limit) {
+  auto stream = ZSTD_createDCtx();
+  if (stream == nullptr) {
+    throw std::runtime_error("Cannot start decompressing.");
+  }
+  ZSTD_inBuffer in{input.data(), input.size(), 0};
+  std::string output;
+  std::vector<char> buffer(buffer_size);
+  size_t result;
+  bool more;
+  do {
+    ZSTD_outBuffer out{buffer.data(), buffer.size(), 0};
+    result = ZSTD_decompressStream(stream, &out, &in);
+    if (ZSTD_isError(result)) {
+      ZSTD_freeDCtx(stream);
+      throw std::runtime_error(std::string("Body is not valid zstd: ") +
+                               ZSTD_getErrorName(result));
+    }
+    output.append(buffer.data(), out.pos);
+    if (output.size() > limit) {
+      ZSTD_freeDCtx(stream);
+      throw std::length_error("Body is too large.");
+    }
+    // A full buffer may mean there is more to come out
+    more = in.pos < in.size || out.pos == out.size;
+  } while (more);
+  ZSTD_freeDCtx(stream);
+  // Anything other than 0 means the last frame was cut short
+  if (result != 0) {
+    throw std::runtime_error("Body is not valid zstd.");
+  }
+  return output;
+}
+#endif
+
+std::string decompress(Encoding encoding, const std::string &input,
+                       size_t limit) {
+  switch (encoding) {
+  case Encoding::Identity:
+    if (input.size() > limit) {
+      throw std::length_error("Body is too large.");
+    }
+    return input;
+  case Encoding::Gzip:
+    return inflateBody(input, limit);
+#ifdef WITH_ZSTD
+  case Encoding::Zstd:
+    return decompressZstd(input, limit);
+#endif
+  default:
+    throw std::runtime_error("Unsupported content encoding.");
+  }
+}
+
+Compressor::Compressor(Encoding encoding_)
+    : encoding(encoding_), stream(nullptr) {
+  switch (encoding) {
+  case Encoding::Gzip: {
+    auto zstream = new z_stream{};
+    if (deflateInit2(zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, gzip_window,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      delete zstream;
+      throw std::runtime_error("Cannot start compressing.");
+    }
+    stream = zstream;
+    break;
+  }
+#ifdef WITH_ZSTD
+  case Encoding::Zstd:
+    stream = ZSTD_createCCtx();
+    if (stream == nullptr) {
+      throw std::runtime_error("Cannot start compressing.");
+    }
+    break;
+#endif
+  case Encoding::Identity:
+    break;
+  default:
+    throw std::runtime_error("Unsupported content encoding.");
+  }
+}
+
+Compressor::~Compressor() {
+  switch (encoding) {
+  case Encoding::Gzip:
+    deflateEnd((z_stream *)stream);
+    delete (z_stream *)stream;
+    break;
+#ifdef WITH_ZSTD
+  case Encoding::Zstd:
+    ZSTD_freeCCtx((ZSTD_CCtx *)stream);
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+std::string Compressor::run(const char *data, size_t length, int mode) {
+  std::string output;
+  std::vector<char> buffer(buffer_size);
+  switch (encoding) {
+  case Encoding::Gzip: {
+    auto zstream = (z_stream *)stream;
+    zstream->next_in = (Bytef *)data;
+    zstream->avail_in = length;
+    auto flush = mode == End ? Z_FINISH : mode == Flush ? Z_SYNC_FLUSH
+                                                        : Z_NO_FLUSH;
+    // Keep going until deflate has room to spare, so nothing is left inside
+    do {
+      zstream->next_out = (Bytef *)buffer.data();
+      zstream->avail_out = buffer.size();
+      deflate(zstream, flush);
+      output.append(buffer.data(), buffer.size() - zstream->avail_out);
+    } while (zstream->avail_out == 0);
+    break;
+  }
+#ifdef WITH_ZSTD
+  case Encoding::Zstd: {
+    ZSTD_inBuffer in{data, length, 0};
+    auto directive = mode == End ? ZSTD_e_end
+                                 : mode == Flush ? ZSTD_e_flush
+                                                 : ZSTD_e_continue;
+    size_t remaining;
+    do {
+      ZSTD_outBuffer out{buffer.data(), buffer.size(), 0};
+      remaining =
+          ZSTD_compressStream2((ZSTD_CCtx *)stream, &out, &in, directive);
+      if (ZSTD_isError(remaining)) {
+        throw std::runtime_error(ZSTD_getErrorName(remaining));
+      }
+      output.append(buffer.data(), out.pos);
+    } while (directive == ZSTD_e_continue ? in.pos < in.size : remaining > 0);
+    break;
+  }
+#endif
+  default:
+    if (length > 0) {
+      output.assign(data, length);
+    }
+  }
+  return output;
+}
+
+std::string Compressor::write(const std::string &data, bool flush) {
+  return run(data.data(), data.size(), flush ? Flush : Continue);
+}
+
+std::string Compressor::finish() { return run(nullptr, 0, End); }
+
+std::string compress(Encoding encoding, const std::string &input) {
+  Compressor compressor(encoding);
+  auto output = compressor.write(input, false);
+  return output + compressor.finish();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+
+// Content codings for request and response bodies. zstd is only available
+// when built with WITH_ZSTD.
+enum class Encoding { Identity, Gzip, Zstd };
+
+// The name used in Content-Encoding and Accept-Encoding headers
+const char *encodingName(Encoding encoding);
+// Pick the best encoding an Accept-Encoding header allows
+Encoding negotiate(const std::string &accept);
+// Whether a body starts like a zstd frame
+bool isZstd(const std::string &body);
+
+// Decompress a whole body, a piece at a time so it can be abandoned as soon as
+// it grows beyond limit. Throws std::length_error if it would, and
+// std::runtime_error if the body is damaged or the encoding unsupported.
+std::string decompress(Encoding encoding, const std::string &input,
+                       size_t limit);
+
+// Compresses a response that is sent in pieces
+class Compressor {
+public:
+  explicit Compressor(Encoding encoding);
+  ~Compressor();
+  Compressor(const Compressor &) = delete;
+  Compressor &operator=(const Compressor &) = delete;
+
+  // Compress some more, returning what can be sent so far; flushing makes
+  // sure the client can decompress everything written up to now
+  std::string write(const std::string &data, bool flush);
+  // End the stream, returning the rest of it
+  std::string finish();
+
+private:
+  std::string run(const char *data, size_t length, int mode);
+
+  Encoding encoding;
+  void *stream;
+};
+
+// Compress a whole body at once
+std::string compress(Encoding encoding, const std::string &input);
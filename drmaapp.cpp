@@ -1,22 +1,36 @@
+#include <cstdlib>
 #include <iostream>
 #include "drmaa.h"
 #include "drmaapp.hpp"
+#include "tracing.hpp"
 
 drmaa::exception::exception(int errcode_, const char *diagnosis_)
-    : diagnosis(diagnosis_ == nullptr ? drmaa_strerror(errcode_) : diagnosis_) {
+    : errcode(errcode_),
+      diagnosis(diagnosis_ == nullptr ? drmaa_strerror(errcode_) : diagnosis_) {
 }
 drmaa::exception::~exception() {}
 const char *drmaa::exception::what() const throw() { return diagnosis.c_str(); }
+int drmaa::exception::code() const { return errcode; }
+bool drmaa::exception::unreachable() const {
+  return errcode == DRMAA_ERRNO_DRM_COMMUNICATION_FAILURE ||
+         errcode == DRMAA_ERRNO_TRY_LATER ||
+         errcode == DRMAA_ERRNO_NO_ACTIVE_SESSION;
+}
 
-drmaa::session::session() throw(drmaa::exception) {
+drmaa::session::session(const std::string &contact) throw(drmaa::exception) {
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
-  int errcode = drmaa_init(nullptr, error_diagnosis, sizeof(error_diagnosis));
+  int errcode = drmaa_init(contact.empty() ? nullptr : contact.c_str(),
+                           error_diagnosis, sizeof(error_diagnosis));
   if (errcode != DRMAA_ERRNO_SUCCESS) {
     throw drmaa::exception(errcode, error_diagnosis);
   }
 }
 
 drmaa::session::~session() {
+  if (remote_worker) {
+    // The worker has the session, and closes it when we hang up
+    return;
+  }
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
   int errcode = drmaa_exit(error_diagnosis, sizeof(error_diagnosis));
   if (errcode != DRMAA_ERRNO_SUCCESS) {
@@ -28,8 +42,12 @@ drmaa::session::~session() {
 drmaa::job_template::job_template(
     std::shared_ptr<drmaa::session> &owner_) throw(drmaa::exception)
     : owner(owner_), impl(nullptr) {
+  if (owner->remote()) {
+    return;
+  }
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
   drmaa_job_template_t *jt;
+  tracing::Span span("drmaa_allocate_job_template");
   int errcode = drmaa_allocate_job_template(&jt, error_diagnosis,
                                             sizeof(error_diagnosis));
   if (errcode != DRMAA_ERRNO_SUCCESS) {
@@ -54,7 +72,8 @@ drmaa::job_template::~job_template() {
 std::string
 drmaa::job_template::get(const std::string &name) throw(drmaa::exception) {
   if (impl == nullptr) {
-    return "";
+    auto it = attributes.find(name);
+    return it == attributes.end() ? "" : it->second;
   }
 
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
@@ -71,7 +90,8 @@ drmaa::job_template::get(const std::string &name) throw(drmaa::exception) {
 std::vector<std::string>
 drmaa::job_template::getv(const std::string &name) throw(drmaa::exception) {
   if (impl == nullptr) {
-    return {};
+    auto it = v_attributes.find(name);
+    return it == v_attributes.end() ? std::vector<std::string>() : it->second;
   }
 
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
@@ -93,7 +113,12 @@ drmaa::job_template::getv(const std::string &name) throw(drmaa::exception) {
 
 void drmaa::job_template::set(
     const std::string &name, const std::string &value) throw(drmaa::exception) {
+  if (impl == nullptr) {
+    attributes[name] = value;
+    return;
+  }
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
+  tracing::Span span("drmaa_set_attribute");
   int errcode = drmaa_set_attribute((drmaa_job_template_t *)impl, name.c_str(),
                                     value.c_str(), error_diagnosis,
                                     sizeof(error_diagnosis));
@@ -105,6 +130,10 @@ void drmaa::job_template::set(
 void drmaa::job_template::setv(
     const std::string &name,
     const std::vector<std::string> &values) throw(drmaa::exception) {
+  if (impl == nullptr) {
+    v_attributes[name] = values;
+    return;
+  }
   const char *array[values.size() + 1];
   for (auto i = 0; i < values.size(); i++) {
     array[i] = values[i].c_str();
@@ -112,6 +141,7 @@ void drmaa::job_template::setv(
   array[values.size()] = nullptr;
 
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
+  tracing::Span span("drmaa_set_vector_attribute");
   int errcode = drmaa_set_vector_attribute((drmaa_job_template_t *)impl,
                                            name.c_str(), array, error_diagnosis,
                                            sizeof(error_diagnosis));
@@ -143,9 +173,36 @@ std::vector<std::string> drmaa::attribute_namesv() throw(drmaa::exception) {
   return getnames<&drmaa_get_vector_attribute_names>();
 }
 
+// A remote job template is sent as the number of attributes, then each name
+// and value, then the number of vector attributes, then each name, number of
+// values and the values
+static std::vector<std::string> remoteRequest(
+    std::vector<std::string> request,
+    const std::map<std::string, std::string> &attributes,
+    const std::map<std::string, std::vector<std::string>> &v_attributes) {
+  request.push_back(std::to_string(attributes.size()));
+  for (auto &attribute : attributes) {
+    request.push_back(attribute.first);
+    request.push_back(attribute.second);
+  }
+  request.push_back(std::to_string(v_attributes.size()));
+  for (auto &attribute : v_attributes) {
+    request.push_back(attribute.first);
+    request.push_back(std::to_string(attribute.second.size()));
+    request.insert(request.end(), attribute.second.begin(),
+                   attribute.second.end());
+  }
+  return request;
+}
+
 std::shared_ptr<drmaa::job> drmaa::job_template::run() throw(exception) {
+  if (impl == nullptr) {
+    auto reply = owner->call(remoteRequest({"run"}, attributes, v_attributes));
+    return std::make_shared<drmaa::job>(owner, reply.at(0));
+  }
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
   char id[DRMAA_JOBNAME_BUFFER];
+  tracing::Span span("drmaa_run_job");
   int errcode = drmaa_run_job(id, sizeof(id), (drmaa_job_template_t *)impl,
                               error_diagnosis, sizeof(error_diagnosis));
   if (errcode != DRMAA_ERRNO_SUCCESS) {
@@ -154,6 +211,37 @@ std::shared_ptr<drmaa::job> drmaa::job_template::run() throw(exception) {
   return std::make_shared<drmaa::job>(owner, id);
 }
 
+std::vector<std::shared_ptr<drmaa::job>>
+drmaa::job_template::run_bulk(int start, int end,
+                              int incr) throw(exception) {
+  std::vector<std::shared_ptr<drmaa::job>> output;
+  if (impl == nullptr) {
+    auto reply = owner->call(remoteRequest(
+        {"run_bulk", std::to_string(start), std::to_string(end),
+         std::to_string(incr)},
+        attributes, v_attributes));
+    for (auto &id : reply) {
+      output.push_back(std::make_shared<drmaa::job>(owner, id));
+    }
+    return output;
+  }
+  char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
+  drmaa_job_ids_t *ids;
+  tracing::Span span("drmaa_run_bulk_jobs");
+  int errcode = drmaa_run_bulk_jobs(&ids, (drmaa_job_template_t *)impl, start,
+                                    end, incr, error_diagnosis,
+                                    sizeof(error_diagnosis));
+  if (errcode != DRMAA_ERRNO_SUCCESS) {
+    throw drmaa::exception(errcode, error_diagnosis);
+  }
+  char id[DRMAA_JOBNAME_BUFFER];
+  while (drmaa_get_next_job_id(ids, id, sizeof(id)) == DRMAA_ERRNO_SUCCESS) {
+    output.push_back(std::make_shared<drmaa::job>(owner, id));
+  }
+  drmaa_release_job_ids(ids);
+  return output;
+}
+
 drmaa::job::job(std::shared_ptr<drmaa::session> &owner_, const char *id_)
     : owner(owner_), id(id_) {}
 
@@ -161,7 +249,11 @@ drmaa::job::job(std::shared_ptr<drmaa::session> &owner_, const std::string &id_)
     : owner(owner_), id(id_) {}
 
 bool drmaa::job::control(int action) throw(drmaa::exception) {
+  if (owner->remote()) {
+    return owner->call({"control", id, std::to_string(action)}).at(0) == "1";
+  }
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
+  tracing::Span span("drmaa_control");
   int errcode = drmaa_control(id.c_str(), action, error_diagnosis,
                               sizeof(error_diagnosis));
   switch (errcode) {
@@ -198,10 +290,15 @@ std::pair<drmaa::state, drmaa::reason> drmaa::job::
 operator*() throw(exception) {
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
   int ps;
-  int errcode =
-      drmaa_job_ps(id.c_str(), &ps, error_diagnosis, sizeof(error_diagnosis));
-  if (errcode != DRMAA_ERRNO_SUCCESS) {
-    throw drmaa::exception(errcode, error_diagnosis);
+  if (owner->remote()) {
+    ps = std::stoi(owner->call({"ps", id}).at(0));
+  } else {
+    tracing::Span span("drmaa_job_ps");
+    int errcode =
+        drmaa_job_ps(id.c_str(), &ps, error_diagnosis, sizeof(error_diagnosis));
+    if (errcode != DRMAA_ERRNO_SUCCESS) {
+      throw drmaa::exception(errcode, error_diagnosis);
+    }
   }
   switch (ps) {
   case DRMAA_PS_QUEUED_ACTIVE:
@@ -232,9 +329,10 @@ operator*() throw(exception) {
 drmaa::job_result::job_result(const char *name,
                               const std::pair<int, bool> &exit_status_,
                               const std::pair<std::string, bool> &signal_name_,
-                              bool aborted_)
+                              bool aborted_,
+                              const std::map<std::string, double> &rusage_)
     : id(name), exit_status(exit_status_), signal_name(signal_name_),
-      has_aborted(aborted_) {}
+      has_aborted(aborted_), rusage(rusage_) {}
 
 const std::pair<int, bool> &drmaa::job_result::exited() { return exit_status; }
 const std::pair<std::string, bool> &drmaa::job_result::signalled() {
@@ -243,14 +341,35 @@ const std::pair<std::string, bool> &drmaa::job_result::signalled() {
 bool drmaa::job_result::aborted() { return has_aborted; }
 
 const std::string &drmaa::job_result::name() { return id; }
+const std::map<std::string, double> &drmaa::job_result::usage() {
+  return rusage;
+}
 
 static std::shared_ptr<drmaa::job_result>
 wait_for_job(const char *ids,
              std::shared_ptr<drmaa::session> &owner) throw(drmaa::exception) {
+  if (owner->remote()) {
+    // The result comes back as the job id, exit status, whether it exited,
+    // signal, whether it was signalled, whether it was aborted, then the
+    // resource usage as names and values; nothing means it isn't finished
+    auto reply = owner->call({"wait", ids});
+    if (reply.size() < 6) {
+      return {};
+    }
+    std::map<std::string, double> usage;
+    for (size_t i = 6; i + 1 < reply.size(); i += 2) {
+      usage[reply[i]] = atof(reply[i + 1].c_str());
+    }
+    return std::make_shared<drmaa::job_result>(
+        reply[0].c_str(),
+        std::make_pair(atoi(reply[1].c_str()), reply[2] == "1"),
+        std::make_pair(reply[3], reply[4] == "1"), reply[5] == "1", usage);
+  }
   char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
   char id[DRMAA_JOBNAME_BUFFER];
   int stat;
   drmaa_attr_values_t *rusage = nullptr;
+  tracing::Span span("drmaa_wait");
   int errcode = drmaa_wait(ids, id, sizeof(id), &stat, DRMAA_TIMEOUT_NO_WAIT,
                            &rusage, error_diagnosis, sizeof(error_diagnosis));
   if (errcode == DRMAA_ERRNO_EXIT_TIMEOUT) {
@@ -260,7 +379,25 @@ wait_for_job(const char *ids,
     throw drmaa::exception(errcode, error_diagnosis);
   }
 
+  // The resource usage comes back as a list of name=value strings; keep
+  // anything that looks like a number and drop the rest
+  std::map<std::string, double> usage;
   if (rusage != nullptr) {
+    char current[DRMAA_ATTR_BUFFER];
+    while (drmaa_get_next_attr_value(rusage, current, sizeof(current)) ==
+           DRMAA_ERRNO_SUCCESS) {
+      std::string entry(current);
+      auto equals = entry.find('=');
+      if (equals == std::string::npos || equals == 0) {
+        continue;
+      }
+      const char *start = entry.c_str() + equals + 1;
+      char *end;
+      double value = strtod(start, &end);
+      if (end != start) {
+        usage[entry.substr(0, equals)] = value;
+      }
+    }
     drmaa_release_attr_values(rusage);
   }
   int exited;
@@ -310,7 +447,7 @@ wait_for_job(const char *ids,
   std::pair<int, bool> exit_state{exit_status, exited != 0};
   std::pair<std::string, bool> signal_state{signal_name, signalled != 0};
   return std::make_shared<drmaa::job_result>(id, exit_state, signal_state,
-                                             aborted != 0);
+                                             aborted != 0, usage);
 }
 
 std::shared_ptr<drmaa::job_result>
@@ -1,4 +1,5 @@
 #pragma once
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -10,8 +11,12 @@ public:
   explicit exception(int errcode, const char *diagnosis);
   ~exception() throw();
   const char *what() const throw();
+  int code() const;
+  // Whether the DRM couldn't be reached, rather than turning the request down
+  bool unreachable() const;
 
 private:
+  int errcode;
   std::string diagnosis;
 };
 
@@ -24,8 +29,28 @@ std::vector<std::string> attribute_namesv() throw(exception);
 
 class session {
 public:
-  session() throw(exception);
+  // A session with the DRM at contact, or the default one if it's empty
+  explicit session(const std::string &contact = "") throw(exception);
+  // Start a session in a worker process of its own, since DRMAA only allows
+  // one session per process. Everything done with it is sent to the worker.
+  // Must be called before any other threads are started.
+  static std::shared_ptr<session>
+  spawn(const std::string &contact) throw(exception);
   ~session();
+
+  bool remote() const;
+  // Make a call in the worker process; each request and reply is a list of
+  // strings, as handled by serve
+  std::vector<std::string>
+  call(const std::vector<std::string> &request) throw(exception);
+
+private:
+  struct worker;
+  explicit session(const std::shared_ptr<worker> &remote_worker);
+  // Answer calls from the parent on a socket until it is closed
+  static void serve(std::shared_ptr<session> &local, int channel);
+
+  std::shared_ptr<worker> remote_worker;
 };
 
 class job;
@@ -43,10 +68,16 @@ public:
             const std::vector<std::string> &values) throw(exception);
 
   std::shared_ptr<job> run() throw(exception);
+  // Submit an array job with a task for each index from start to end
+  std::vector<std::shared_ptr<job>> run_bulk(int start, int end,
+                                             int incr) throw(exception);
 
 private:
   std::shared_ptr<session> owner;
   void *impl;
+  // Kept here for a remote session, and sent along when the job is run
+  std::map<std::string, std::string> attributes;
+  std::map<std::string, std::vector<std::string>> v_attributes;
 };
 
 class job {
@@ -73,18 +104,21 @@ private:
 class job_result {
 public:
   job_result(const char *name, const std::pair<int, bool> &exit_status,
-             const std::pair<std::string, bool> &signal_name, bool aborted);
+             const std::pair<std::string, bool> &signal_name, bool aborted,
+             const std::map<std::string, double> &rusage);
 
   const std::pair<int, bool> &exited();
   const std::pair<std::string, bool> &signalled();
   bool aborted();
   const std::string &name();
+  const std::map<std::string, double> &usage();
 
 private:
   std::string id;
   std::pair<int, bool> exit_status;
   std::pair<std::string, bool> signal_name;
   bool has_aborted;
+  std::map<std::string, double> rusage;
 };
 
 std::shared_ptr<job_result>
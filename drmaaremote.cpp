@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include "cbor.hpp"
+#include "drmaa.h"
+#include "drmaapp.hpp"
+#include "env.hpp"
+#include "executor.hpp"
+
+// A remote session talks to a worker process over a socket pair. Every
+// message is a 4-byte big-endian length followed by a CBOR array of text
+// strings. Requests are [id, operation, arguments...] and replies are either
+// [id, "ok", results...] or [id, "error", code, diagnosis], so calls from
+// many threads can be in flight at once and answered in any order.
+
+namespace {
+// The parent's ends of the workers started so far, which later workers
+// shouldn't hold open
+std::vector<int> parent_channels;
+
+bool readFully(int fd, char *buffer, size_t length) {
+  while (length > 0) {
+    auto count = read(fd, buffer, length);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    buffer += count;
+    length -= count;
+  }
+  return true;
+}
+
+bool readFrame(int fd, std::vector<std::string> &message) {
+  uint32_t length;
+  if (!readFully(fd, (char *)&length, sizeof(length))) {
+    return false;
+  }
+  std::string data(ntohl(length), '\0');
+  if (!readFully(fd, &data[0], data.size())) {
+    return false;
+  }
+  message = readStrings(data);
+  return true;
+}
+
+bool writeFrame(int fd, const std::vector<std::string> &message) {
+  CborWriter writer;
+  writer.array(message.size());
+  for (auto &item : message) {
+    writer.text(item);
+  }
+  uint32_t length = htonl(writer.str().size());
+  auto data = std::string((char *)&length, sizeof(length)) + writer.str();
+  const char *buffer = data.data();
+  size_t remaining = data.size();
+  while (remaining > 0) {
+    auto count = send(fd, buffer, remaining, MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    buffer += count;
+    remaining -= count;
+  }
+  return true;
+}
+
+// The inverse of remoteRequest in drmaapp.cpp, starting from the given field
+void readTemplate(const std::vector<std::string> &request, size_t i,
+                  drmaa::job_template &jt) {
+  auto count = std::stoul(request.at(i++));
+  for (size_t a = 0; a < count; a++, i += 2) {
+    jt.set(request.at(i), request.at(i + 1));
+  }
+  count = std::stoul(request.at(i++));
+  for (size_t a = 0; a < count; a++) {
+    auto &name = request.at(i++);
+    auto values = std::stoul(request.at(i++));
+    if (i + values > request.size()) {
+      throw std::out_of_range("Vector attribute is cut short.");
+    }
+    jt.setv(name, std::vector<std::string>(request.begin() + i,
+                                           request.begin() + i + values));
+    i += values;
+  }
+}
+
+std::vector<std::string> handle(std::shared_ptr<drmaa::session> &local,
+                                const std::vector<std::string> &request) {
+  std::vector<std::string> reply{request.at(0), "ok"};
+  auto &operation = request.at(1);
+  if (operation == "run" || operation == "run_bulk") {
+    drmaa::job_template jt(local);
+    if (operation == "run") {
+      readTemplate(request, 2, jt);
+      reply.push_back(jt.run()->name());
+    } else {
+      readTemplate(request, 5, jt);
+      for (auto &job : jt.run_bulk(std::stoi(request.at(2)),
+                                   std::stoi(request.at(3)),
+                                   std::stoi(request.at(4)))) {
+        reply.push_back(job->name());
+      }
+    }
+  } else if (operation == "control") {
+    drmaa::job job(local, request.at(2));
+    bool changed;
+    switch (std::stoi(request.at(3))) {
+    case DRMAA_CONTROL_SUSPEND:
+      changed = job.suspend();
+      break;
+    case DRMAA_CONTROL_RESUME:
+      changed = job.resume();
+      break;
+    case DRMAA_CONTROL_HOLD:
+      changed = job.hold();
+      break;
+    case DRMAA_CONTROL_RELEASE:
+      changed = job.release();
+      break;
+    case DRMAA_CONTROL_TERMINATE:
+      changed = job.kill();
+      break;
+    default:
+      throw drmaa::exception(DRMAA_ERRNO_INVALID_ARGUMENT, nullptr);
+    }
+    reply.push_back(changed ? "1" : "0");
+  } else if (operation == "ps") {
+    char error_diagnosis[DRMAA_ERROR_STRING_BUFFER];
+    int ps;
+    int errcode = drmaa_job_ps(request.at(2).c_str(), &ps, error_diagnosis,
+                               sizeof(error_diagnosis));
+    if (errcode != DRMAA_ERRNO_SUCCESS) {
+      throw drmaa::exception(errcode, error_diagnosis);
+    }
+    reply.push_back(std::to_string(ps));
+  } else if (operation == "wait") {
+    std::shared_ptr<drmaa::job_result> result;
+    if (request.at(2) == DRMAA_JOB_IDS_SESSION_ANY) {
+      result = drmaa::wait(local);
+    } else {
+      result = drmaa::job(local, request.at(2)).wait();
+    }
+    if (result) {
+      reply.push_back(result->name());
+      reply.push_back(std::to_string(result->exited().first));
+      reply.push_back(result->exited().second ? "1" : "0");
+      reply.push_back(result->signalled().first);
+      reply.push_back(result->signalled().second ? "1" : "0");
+      reply.push_back(result->aborted() ? "1" : "0");
+      for (auto &usage : result->usage()) {
+        reply.push_back(usage.first);
+        reply.push_back(std::to_string(usage.second));
+      }
+    }
+  } else {
+    throw drmaa::exception(DRMAA_ERRNO_INVALID_ARGUMENT,
+                           ("Unknown operation " + operation).c_str());
+  }
+  return reply;
+}
+}
+
+struct drmaa::session::worker {
+  pid_t pid;
+  int channel;
+  // Taken to send a request; replies are read on a thread of their own
+  std::mutex write_lock;
+  std::once_flag reading;
+  std::thread reader;
+
+  std::mutex lock;
+  std::condition_variable replied;
+  uint64_t next_call;
+  bool gone;
+  std::set<uint64_t> waiting;
+  std::map<uint64_t, std::vector<std::string>> replies;
+
+  worker(pid_t pid_, int channel_)
+      : pid(pid_), channel(channel_), next_call(0), gone(false) {}
+
+  ~worker() {
+    // Hanging up tells the worker to finish, and stops the reader
+    shutdown(channel, SHUT_RDWR);
+    if (reader.joinable()) {
+      reader.join();
+    }
+    close(channel);
+    parent_channels.erase(
+        std::remove(parent_channels.begin(), parent_channels.end(), channel),
+        parent_channels.end());
+    int status;
+    waitpid(pid, &status, 0);
+  }
+
+  void read() {
+    std::vector<std::string> reply;
+    try {
+      while (readFrame(channel, reply)) {
+        std::unique_lock<std::mutex> guard(lock);
+        auto id = std::stoull(reply.at(0));
+        // Anything no one is waiting for any more timed out, so drop it
+        if (waiting.count(id)) {
+          replies[id] = std::move(reply);
+          replied.notify_all();
+        }
+      }
+    } catch (std::exception &e) {
+      std::cerr << "Bad reply from DRMAA worker " << pid << ": " << e.what()
+                << std::endl;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    gone = true;
+    replied.notify_all();
+  }
+};
+
+drmaa::session::session(const std::shared_ptr<worker> &remote_worker_)
+    : remote_worker(remote_worker_) {}
+
+bool drmaa::session::remote() const { return remote_worker != nullptr; }
+
+std::shared_ptr<drmaa::session>
+drmaa::session::spawn(const std::string &contact) throw(drmaa::exception) {
+  int channels[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channels) != 0) {
+    throw drmaa::exception(DRMAA_ERRNO_INTERNAL_ERROR, strerror(errno));
+  }
+  auto parent = getpid();
+  auto pid = fork();
+  if (pid < 0) {
+    close(channels[0]);
+    close(channels[1]);
+    throw drmaa::exception(DRMAA_ERRNO_INTERNAL_ERROR, strerror(errno));
+  }
+  if (pid == 0) {
+    close(channels[0]);
+    for (auto channel : parent_channels) {
+      close(channel);
+    }
+    // Signals to stop are left blocked, so the worker stays until the parent
+    // has drained and hangs up, or dies
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent) {
+      _exit(1);
+    }
+    try {
+      auto local = std::make_shared<drmaa::session>(contact);
+      if (writeFrame(channels[1], {"ready"})) {
+        serve(local, channels[1]);
+      }
+    } catch (drmaa::exception &e) {
+      writeFrame(channels[1],
+                 {"error", std::to_string(e.code()), e.what()});
+    }
+    _exit(0);
+  }
+  close(channels[1]);
+  auto remote = std::make_shared<worker>(pid, channels[0]);
+  std::vector<std::string> ready;
+  try {
+    if (!readFrame(channels[0], ready)) {
+      ready.clear();
+    }
+  } catch (std::exception &e) {
+    ready.clear();
+  }
+  if (ready.size() == 3 && ready[0] == "error") {
+    throw drmaa::exception(std::stoi(ready[1]), ready[2].c_str());
+  }
+  if (ready.size() != 1 || ready[0] != "ready") {
+    throw drmaa::exception(DRMAA_ERRNO_DRM_COMMUNICATION_FAILURE,
+                           ("DRMAA worker for " + contact + " did not start.")
+                               .c_str());
+  }
+  parent_channels.push_back(channels[0]);
+  return std::shared_ptr<drmaa::session>(new drmaa::session(remote));
+}
+
+std::vector<std::string> drmaa::session::call(
+    const std::vector<std::string> &request) throw(drmaa::exception) {
+  static const auto timeout =
+      std::chrono::seconds(envSize("DRMAAWS_WORKER_TIMEOUT", 60));
+  auto remote = remote_worker;
+  std::call_once(remote->reading, [remote] {
+    remote->reader = std::thread(&worker::read, remote.get());
+  });
+
+  uint64_t id;
+  {
+    std::unique_lock<std::mutex> guard(remote->lock);
+    if (remote->gone) {
+      throw drmaa::exception(DRMAA_ERRNO_DRM_COMMUNICATION_FAILURE,
+                             "DRMAA worker has exited.");
+    }
+    id = remote->next_call++;
+    remote->waiting.insert(id);
+  }
+  std::vector<std::string> message{std::to_string(id)};
+  message.insert(message.end(), request.begin(), request.end());
+  bool sent;
+  {
+    std::unique_lock<std::mutex> guard(remote->write_lock);
+    sent = writeFrame(remote->channel, message);
+  }
+
+  std::vector<std::string> reply;
+  {
+    std::unique_lock<std::mutex> guard(remote->lock);
+    if (sent) {
+      remote->replied.wait_for(guard, timeout, [&] {
+        return remote->gone || remote->replies.count(id);
+      });
+    }
+    remote->waiting.erase(id);
+    auto it = remote->replies.find(id);
+    if (it != remote->replies.end()) {
+      reply = std::move(it->second);
+      remote->replies.erase(it);
+    }
+  }
+  if (reply.size() < 2) {
+    throw drmaa::exception(DRMAA_ERRNO_DRM_COMMUNICATION_FAILURE,
+                           "No reply from DRMAA worker.");
+  }
+  if (reply[1] == "error") {
+    throw drmaa::exception(std::stoi(reply.at(2)), reply.at(3).c_str());
+  }
+  return std::vector<std::string>(reply.begin() + 2, reply.end());
+}
+
+void drmaa::session::serve(std::shared_ptr<session> &local, int channel) {
+  std::mutex write_lock;
+  {
+    Executor pool(envSize("DRMAAWS_CLUSTER_WORKER_THREADS", 8), 1024);
+    std::vector<std::string> request;
+    while (true) {
+      try {
+        if (!readFrame(channel, request)) {
+          break;
+        }
+      } catch (CborError &e) {
+        std::cerr << "Bad request in DRMAA worker: " << e.what() << std::endl;
+        break;
+      }
+      pool.submit([&local, &write_lock, channel, request] {
+        std::vector<std::string> reply;
+        try {
+          reply = handle(local, request);
+        } catch (drmaa::exception &e) {
+          reply = {request.at(0), "error", std::to_string(e.code()),
+                   e.what()};
+        } catch (std::exception &e) {
+          reply = {request.empty() ? "" : request[0], "error",
+                   std::to_string(DRMAA_ERRNO_INVALID_ARGUMENT), e.what()};
+        }
+        std::unique_lock<std::mutex> guard(write_lock);
+        writeFrame(channel, reply);
+      });
+    }
+  }
+  close(channel);
+}
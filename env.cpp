@@ -0,0 +1,11 @@
+#include <cstdlib>
+#include "env.hpp"
+
+size_t envSize(const char *name, size_t default_value) {
+  auto value = getenv(name);
+  if (value == nullptr) {
+    return default_value;
+  }
+  auto parsed = strtoul(value, nullptr, 10);
+  return parsed == 0 ? default_value : parsed;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+
+// A positive number from the environment, or the default if the variable isn't
+// set or doesn't hold one
+size_t envSize(const char *name, size_t default_value);
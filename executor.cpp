@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <iostream>
+#include "executor.hpp"
+
+Executor::Executor(size_t threads, size_t capacity_)
+    : capacity(capacity_), stopping(false), started_tasks(0),
+      waited_seconds(0) {
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back(&Executor::work, this);
+  }
+}
+
+Executor::~Executor() {
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    stopping = true;
+  }
+  ready.notify_all();
+  space.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void Executor::submit(const std::function<void()> &task) {
+  std::unique_lock<std::mutex> guard(lock);
+  space.wait(guard, [this] { return stopping || tasks.size() < capacity; });
+  tasks.push_back({task, std::chrono::steady_clock::now()});
+  ready.notify_one();
+}
+
+bool Executor::trySubmit(const std::function<void()> &task) {
+  std::unique_lock<std::mutex> guard(lock);
+  if (stopping || tasks.size() >= capacity) {
+    return false;
+  }
+  tasks.push_back({task, std::chrono::steady_clock::now()});
+  ready.notify_one();
+  return true;
+}
+
+size_t Executor::depth() {
+  std::unique_lock<std::mutex> guard(lock);
+  return tasks.size();
+}
+
+size_t Executor::started() {
+  std::unique_lock<std::mutex> guard(lock);
+  return started_tasks;
+}
+
+double Executor::waited() {
+  std::unique_lock<std::mutex> guard(lock);
+  return waited_seconds;
+}
+
+void Executor::work() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      ready.wait(guard, [this] { return stopping || !tasks.empty(); });
+      // Drain what is left before shutting down so no one waits forever
+      if (tasks.empty()) {
+        return;
+      }
+      task = std::move(tasks.front().run);
+      started_tasks++;
+      waited_seconds += std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() -
+                            tasks.front().queued_at)
+                            .count();
+      tasks.pop_front();
+    }
+    space.notify_one();
+    try {
+      task();
+    } catch (std::exception &e) {
+      std::cerr << "Error in background task: " << e.what() << std::endl;
+    }
+  }
+}
+
+Latch::Latch(size_t count) : remaining(count) {}
+
+void Latch::countDown() {
+  std::unique_lock<std::mutex> guard(lock);
+  if (remaining > 0 && --remaining == 0) {
+    done.notify_all();
+  }
+}
+
+void Latch::wait() {
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [this] { return remaining == 0; });
+}
+
+RateLimiter::RateLimiter(double rate_)
+    : rate(rate_), tokens(rate_), last(std::chrono::steady_clock::now()) {}
+
+void RateLimiter::refill() {
+  auto now = std::chrono::steady_clock::now();
+  tokens = std::min(
+      rate, tokens + rate * std::chrono::duration<double>(now - last).count());
+  last = now;
+}
+
+bool RateLimiter::tryAcquire() {
+  std::unique_lock<std::mutex> guard(lock);
+  refill();
+  if (tokens < 1) {
+    return false;
+  }
+  tokens--;
+  return true;
+}
+
+void RateLimiter::acquire() {
+  std::unique_lock<std::mutex> guard(lock);
+  refill();
+  // Take the token now, even if that puts us in debt, so waiting callers are
+  // served in order
+  tokens--;
+  if (tokens < 0) {
+    auto wait = std::chrono::duration<double>(-tokens / rate);
+    guard.unlock();
+    std::this_thread::sleep_for(wait);
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed pool of worker threads draining a bounded queue of tasks
+class Executor {
+public:
+  Executor(size_t threads, size_t capacity);
+  ~Executor();
+
+  // Queue a task, blocking while the queue is full
+  void submit(const std::function<void()> &task);
+  // Queue a task if there is room for it
+  bool trySubmit(const std::function<void()> &task);
+
+  size_t depth();
+  // Tasks that have started, and how long they waited in total, in seconds
+  size_t started();
+  double waited();
+
+private:
+  struct Task {
+    std::function<void()> run;
+    std::chrono::steady_clock::time_point queued_at;
+  };
+
+  void work();
+
+  size_t capacity;
+  bool stopping;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::condition_variable space;
+  std::deque<Task> tasks;
+  size_t started_tasks;
+  double waited_seconds;
+  std::vector<std::thread> workers;
+};
+
+// Wait for a fixed number of tasks to finish
+class Latch {
+public:
+  explicit Latch(size_t count);
+
+  void countDown();
+  void wait();
+
+private:
+  size_t remaining;
+  std::mutex lock;
+  std::condition_variable done;
+};
+
+// A token bucket allowing a steady rate of calls per second, with bursts of up
+// to a second's worth
+class RateLimiter {
+public:
+  explicit RateLimiter(double rate);
+
+  // Take a token if there is one
+  bool tryAcquire();
+  // Take a token, waiting for one if need be
+  void acquire();
+
+private:
+  // Must be called with the lock held
+  void refill();
+
+  double rate;
+  double tokens;
+  std::chrono::steady_clock::time_point last;
+  std::mutex lock;
+};
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include "fairqueue.hpp"
+
+FairQueue::FairQueue(size_t threads,
+                     const std::map<std::string, double> &weights_)
+    : weights(weights_), stopping(false) {
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back(&FairQueue::work, this);
+  }
+}
+
+FairQueue::~FairQueue() {
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    stopping = true;
+  }
+  ready.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+bool FairQueue::run(const std::string &tenant,
+                    const std::function<void()> &task,
+                    std::chrono::milliseconds timeout) {
+  auto call = std::make_shared<Call>();
+  call->task = task;
+  call->queued_at = std::chrono::steady_clock::now();
+  call->started = false;
+  call->done = false;
+
+  std::unique_lock<std::mutex> guard(lock);
+  auto it = tenants.find(tenant);
+  if (it == tenants.end()) {
+    auto weight = weights.find(tenant);
+    it = tenants
+             .insert(std::make_pair(
+                 tenant, Tenant{{},
+                                weight == weights.end() ? weights.at("*")
+                                                        : weight->second,
+                                0,
+                                0,
+                                0}))
+             .first;
+  }
+  if (it->second.calls.empty()) {
+    active.push_back(tenant);
+  }
+  it->second.calls.push_back(call);
+  ready.notify_one();
+
+  if (!finished.wait_for(guard, timeout, [&call] { return call->started; })) {
+    auto &calls = it->second.calls;
+    calls.erase(std::find(calls.begin(), calls.end(), call));
+    if (calls.empty()) {
+      it->second.deficit = 0;
+      active.erase(std::find(active.begin(), active.end(), tenant));
+    }
+    return false;
+  }
+  finished.wait(guard, [&call] { return call->done; });
+  if (call->error) {
+    std::rethrow_exception(call->error);
+  }
+  return true;
+}
+
+std::shared_ptr<FairQueue::Call> FairQueue::next() {
+  auto name = active.front();
+  auto &tenant = tenants[name];
+  if (tenant.deficit < 1) {
+    // A new turn; weights below one still get a task every few turns
+    tenant.deficit += std::max(tenant.weight, 0.01);
+  }
+  std::shared_ptr<Call> call;
+  if (tenant.deficit >= 1) {
+    call = tenant.calls.front();
+    tenant.calls.pop_front();
+    tenant.deficit--;
+    tenant.started++;
+    tenant.waited += std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - call->queued_at)
+                         .count();
+  }
+  if (tenant.calls.empty()) {
+    tenant.deficit = 0;
+    active.pop_front();
+  } else if (tenant.deficit < 1) {
+    active.pop_front();
+    active.push_back(name);
+  }
+  return call;
+}
+
+void FairQueue::work() {
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    ready.wait(guard, [this] { return stopping || !active.empty(); });
+    if (stopping) {
+      return;
+    }
+    auto call = next();
+    if (!call) {
+      continue;
+    }
+    call->started = true;
+    finished.notify_all();
+    guard.unlock();
+    try {
+      call->task();
+    } catch (...) {
+      call->error = std::current_exception();
+    }
+    guard.lock();
+    call->done = true;
+    finished.notify_all();
+  }
+}
+
+std::vector<TenantStats> FairQueue::stats() {
+  std::vector<TenantStats> output;
+  std::unique_lock<std::mutex> guard(lock);
+  for (auto &tenant : tenants) {
+    output.push_back({tenant.first, tenant.second.calls.size(),
+                      tenant.second.started, tenant.second.waited});
+  }
+  return output;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct TenantStats {
+  std::string tenant;
+  size_t depth;
+  // Tasks that have started, and how long they waited in total, in seconds
+  size_t started;
+  double waited;
+};
+
+// Runs tasks on a fixed pool of threads, with a queue for each tenant. Queues
+// are served by deficit round robin: each turn, a tenant may start as many
+// tasks as its weight before the next tenant gets a go, so a tenant with lots
+// queued can't starve the others.
+class FairQueue {
+public:
+  FairQueue(size_t threads, const std::map<std::string, double> &weights);
+  ~FairQueue();
+
+  // Run a task for a tenant and wait for it to finish, rethrowing anything it
+  // throws. If it hasn't started within the timeout, it is dropped and this
+  // returns false.
+  bool run(const std::string &tenant, const std::function<void()> &task,
+           std::chrono::milliseconds timeout);
+
+  std::vector<TenantStats> stats();
+
+private:
+  struct Call {
+    std::function<void()> task;
+    std::chrono::steady_clock::time_point queued_at;
+    bool started;
+    bool done;
+    std::exception_ptr error;
+  };
+  struct Tenant {
+    std::deque<std::shared_ptr<Call>> calls;
+    double weight;
+    double deficit;
+    size_t started;
+    double waited;
+  };
+
+  void work();
+  // Must be called with the lock held
+  std::shared_ptr<Call> next();
+
+  // Weights for each tenant; "*" is for everyone else
+  std::map<std::string, double> weights;
+  bool stopping;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::condition_variable finished;
+  std::map<std::string, Tenant> tenants;
+  // Tenants with something queued, in the order they get a turn
+  std::deque<std::string> active;
+  std::vector<std::thread> workers;
+};
@@ -0,0 +1,234 @@
+#include "cbor.hpp"
+#include "graphstore.hpp"
+#include "tracing.hpp"
+
+GraphStore::GraphStore(const std::string &path)
+    : db(path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE) {
+  db.exec("CREATE TABLE IF NOT EXISTS graphs (id text PRIMARY KEY, created_at "
+          "integer NOT NULL, finished_at integer)");
+  db.exec("CREATE TABLE IF NOT EXISTS graph_nodes (graph text NOT NULL, name "
+          "text NOT NULL, job_key text NOT NULL, job blob NOT NULL, state text "
+          "NOT NULL, waiting integer NOT NULL DEFAULT 0, PRIMARY KEY (graph, "
+          "name))");
+  db.exec("CREATE INDEX IF NOT EXISTS graph_nodes_job_key ON graph_nodes "
+          "(job_key, state)");
+  db.exec("CREATE INDEX IF NOT EXISTS graph_nodes_state ON graph_nodes "
+          "(state)");
+  db.exec("CREATE TABLE IF NOT EXISTS graph_edges (graph text NOT NULL, parent "
+          "text NOT NULL, child text NOT NULL, PRIMARY KEY (graph, parent, "
+          "child))");
+}
+
+bool GraphStore::create(
+    const std::string &id, const std::vector<GraphNode> &nodes,
+    const std::vector<std::pair<std::string, std::string>> &edges) {
+  tracing::Span span("graph create");
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Transaction transaction(db);
+  SQLite::Statement graph(db, "INSERT OR IGNORE INTO graphs (id, created_at) "
+                              "VALUES (?, strftime('%s', 'now'))");
+  graph.bind(1, id);
+  if (graph.exec() == 0) {
+    return false;
+  }
+  SQLite::Statement insert(db, "INSERT INTO graph_nodes (graph, name, "
+                               "job_key, job, state) VALUES (?, ?, ?, ?, "
+                               "'WAITING')");
+  for (auto &node : nodes) {
+    auto job = writeJob(node.job);
+    insert.bind(1, id);
+    insert.bind(2, node.name);
+    insert.bind(3, node.key);
+    insert.bind(4, job.data(), job.size());
+    insert.exec();
+    insert.reset();
+  }
+  SQLite::Statement edge(db, "INSERT OR IGNORE INTO graph_edges (graph, "
+                             "parent, child) VALUES (?, ?, ?)");
+  for (auto &parent_child : edges) {
+    edge.bind(1, id);
+    edge.bind(2, parent_child.first);
+    edge.bind(3, parent_child.second);
+    edge.exec();
+    edge.reset();
+  }
+  // Now the duplicate edges are gone, count up what everything waits for
+  SQLite::Statement count(
+      db, "UPDATE graph_nodes SET waiting = (SELECT COUNT(*) FROM graph_edges "
+          "WHERE graph_edges.graph = graph_nodes.graph AND graph_edges.child "
+          "= graph_nodes.name) WHERE graph = ?");
+  count.bind(1, id);
+  count.exec();
+  SQLite::Statement roots(db, "UPDATE graph_nodes SET state = 'READY' WHERE "
+                              "graph = ? AND waiting = 0");
+  roots.bind(1, id);
+  roots.exec();
+  transaction.commit();
+  return true;
+}
+
+bool GraphStore::get(const std::string &id, std::vector<GraphNode> &nodes) {
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Statement graph(db, "SELECT 1 FROM graphs WHERE id = ?");
+  graph.bind(1, id);
+  if (!graph.executeStep()) {
+    return false;
+  }
+  SQLite::Statement query(db, "SELECT name, job_key, state FROM graph_nodes "
+                              "WHERE graph = ? ORDER BY name");
+  query.bind(1, id);
+  while (query.executeStep()) {
+    nodes.push_back({id, query.getColumn(0).getString(),
+                     query.getColumn(1).getString(),
+                     query.getColumn(2).getString(), JobRequest()});
+  }
+  return true;
+}
+
+std::vector<GraphNode> GraphStore::finish(const std::string &key,
+                                          bool succeeded) {
+  std::vector<GraphNode> ready;
+  tracing::Span span("graph finish");
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Transaction transaction(db);
+  std::vector<std::pair<std::string, std::string>> finished;
+  {
+    SQLite::Statement query(db, "SELECT graph, name FROM graph_nodes WHERE "
+                                "job_key = ? AND state IN ('READY', "
+                                "'SUBMITTED')");
+    query.bind(1, key);
+    while (query.executeStep()) {
+      finished.push_back(std::make_pair(query.getColumn(0).getString(),
+                                        query.getColumn(1).getString()));
+    }
+  }
+  if (finished.empty()) {
+    return ready;
+  }
+  SQLite::Statement update(db, "UPDATE graph_nodes SET state = ? WHERE graph "
+                               "= ? AND name = ?");
+  SQLite::Statement release(
+      db, "UPDATE graph_nodes SET waiting = waiting - 1 WHERE graph = ?1 AND "
+          "name IN (SELECT child FROM graph_edges WHERE graph = ?1 AND parent "
+          "= ?2)");
+  SQLite::Statement released(
+      db, "SELECT name, job_key, job FROM graph_nodes WHERE graph = ?1 AND "
+          "state = 'WAITING' AND waiting = 0 AND name IN (SELECT child FROM "
+          "graph_edges WHERE graph = ?1 AND parent = ?2)");
+  // Everything downstream of a failure, however far
+  SQLite::Statement cancel(
+      db, "WITH RECURSIVE downstream(name) AS (SELECT child FROM graph_edges "
+          "WHERE graph = ?1 AND parent = ?2 UNION SELECT graph_edges.child "
+          "FROM graph_edges JOIN downstream ON graph_edges.parent = "
+          "downstream.name WHERE graph_edges.graph = ?1) UPDATE graph_nodes "
+          "SET state = 'CANCELLED' WHERE graph = ?1 AND state = 'WAITING' AND "
+          "name IN downstream");
+  SQLite::Statement done(
+      db, "UPDATE graphs SET finished_at = strftime('%s', 'now') WHERE id = ?1 "
+          "AND NOT EXISTS (SELECT 1 FROM graph_nodes WHERE graph = ?1 AND "
+          "state IN ('WAITING', 'READY', 'SUBMITTED'))");
+  for (auto &node : finished) {
+    update.bind(1, succeeded ? "SUCCEEDED" : "FAILED");
+    update.bind(2, node.first);
+    update.bind(3, node.second);
+    update.exec();
+    update.reset();
+    if (succeeded) {
+      release.bind(1, node.first);
+      release.bind(2, node.second);
+      release.exec();
+      release.reset();
+      released.bind(1, node.first);
+      released.bind(2, node.second);
+      while (released.executeStep()) {
+        GraphNode child{node.first, released.getColumn(0).getString(),
+                        released.getColumn(1).getString(), "READY",
+                        JobRequest()};
+        readJob(released.getColumn(2).getString(), child.job);
+        ready.push_back(std::move(child));
+      }
+      released.reset();
+    } else {
+      cancel.bind(1, node.first);
+      cancel.bind(2, node.second);
+      cancel.exec();
+      cancel.reset();
+    }
+    done.bind(1, node.first);
+    done.exec();
+    done.reset();
+  }
+  for (auto &node : ready) {
+    update.bind(1, "READY");
+    update.bind(2, node.graph);
+    update.bind(3, node.name);
+    update.exec();
+    update.reset();
+  }
+  transaction.commit();
+  return ready;
+}
+
+void GraphStore::submitted(const std::string &graph, const std::string &name) {
+  std::unique_lock<std::mutex> guard(lock);
+  // It may have finished already, and that takes priority
+  SQLite::Statement update(db, "UPDATE graph_nodes SET state = 'SUBMITTED' "
+                               "WHERE graph = ? AND name = ? AND state = "
+                               "'READY'");
+  update.bind(1, graph);
+  update.bind(2, name);
+  update.exec();
+}
+
+std::vector<GraphNode> GraphStore::active() {
+  std::vector<GraphNode> output;
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Statement query(db, "SELECT graph, name, job_key, state, job FROM "
+                              "graph_nodes WHERE state IN ('READY', "
+                              "'SUBMITTED')");
+  while (query.executeStep()) {
+    GraphNode node{query.getColumn(0).getString(),
+                   query.getColumn(1).getString(),
+                   query.getColumn(2).getString(),
+                   query.getColumn(3).getString(), JobRequest()};
+    readJob(query.getColumn(4).getString(), node.job);
+    output.push_back(std::move(node));
+  }
+  return output;
+}
+
+size_t GraphStore::expire(double days) {
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Transaction transaction(db);
+  std::vector<std::string> expired;
+  {
+    SQLite::Statement query(db, "SELECT id FROM graphs WHERE finished_at < "
+                                "strftime('%s', 'now') - ?");
+    query.bind(1, (long long)(days * 86400));
+    while (query.executeStep()) {
+      expired.push_back(query.getColumn(0).getString());
+    }
+  }
+  SQLite::Statement remove(db, "DELETE FROM graphs WHERE id = ?");
+  SQLite::Statement remove_nodes(db, "DELETE FROM graph_nodes WHERE graph = ?");
+  SQLite::Statement remove_edges(db, "DELETE FROM graph_edges WHERE graph = ?");
+  for (auto &id : expired) {
+    for (auto statement : {&remove, &remove_nodes, &remove_edges}) {
+      statement->bind(1, id);
+      statement->exec();
+      statement->reset();
+    }
+  }
+  transaction.commit();
+  return expired.size();
+}
+
+size_t GraphStore::running() {
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Statement query(db, "SELECT COUNT(*) FROM graphs WHERE finished_at "
+                              "IS NULL");
+  if (query.executeStep()) {
+    return query.getColumn(0).getInt();
+  }
+  return 0;
+}
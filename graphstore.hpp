@@ -0,0 +1,52 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <SQLiteCpp/SQLiteCpp.h>
+#include "jobrequest.hpp"
+
+// One job in a dependency graph. The state is one of:
+//
+//   WAITING    for some of its parents to succeed
+//   READY      to be submitted, since they all have
+//   SUBMITTED  and being tracked like any other job
+//   SUCCEEDED
+//   FAILED     which cancels everything downstream of it
+//   CANCELLED  because something upstream failed
+struct GraphNode {
+  std::string graph;
+  std::string name;
+  std::string key;
+  std::string state;
+  JobRequest job;
+};
+
+// Keeps dependency graphs of jobs in SQLite, and works out which jobs can go
+// next as others finish. Safe to call from multiple threads.
+class GraphStore {
+public:
+  explicit GraphStore(const std::string &path);
+
+  // Store a new graph, where edges go from parent to child by name. Returns
+  // false, without changing anything, if there is already one with this id
+  bool create(const std::string &id, const std::vector<GraphNode> &nodes,
+              const std::vector<std::pair<std::string, std::string>> &edges);
+  // Every job in a graph, without their requests; false if it's unknown
+  bool get(const std::string &id, std::vector<GraphNode> &nodes);
+  // Record that a job has finished, wherever it appears as READY or SUBMITTED,
+  // and return whatever is now READY as a result
+  std::vector<GraphNode> finish(const std::string &key, bool succeeded);
+  void submitted(const std::string &graph, const std::string &name);
+  // Jobs that are READY or SUBMITTED, so they can be (re)started
+  std::vector<GraphNode> active();
+  // Delete graphs that finished more than this many days ago
+  size_t expire(double days);
+  // Graphs that haven't finished yet
+  size_t running();
+
+private:
+  std::mutex lock;
+  SQLite::Database db;
+};
@@ -0,0 +1,279 @@
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <openssl/sha.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "jobindex.hpp"
+#include "statestore.hpp"
+
+static const uint64_t initial_capacity = 4096;
+
+enum slot_state { UsedSlot = 1, DeletedSlot = 2 };
+
+struct IndexHeader {
+  char magic[4];
+  uint32_t slot_size;
+  uint64_t capacity;
+  uint64_t used;
+  // Deleted slots, which still have to be probed past
+  uint64_t tombstones;
+  char padding[32];
+};
+
+struct IndexSlot {
+  uint32_t version;
+  uint8_t state;
+  uint8_t status;
+  uint16_t padding;
+  int64_t submitted_at;
+  int64_t updated_at;
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  char drmaa[48];
+  uint32_t crc;
+};
+
+static_assert(sizeof(IndexHeader) == 64, "index header must be 64 bytes");
+static_assert(sizeof(IndexSlot) == 96, "index slots must be 96 bytes");
+
+static uint32_t checksum(const IndexSlot *slot) {
+  auto start = (const Bytef *)slot + offsetof(IndexSlot, state);
+  return crc32(0, start, offsetof(IndexSlot, crc) -
+                             offsetof(IndexSlot, state));
+}
+
+// A slot that was half written when we crashed is no use to anyone
+static bool intact(const IndexSlot *slot) {
+  return (slot->version & 1) == 0 && slot->crc == checksum(slot);
+}
+
+JobIndex::JobIndex(const std::string &path_)
+    : path(path_), fd(open(path_.c_str(), O_RDWR | O_CREAT, 0644)),
+      created(false), header(nullptr), slots(nullptr), length(0) {
+  if (fd == -1) {
+    throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+  }
+  struct stat info;
+  IndexHeader existing;
+  if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(IndexHeader) &&
+      pread(fd, &existing, sizeof(existing), 0) == sizeof(existing) &&
+      memcmp(existing.magic, "DWI1", 4) == 0 &&
+      existing.slot_size == sizeof(IndexSlot) && existing.capacity > 0 &&
+      (existing.capacity & (existing.capacity - 1)) == 0 &&
+      info.st_size == (off_t)(sizeof(IndexHeader) +
+                              existing.capacity * sizeof(IndexSlot))) {
+    map(fd, existing.capacity, false);
+    return;
+  }
+  if (info.st_size > 0) {
+    std::cerr << "Discarding unreadable job index " << path << std::endl;
+  }
+  if (ftruncate(fd, 0) != 0) {
+    throw std::runtime_error("Cannot truncate " + path + ": " +
+                             strerror(errno));
+  }
+  map(fd, initial_capacity, true);
+  created = true;
+}
+
+JobIndex::~JobIndex() {
+  munmap(header, length);
+  close(fd);
+}
+
+void JobIndex::map(int file, uint64_t capacity, bool initialise) {
+  auto bytes = sizeof(IndexHeader) + capacity * sizeof(IndexSlot);
+  if (initialise && ftruncate(file, bytes) != 0) {
+    throw std::runtime_error("Cannot resize " + path + ": " + strerror(errno));
+  }
+  auto memory =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Cannot map " + path + ": " + strerror(errno));
+  }
+  header = (IndexHeader *)memory;
+  slots = (IndexSlot *)((char *)memory + sizeof(IndexHeader));
+  length = bytes;
+  if (initialise) {
+    memcpy(header->magic, "DWI1", 4);
+    header->slot_size = sizeof(IndexSlot);
+    header->capacity = capacity;
+    header->used = 0;
+    header->tombstones = 0;
+  }
+}
+
+IndexSlot *JobIndex::find(const unsigned char *digest, bool insert) {
+  uint64_t start;
+  memcpy(&start, digest, sizeof(start));
+  auto mask = header->capacity - 1;
+  IndexSlot *reusable = nullptr;
+  for (uint64_t i = 0; i < header->capacity; i++) {
+    auto slot = &slots[(start + i) & mask];
+    if (slot->version == 0) {
+      // Never written, so the key can't be any further along
+      if (!insert) {
+        return nullptr;
+      }
+      return reusable == nullptr ? slot : reusable;
+    }
+    if (!intact(slot) || slot->state != UsedSlot) {
+      if (reusable == nullptr) {
+        reusable = slot;
+      }
+      continue;
+    }
+    if (memcmp(slot->digest, digest, SHA_DIGEST_LENGTH) == 0) {
+      return slot;
+    }
+  }
+  return insert ? reusable : nullptr;
+}
+
+void JobIndex::grow() {
+  uint64_t capacity = initial_capacity;
+  while ((header->used + 1) * 2 > capacity) {
+    capacity *= 2;
+  }
+  auto replacement_path = path + ".new";
+  auto replacement =
+      open(replacement_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (replacement == -1) {
+    throw std::runtime_error("Cannot open " + replacement_path + ": " +
+                             strerror(errno));
+  }
+  auto old_header = header;
+  auto old_slots = slots;
+  auto old_length = length;
+  auto old_capacity = header->capacity;
+  try {
+    map(replacement, capacity, true);
+  } catch (std::exception &e) {
+    close(replacement);
+    header = old_header;
+    slots = old_slots;
+    length = old_length;
+    throw;
+  }
+  // Nothing reads the new file until it is renamed over the old one, so the
+  // slots can be copied without versioning them
+  for (uint64_t i = 0; i < old_capacity; i++) {
+    auto slot = &old_slots[i];
+    if (slot->version != 0 && intact(slot) && slot->state == UsedSlot) {
+      *find(slot->digest, true) = *slot;
+      header->used++;
+    }
+  }
+  msync(header, length, MS_SYNC);
+  if (rename(replacement_path.c_str(), path.c_str()) != 0) {
+    auto error = errno;
+    munmap(header, length);
+    close(replacement);
+    header = old_header;
+    slots = old_slots;
+    length = old_length;
+    throw std::runtime_error("Cannot replace " + path + ": " +
+                             strerror(error));
+  }
+  munmap(old_header, old_length);
+  close(fd);
+  fd = replacement;
+  std::cerr << "Resized job index from " << old_capacity << " to " << capacity
+            << " slots" << std::endl;
+}
+
+bool JobIndex::fresh() const { return created; }
+
+bool JobIndex::get(const std::string &key, IndexEntry &entry) {
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char *)key.data(), key.size(), digest);
+  std::unique_lock<std::mutex> guard(lock);
+  auto slot = find(digest, false);
+  if (slot == nullptr || *statusName(slot->status) == '\0') {
+    return false;
+  }
+  entry.drmaa =
+      std::string(slot->drmaa, strnlen(slot->drmaa, sizeof(slot->drmaa)));
+  entry.status = statusName(slot->status);
+  entry.submitted_at = slot->submitted_at;
+  entry.updated_at = slot->updated_at;
+  return true;
+}
+
+void JobIndex::put(const std::string &key, const std::string &drmaa,
+                   const std::string &status, int64_t updated_at) {
+  auto code = statusCode(status);
+  if (code == 0) {
+    // Can't be represented, so make sure nobody finds an older version
+    erase(key);
+    return;
+  }
+  // An id too long to fit is left out, which tells readers to get it from the
+  // state store; the status can still be answered from here
+  auto fits = drmaa.size() < sizeof(IndexSlot::drmaa);
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char *)key.data(), key.size(), digest);
+  std::unique_lock<std::mutex> guard(lock);
+  if ((header->used + header->tombstones + 1) * 10 > header->capacity * 7) {
+    grow();
+  }
+  auto slot = find(digest, true);
+  auto existing = slot->version != 0 && intact(slot);
+  auto replacing = existing && slot->state == UsedSlot;
+  auto submitted_at = replacing ? slot->submitted_at : updated_at;
+
+  slot->version |= 1;
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->state = UsedSlot;
+  slot->status = code;
+  slot->padding = 0;
+  slot->submitted_at = submitted_at;
+  slot->updated_at = updated_at;
+  memcpy(slot->digest, digest, sizeof(digest));
+  memset(slot->drmaa, 0, sizeof(slot->drmaa));
+  if (fits) {
+    memcpy(slot->drmaa, drmaa.data(), drmaa.size());
+  }
+  slot->crc = checksum(slot);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->version++;
+
+  if (!replacing) {
+    header->used++;
+    if (slot->version > 2 && header->tombstones > 0) {
+      header->tombstones--;
+    }
+  }
+}
+
+void JobIndex::erase(const std::string &key) {
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  SHA1((const unsigned char *)key.data(), key.size(), digest);
+  std::unique_lock<std::mutex> guard(lock);
+  auto slot = find(digest, false);
+  if (slot == nullptr) {
+    return;
+  }
+  slot->version |= 1;
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->state = DeletedSlot;
+  slot->crc = checksum(slot);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->version++;
+  header->used--;
+  header->tombstones++;
+}
+
+size_t JobIndex::size() {
+  std::unique_lock<std::mutex> guard(lock);
+  return header->used;
+}
+
+size_t JobIndex::capacityBytes() {
+  std::unique_lock<std::mutex> guard(lock);
+  return length;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+struct IndexHeader;
+struct IndexSlot;
+
+struct IndexEntry {
+  // Empty if the id was too long to keep
+  std::string drmaa;
+  std::string status;
+  // Seconds since the epoch
+  int64_t submitted_at;
+  int64_t updated_at;
+};
+
+// A memory-mapped hash table from job key to DRMAA id, status and timestamps,
+// so a restarted process can find out about a job without asking the state
+// store. Opening it only maps the file; pages are read in as they are probed.
+//
+// The file is a 64-byte header:
+//
+//   magic "DWI1" slot size (u32) capacity (u64) used (u64) tombstones (u64)
+//
+// followed by capacity fixed-width slots, probed linearly from the first eight
+// bytes of the SHA-1 of the key:
+//
+//   version (u32) state (u8) status (u8) padding (u16) submitted_at (i64)
+//   updated_at (i64) key digest (20 bytes) drmaa id (48 bytes, NUL-padded)
+//   crc32 (u32)
+//
+// in host byte order, where the checksum covers everything between the
+// version and itself. An id of 48 bytes or more doesn't fit and is left empty,
+// so it has to be looked up in the state store.
+//
+// Slots are updated in place. The version is made odd before a slot is
+// touched and even again after the checksum is written, so a slot that was
+// being written when the process died is recognisable and treated as free. The
+// state store stays the record of truth; anything missing here is looked up
+// there instead.
+class JobIndex {
+public:
+  explicit JobIndex(const std::string &path);
+  ~JobIndex();
+
+  // Whether the file was created (or thrown away as unreadable) on opening, so
+  // it knows nothing about jobs from before
+  bool fresh() const;
+  bool get(const std::string &key, IndexEntry &entry);
+  void put(const std::string &key, const std::string &drmaa,
+           const std::string &status, int64_t updated_at);
+  void erase(const std::string &key);
+  size_t size();
+  // Bytes mapped for the table
+  size_t capacityBytes();
+
+private:
+  // Must be called with the lock held
+  void map(int file, uint64_t capacity, bool initialise);
+  IndexSlot *find(const unsigned char *digest, bool insert);
+  void grow();
+
+  std::string path;
+  std::mutex lock;
+  int fd;
+  bool created;
+  IndexHeader *header;
+  IndexSlot *slots;
+  size_t length;
+};
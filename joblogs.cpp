@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <pwd.h>
+#include <sstream>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "drmaa.h"
+#include "drmaapp.hpp"
+#include "joblogs.hpp"
+
+// How long a client may go without reading before we give up on it
+static const int send_timeout_ms = 60000;
+// How often to look for more of a log that is being followed
+static const int follow_interval_ms = 1000;
+// The most sent in one go, so a log that is growing quickly still gets sent in
+// chunks of a sensible size
+static const uint64_t chunk_size = 1 << 20;
+
+static std::string attribute(const JobRequest &job, const std::string &name) {
+  auto it = job.attributes().find(name);
+  return it == job.attributes().end() ? "" : it->second;
+}
+
+static void replace(std::string &text, const std::string &placeholder,
+                    const std::string &value) {
+  for (auto at = text.find(placeholder); at != std::string::npos;
+       at = text.find(placeholder, at + value.size())) {
+    text.replace(at, placeholder.size(), value);
+  }
+}
+
+// Jobs run as us, so they have our home directory
+static std::string homeDirectory() {
+  auto home = getenv("HOME");
+  if (home != nullptr) {
+    return home;
+  }
+  auto entry = getpwuid(getuid());
+  return entry == nullptr ? "/" : entry->pw_dir;
+}
+
+std::string logPath(const JobRequest &job, const std::string &drmaa_id,
+                    bool error) {
+  auto joined = attribute(job, drmaa::join_files) == "y";
+  auto separate = error && !joined;
+  auto path = attribute(job, separate ? drmaa::error_path : drmaa::output_path);
+  // Paths are [hostname]:path, and we assume the file system is shared
+  auto colon = path.find(':');
+  if (colon != std::string::npos) {
+    path = path.substr(colon + 1);
+  }
+  if (path.empty()) {
+    return path;
+  }
+  auto home = homeDirectory();
+  auto wd = attribute(job, drmaa::wd);
+  replace(wd, DRMAA_PLACEHOLDER_HD, home);
+  if (wd.empty()) {
+    wd = home;
+  }
+  replace(path, DRMAA_PLACEHOLDER_HD, home);
+  replace(path, DRMAA_PLACEHOLDER_WD, wd);
+  // Tasks of array jobs have ids like 1234.5
+  auto dot = drmaa_id.rfind('.');
+  replace(path, DRMAA_PLACEHOLDER_INCR,
+          dot == std::string::npos ? "" : drmaa_id.substr(dot + 1));
+  if (path[0] != '/') {
+    path = wd + "/" + path;
+  }
+  struct stat info;
+  if (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+    auto name = attribute(job, drmaa::job_name);
+    if (name.empty()) {
+      name = attribute(job, drmaa::remote_command);
+      name = name.substr(name.rfind('/') + 1);
+    }
+    path += "/" + name + (separate ? ".e" : ".o") + drmaa_id;
+  }
+  return path;
+}
+
+static bool isNumber(const std::string &text) {
+  return std::all_of(text.begin(), text.end(),
+                     [](char c) { return c >= '0' && c <= '9'; });
+}
+
+RangeRequest parseRange(const std::string &header, uint64_t size,
+                        uint64_t &first, uint64_t &last) {
+  if (header.compare(0, 6, "bytes=") != 0 ||
+      header.find(',') != std::string::npos) {
+    return RangeRequest::Whole;
+  }
+  auto dash = header.find('-', 6);
+  if (dash == std::string::npos) {
+    return RangeRequest::Whole;
+  }
+  auto from = header.substr(6, dash - 6);
+  auto to = header.substr(dash + 1);
+  if (!isNumber(from) || !isNumber(to) || (from.empty() && to.empty())) {
+    return RangeRequest::Whole;
+  }
+  if (from.empty()) {
+    // The last so many bytes
+    auto suffix = strtoull(to.c_str(), nullptr, 10);
+    if (suffix == 0 || size == 0) {
+      return RangeRequest::Unsatisfiable;
+    }
+    first = suffix >= size ? 0 : size - suffix;
+    last = size - 1;
+    return RangeRequest::Partial;
+  }
+  first = strtoull(from.c_str(), nullptr, 10);
+  if (first >= size) {
+    return RangeRequest::Unsatisfiable;
+  }
+  last = to.empty() ? size - 1
+                    : std::min<uint64_t>(strtoull(to.c_str(), nullptr, 10),
+                                         size - 1);
+  return last < first ? RangeRequest::Whole : RangeRequest::Partial;
+}
+
+// Wait until the socket can take more, or give up on it
+static bool writable(int socket) {
+  pollfd entry{socket, POLLOUT, 0};
+  auto ready = poll(&entry, 1, send_timeout_ms);
+  if (ready == -1) {
+    return errno == EINTR;
+  }
+  return ready == 1 && (entry.revents & (POLLERR | POLLHUP)) == 0;
+}
+
+static bool sendAll(int socket, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    auto count =
+        ::send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (count > 0) {
+      sent += count;
+    } else if ((errno != EAGAIN && errno != EINTR) || !writable(socket)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool sendRange(int socket, int fd, uint64_t offset, uint64_t length) {
+  off_t position = offset;
+  while (length > 0) {
+    auto count =
+        sendfile(socket, fd, &position, std::min(length, chunk_size));
+    if (count > 0) {
+      length -= count;
+    } else if (count == 0) {
+      // The file got shorter under us
+      return false;
+    } else if ((errno != EAGAIN && errno != EINTR) || !writable(socket)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+LogFile::LogFile(const std::string &path)
+    : fd(open(path.c_str(), O_RDONLY | O_CLOEXEC)) {}
+
+LogFile::~LogFile() {
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+LogFile::operator bool() const { return fd != -1; }
+
+uint64_t LogFile::size() const {
+  struct stat info;
+  return fstat(fd, &info) == 0 ? info.st_size : 0;
+}
+
+bool LogFile::send(int socket, uint64_t first, uint64_t length, bool partial) {
+  auto client = dup(socket);
+  if (client == -1) {
+    return false;
+  }
+  std::string head =
+      partial ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+  head += "Content-Type: text/plain\r\nAccept-Ranges: bytes\r\n";
+  if (partial) {
+    head += "Content-Range: bytes " + std::to_string(first) + "-" +
+            std::to_string(first + length - 1) + "/" + std::to_string(size()) +
+            "\r\n";
+  }
+  head += "Content-Length: " + std::to_string(length) + "\r\n\r\n";
+  auto sent = sendAll(client, head) && sendRange(client, fd, first, length);
+  if (!sent) {
+    // The client can't be left waiting for the rest
+    shutdown(client, SHUT_RDWR);
+  }
+  close(client);
+  return sent;
+}
+
+bool LogFile::follow(int socket, uint64_t offset,
+                     const std::function<bool()> &more) {
+  auto client = dup(socket);
+  if (client == -1) {
+    return false;
+  }
+  auto sent = sendAll(client, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                              "Transfer-Encoding: chunked\r\n\r\n");
+  auto finishing = false;
+  while (sent) {
+    auto available = size();
+    // If it was truncated, carry on from wherever it has got to
+    offset = std::min(offset, available);
+    if (available > offset) {
+      auto length = std::min(available - offset, chunk_size);
+      std::ostringstream chunk;
+      chunk << std::hex << length << "\r\n";
+      sent = sendAll(client, chunk.str()) &&
+             sendRange(client, fd, offset, length) && sendAll(client, "\r\n");
+      offset += length;
+    } else if (finishing) {
+      break;
+    } else if (!more()) {
+      // Have one last look for anything written as it finished
+      finishing = true;
+    } else {
+      // Wait for more, noticing if the client hangs up meanwhile
+      pollfd entry{client, POLLRDHUP, 0};
+      if (poll(&entry, 1, follow_interval_ms) > 0 &&
+          (entry.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0) {
+        sent = false;
+      }
+    }
+  }
+  sent = sent && sendAll(client, "0\r\n\r\n");
+  if (!sent) {
+    shutdown(client, SHUT_RDWR);
+  }
+  close(client);
+  return sent;
+}
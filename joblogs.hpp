@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "jobrequest.hpp"
+
+// Where a job's output or error stream ends up: DRMAA's path with the host
+// name taken off and the placeholders filled in, made absolute against the
+// job's working directory. Grid Engine writes into a file named after the job
+// when the path is a directory, so that is followed too. Empty if the job
+// didn't give a path.
+std::string logPath(const JobRequest &job, const std::string &drmaa_id,
+                    bool error);
+
+enum class RangeRequest { Whole, Partial, Unsatisfiable };
+
+// Work out which bytes, first to last inclusive, a Range header asks for from
+// a file of the given size. Only a single range is supported; anything else
+// gets the whole file.
+RangeRequest parseRange(const std::string &header, uint64_t size,
+                        uint64_t &first, uint64_t &last);
+
+// A job's log, sent straight from the file to the client's socket with
+// sendfile, so none of it passes through our memory however big it is. The
+// response, headers and all, is written to the socket directly; the socket is
+// duplicated, so it stays ours even if the server closes its end.
+class LogFile {
+public:
+  // Check whether it opened before using it
+  explicit LogFile(const std::string &path);
+  ~LogFile();
+  LogFile(const LogFile &) = delete;
+  LogFile &operator=(const LogFile &) = delete;
+
+  explicit operator bool() const;
+  uint64_t size() const;
+
+  // Send length bytes from first as a whole response; if partial, as the
+  // answer to a Range request. Returns false if the client went away or
+  // stopped reading.
+  bool send(int socket, uint64_t first, uint64_t length, bool partial);
+  // Send everything from offset as a chunked response, and keep sending
+  // whatever is appended until more returns false or the client goes away
+  bool follow(int socket, uint64_t offset, const std::function<bool()> &more);
+
+private:
+  int fd;
+};
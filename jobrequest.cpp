@@ -0,0 +1,37 @@
+#include <functional>
+#include <numeric>
+#include <sstream>
+#include "jobrequest.hpp"
+
+JobRequest::JobRequest() {}
+
+std::map<std::string, std::string> &JobRequest::attributes() { return attrs; }
+std::map<std::string, std::vector<std::string>> &JobRequest::v_attributes() {
+  return v_attrs;
+}
+const std::map<std::string, std::string> &JobRequest::attributes() const {
+  return attrs;
+}
+const std::map<std::string, std::vector<std::string>> &
+JobRequest::v_attributes() const {
+  return v_attrs;
+}
+
+std::string JobRequest::str() const {
+  std::stringstream output;
+  for (auto attr : attrs) {
+    output << (std::hash<std::string>{}(attr.second) * 31 +
+               std::hash<std::string>{}(attr.first));
+  }
+  for (auto attr : v_attrs) {
+
+    output << (std::accumulate(
+                   attr.second.begin(), attr.second.end(), (size_t)0,
+                   [](size_t a, const std::string &value) {
+                     return a * 31 + std::hash<std::string>{}(value);
+                   }) *
+                   31 +
+               std::hash<std::string>{}(attr.first));
+  }
+  return output.str();
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+class JobRequest {
+public:
+  JobRequest();
+
+  std::map<std::string, std::string> &attributes();
+  std::map<std::string, std::vector<std::string>> &v_attributes();
+  const std::map<std::string, std::string> &attributes() const;
+  const std::map<std::string, std::vector<std::string>> &v_attributes() const;
+  std::string str() const;
+
+private:
+  std::map<std::string, std::string> attrs;
+  std::map<std::string, std::vector<std::string>> v_attrs;
+};
@@ -0,0 +1,155 @@
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include "jobtable.hpp"
+#include "statestore.hpp"
+
+static const size_t initial_capacity = 1024;
+static const uint8_t empty_slot = 0;
+static const uint8_t deleted_slot = 0xFF;
+
+static uint32_t hashKey(const std::string &key) {
+  return (uint32_t)std::hash<std::string>{}(key);
+}
+
+static uint8_t packStatus(const std::string &status) {
+  auto code = statusCode(status);
+  return code == 0 ? statusCode("UNKNOWN") : code;
+}
+
+JobTable::JobTable() : used(0), deleted(0), garbage(0) {
+  rebuild(initial_capacity);
+}
+
+size_t JobTable::locate(const std::string &key, uint32_t hash) const {
+  auto mask = slots.size() - 1;
+  auto free = slots.size();
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    auto &slot = slots[i];
+    if (slot.status == empty_slot) {
+      return free == slots.size() ? i : free;
+    }
+    if (slot.status == deleted_slot) {
+      if (free == slots.size()) {
+        free = i;
+      }
+    } else if (slot.hash == hash && slot.key_length == key.size() &&
+               memcmp(&arena[slot.offset], key.data(), key.size()) == 0) {
+      return i;
+    }
+  }
+}
+
+void JobTable::rebuild(size_t capacity) {
+  std::vector<Slot> old_slots;
+  std::vector<char> old_arena;
+  old_slots.swap(slots);
+  old_arena.swap(arena);
+  slots.assign(capacity, Slot{0, 0, 0, 0, 0, empty_slot});
+  arena.reserve(old_arena.size() - garbage);
+  for (auto &slot : old_slots) {
+    if (slot.status == empty_slot || slot.status == deleted_slot) {
+      continue;
+    }
+    auto mask = slots.size() - 1;
+    auto i = slot.hash & mask;
+    while (slots[i].status != empty_slot) {
+      i = (i + 1) & mask;
+    }
+    slots[i] = slot;
+    slots[i].offset = arena.size();
+    arena.insert(arena.end(), old_arena.begin() + slot.offset,
+                 old_arena.begin() + slot.offset + slot.key_length +
+                     slot.drmaa_length);
+  }
+  deleted = 0;
+  garbage = 0;
+}
+
+const char *JobTable::status(const std::string &key) const {
+  auto &slot = slots[locate(key, hashKey(key))];
+  if (slot.status == empty_slot || slot.status == deleted_slot) {
+    return nullptr;
+  }
+  return statusName(slot.status);
+}
+
+bool JobTable::get(const std::string &key, TrackedJob &job) const {
+  auto &slot = slots[locate(key, hashKey(key))];
+  if (slot.status == empty_slot || slot.status == deleted_slot) {
+    return false;
+  }
+  job.drmaa.assign(&arena[slot.offset + slot.key_length], slot.drmaa_length);
+  job.status = statusName(slot.status);
+  job.checked_at = slot.checked_at;
+  return true;
+}
+
+void JobTable::put(const std::string &key, const TrackedJob &job) {
+  auto &drmaa = job.drmaa;
+  if (key.size() > UINT16_MAX || drmaa.size() > UINT8_MAX) {
+    throw std::length_error("Job key or DRMAA id too long to track: " + key);
+  }
+  if ((used + deleted + 1) * 4 > slots.size() * 3) {
+    rebuild(used * 2 + 2 > slots.size() ? slots.size() * 2 : slots.size());
+  } else if (garbage > (1 << 20) && garbage * 2 > arena.size()) {
+    rebuild(slots.size());
+  }
+  auto hash = hashKey(key);
+  auto &slot = slots[locate(key, hash)];
+  if (slot.status != empty_slot && slot.status != deleted_slot) {
+    if (slot.drmaa_length == drmaa.size() &&
+        memcmp(&arena[slot.offset + slot.key_length], drmaa.data(),
+               drmaa.size()) == 0) {
+      slot.status = packStatus(job.status);
+      slot.checked_at = job.checked_at;
+      return;
+    }
+    garbage += slot.key_length + slot.drmaa_length;
+  } else {
+    if (slot.status == deleted_slot) {
+      deleted--;
+    }
+    used++;
+  }
+  if (arena.size() + key.size() + drmaa.size() > UINT32_MAX) {
+    throw std::length_error("Too many jobs to track");
+  }
+  slot.hash = hash;
+  slot.checked_at = job.checked_at;
+  slot.offset = arena.size();
+  slot.key_length = key.size();
+  slot.drmaa_length = drmaa.size();
+  slot.status = packStatus(job.status);
+  arena.insert(arena.end(), key.begin(), key.end());
+  arena.insert(arena.end(), drmaa.begin(), drmaa.end());
+}
+
+bool JobTable::update(const std::string &key, const std::string &status,
+                      int64_t checked_at) {
+  auto &slot = slots[locate(key, hashKey(key))];
+  if (slot.status == empty_slot || slot.status == deleted_slot) {
+    return false;
+  }
+  slot.status = packStatus(status);
+  slot.checked_at = checked_at;
+  return true;
+}
+
+bool JobTable::erase(const std::string &key) {
+  auto &slot = slots[locate(key, hashKey(key))];
+  if (slot.status == empty_slot || slot.status == deleted_slot) {
+    return false;
+  }
+  garbage += slot.key_length + slot.drmaa_length;
+  slot.status = deleted_slot;
+  used--;
+  deleted++;
+  return true;
+}
+
+size_t JobTable::size() const { return used; }
+
+size_t JobTable::bytes() const {
+  return sizeof(*this) + slots.capacity() * sizeof(Slot) + arena.capacity();
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct TrackedJob {
+  std::string drmaa;
+  std::string status;
+  // When we last asked DRMAA about it, in seconds since the epoch, or 0 if we
+  // haven't yet
+  int64_t checked_at;
+};
+
+// The jobs we are currently tracking, as a flat open-addressing hash table from
+// job key to DRMAA id, status and when it was last checked. Keys and ids are
+// copied into one shared arena, so each job costs a 16-byte slot plus its key
+// and id, with no per-job allocations. The arena is compacted whenever the
+// table is rehashed.
+//
+// Not thread-safe; callers are expected to hold their own lock.
+class JobTable {
+public:
+  JobTable();
+
+  // Returns the status, or nullptr if the job isn't in the table
+  const char *status(const std::string &key) const;
+  bool get(const std::string &key, TrackedJob &job) const;
+  void put(const std::string &key, const TrackedJob &job);
+  // Change the status of a job already in the table
+  bool update(const std::string &key, const std::string &status,
+              int64_t checked_at);
+  bool erase(const std::string &key);
+  size_t size() const;
+  // Memory held by the table, including slack
+  size_t bytes() const;
+
+private:
+  struct Slot {
+    uint32_t hash;
+    // Seconds since the epoch, which fit unsigned 32 bits until 2106; half
+    // the size of an int64_t keeps the slot to 16 bytes
+    uint32_t checked_at;
+    // Position of the key in the arena, followed directly by the DRMAA id
+    uint32_t offset;
+    uint16_t key_length;
+    uint8_t drmaa_length;
+    // A status code, or a marker for empty and deleted slots
+    uint8_t status;
+  };
+
+  // Find the slot holding a key or, if there isn't one, where it should go
+  size_t locate(const std::string &key, uint32_t hash) const;
+  void rebuild(size_t capacity);
+
+  std::vector<Slot> slots;
+  std::vector<char> arena;
+  size_t used;
+  size_t deleted;
+  // Bytes in the arena belonging to deleted jobs
+  size_t garbage;
+};
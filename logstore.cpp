@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+#include <zlib.h>
+#include "logstore.hpp"
+
+static const size_t header_length = 11;
+static const size_t compact_minimum = 1 << 20;
+
+enum record_type { JobRecordType = 1, UsageRecordType = 2, DeleteRecordType = 3 };
+
+static void putInt(std::string &output, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    output += (char)((value >> (8 * i)) & 0xFF);
+  }
+}
+
+static uint64_t getInt(const std::string &input, size_t &offset, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes && offset < input.size(); i++) {
+    value |= (uint64_t)(unsigned char)input[offset++] << (8 * i);
+  }
+  return value;
+}
+
+// Strings longer than their length field can say are cut short, rather than
+// leaving a length that doesn't match the data and breaking every record after
+static void putString(std::string &output, const std::string &value) {
+  auto length = std::min<size_t>(value.size(), 0xFFFF);
+  putInt(output, length, 2);
+  output.append(value, 0, length);
+}
+
+static std::string getString(const std::string &input, size_t &offset) {
+  auto length = getInt(input, offset, 2);
+  auto value = input.substr(std::min(offset, input.size()), length);
+  offset += length;
+  return value;
+}
+
+static std::string encode(record_type type, const std::string &key,
+                          const std::string &payload) {
+  std::string record;
+  putInt(record, 0, 4);
+  putInt(record, type, 1);
+  putInt(record, key.size(), 2);
+  putInt(record, payload.size(), 4);
+  record += key;
+  record += payload;
+  auto crc = crc32(0, (const Bytef *)record.data() + 4, record.size() - 4);
+  for (int i = 0; i < 4; i++) {
+    record[i] = (char)((crc >> (8 * i)) & 0xFF);
+  }
+  return record;
+}
+
+static std::string encodeJob(const std::string &key, const JobRecord &record) {
+  std::string payload;
+  putInt(payload, record.updated_at, 8);
+  putString(payload, record.drmaa);
+  putString(payload, record.status);
+  putString(payload, record.job_name);
+  putString(payload, record.job_category);
+  putString(payload, record.output_path);
+  putString(payload, record.error_path);
+  return encode(JobRecordType, key, payload);
+}
+
+static size_t recordLength(const std::string &data, size_t offset) {
+  offset += 5;
+  auto key_length = getInt(data, offset, 2);
+  auto payload_length = getInt(data, offset, 4);
+  return header_length + key_length + payload_length;
+}
+
+// Decode a job record starting at offset in data
+static void decodeJob(const std::string &data, size_t offset,
+                      JobRecord &output) {
+  size_t position = offset + 5;
+  auto key_length = getInt(data, position, 2);
+  auto end = offset + recordLength(data, offset);
+  position = offset + header_length + key_length;
+  output.updated_at = (int64_t)getInt(data, position, 8);
+  output.drmaa = getString(data, position);
+  output.status = getString(data, position);
+  output.job_name = getString(data, position);
+  output.job_category = getString(data, position);
+  // Records written before log paths were kept stop here
+  output.output_path.clear();
+  output.error_path.clear();
+  if (position < end) {
+    output.output_path = getString(data, position);
+    output.error_path = getString(data, position);
+  }
+}
+
+LogStateStore::LogStateStore(const std::string &path_)
+    : path(path_), fd(open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644)),
+      end(0), garbage(0) {
+  if (fd == -1) {
+    throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+  }
+  auto size = lseek(fd, 0, SEEK_END);
+  end = replay(fd, size, index, order, garbage);
+  if (end != size) {
+    std::cerr << "Discarding " << (size - end) << " damaged bytes at the end of "
+              << path << std::endl;
+    if (ftruncate(fd, end) != 0) {
+      throw std::runtime_error("Cannot truncate " + path + ": " +
+                               strerror(errno));
+    }
+  }
+}
+
+LogStateStore::~LogStateStore() {
+  fdatasync(fd);
+  close(fd);
+}
+
+void LogStateStore::apply(const std::string &data, size_t offset,
+                          off_t position, Index &target, Order &target_order,
+                          size_t &waste) {
+  size_t cursor = offset + 4;
+  auto type = getInt(data, cursor, 1);
+  auto key_length = getInt(data, cursor, 2);
+  auto key = data.substr(offset + header_length, key_length);
+  Location location{position, (uint32_t)recordLength(data, offset)};
+  switch (type) {
+  case JobRecordType: {
+    JobRecord job;
+    decodeJob(data, offset, job);
+    auto &entry = target[key];
+    if (entry.job.length > 0) {
+      target_order.erase(std::make_pair(entry.updated_at, key));
+    }
+    waste += entry.job.length;
+    entry.job = location;
+    entry.status = job.status;
+    entry.updated_at = job.updated_at;
+    target_order.insert(std::make_pair(entry.updated_at, key));
+    break;
+  }
+  case UsageRecordType: {
+    auto &entry = target[key];
+    waste += entry.usage.length;
+    entry.usage = location;
+    break;
+  }
+  case DeleteRecordType: {
+    auto it = target.find(key);
+    if (it != target.end()) {
+      if (it->second.job.length > 0) {
+        target_order.erase(std::make_pair(it->second.updated_at, key));
+      }
+      waste += it->second.job.length + it->second.usage.length;
+      target.erase(it);
+    }
+    waste += location.length;
+    break;
+  }
+  }
+}
+
+off_t LogStateStore::replay(int source, off_t size, Index &target,
+                            Order &target_order, size_t &waste) {
+  std::string record;
+  off_t offset = 0;
+  while (offset + (off_t)header_length <= size) {
+    record.resize(header_length);
+    if (pread(source, &record[0], header_length, offset) !=
+        (ssize_t)header_length) {
+      break;
+    }
+    auto length = recordLength(record, 0);
+    size_t position = 0;
+    auto crc = getInt(record, position, 4);
+    auto type = getInt(record, position, 1);
+    record.resize(length);
+    if (type < JobRecordType || type > DeleteRecordType ||
+        offset + (off_t)length > size ||
+        pread(source, &record[0], length, offset) != (ssize_t)length ||
+        crc32(0, (const Bytef *)record.data() + 4, length - 4) != crc) {
+      break;
+    }
+    apply(record, 0, offset, target, target_order, waste);
+    offset += length;
+  }
+  return offset;
+}
+
+void LogStateStore::append(const std::string &records) {
+  size_t written = 0;
+  while (written < records.size()) {
+    auto result =
+        write(fd, records.data() + written, records.size() - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Cannot write to " + path + ": " +
+                               strerror(errno));
+    }
+    written += result;
+  }
+  // Update the index from what we wrote, so it is always exactly what a
+  // replay would produce
+  for (size_t offset = 0; offset < records.size();
+       offset += recordLength(records, offset)) {
+    apply(records, offset, end + offset, index, order, garbage);
+  }
+  end += records.size();
+}
+
+bool LogStateStore::read(const Location &location, std::string &record) {
+  if (location.length == 0) {
+    return false;
+  }
+  record.resize(location.length);
+  return pread(fd, &record[0], location.length, location.offset) ==
+         (ssize_t)location.length;
+}
+
+bool LogStateStore::get(const std::string &key, JobRecord &record) {
+  std::unique_lock<std::mutex> guard(lock);
+  auto it = index.find(key);
+  std::string data;
+  if (it == index.end() || !read(it->second.job, data)) {
+    return false;
+  }
+  decodeJob(data, 0, record);
+  return true;
+}
+
+void LogStateStore::put(const std::string &key, const JobRecord &record) {
+  std::unique_lock<std::mutex> guard(lock);
+  append(encodeJob(key, record));
+}
+
+void LogStateStore::putAll(
+    const std::vector<std::pair<std::string, JobRecord>> &records) {
+  std::string data;
+  for (auto &record : records) {
+    data += encodeJob(record.first, record.second);
+  }
+  std::unique_lock<std::mutex> guard(lock);
+  append(data);
+}
+
+std::map<std::string, std::string>
+LogStateStore::statuses(const std::vector<std::string> &keys) {
+  std::map<std::string, std::string> output;
+  std::unique_lock<std::mutex> guard(lock);
+  for (auto &key : keys) {
+    auto it = index.find(key);
+    if (it != index.end() && it->second.job.length > 0) {
+      output[key] = it->second.status;
+    }
+  }
+  return output;
+}
+
+void LogStateStore::putUsage(const std::string &key,
+                             const std::map<std::string, double> &usage) {
+  std::string payload;
+  putInt(payload, usage.size(), 2);
+  for (auto &resource : usage) {
+    uint64_t bits;
+    memcpy(&bits, &resource.second, sizeof(bits));
+    putString(payload, resource.first);
+    putInt(payload, bits, 8);
+  }
+  std::unique_lock<std::mutex> guard(lock);
+  append(encode(UsageRecordType, key, payload));
+}
+
+std::map<std::string, double> LogStateStore::getUsage(const std::string &key) {
+  std::map<std::string, double> output;
+  std::unique_lock<std::mutex> guard(lock);
+  auto it = index.find(key);
+  std::string data;
+  if (it == index.end() || !read(it->second.usage, data)) {
+    return output;
+  }
+  size_t offset = header_length + key.size();
+  auto count = getInt(data, offset, 2);
+  for (uint64_t i = 0; i < count; i++) {
+    auto name = getString(data, offset);
+    auto bits = getInt(data, offset, 8);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    output[name] = value;
+  }
+  return output;
+}
+
+std::vector<std::pair<std::string, JobRecord>>
+LogStateStore::list(const JobFilter &filter, const ListCursor &after,
+                    size_t limit) {
+  std::vector<std::pair<std::string, JobRecord>> output;
+  std::unique_lock<std::mutex> guard(lock);
+  // Walk the jobs in listing order from wherever the page starts, so each page
+  // only costs what it looks at
+  auto since = std::make_pair(filter.since, std::string());
+  auto cursor = std::make_pair(after.updated_at, after.key);
+  auto start = !after.key.empty() && cursor >= since
+                   ? order.upper_bound(cursor)
+                   : order.lower_bound(since);
+  std::string data;
+  for (auto candidate = start;
+       candidate != order.end() && output.size() < limit &&
+       (filter.until == 0 || candidate->first < filter.until);
+       ++candidate) {
+    auto &job = index[candidate->second];
+    if (!filter.status.empty() && job.status != filter.status) {
+      continue;
+    }
+    JobRecord record;
+    if (!read(job.job, data)) {
+      continue;
+    }
+    decodeJob(data, 0, record);
+    if ((!filter.drmaa.empty() && record.drmaa != filter.drmaa) ||
+        record.job_name.compare(0, filter.job_name_prefix.size(),
+                                filter.job_name_prefix) != 0) {
+      continue;
+    }
+    output.push_back(std::make_pair(candidate->second, record));
+  }
+  return output;
+}
+
+void LogStateStore::unfinished(
+    const std::function<void(const std::string &, const JobRecord &)>
+        &consumer) {
+  std::unique_lock<std::mutex> guard(lock);
+  std::string data;
+  for (auto &entry : index) {
+    if (!isFinished(entry.second.status) && read(entry.second.job, data)) {
+      JobRecord record;
+      decodeJob(data, 0, record);
+      consumer(entry.first, record);
+    }
+  }
+}
+
+std::vector<std::string>
+LogStateStore::expire(const std::map<std::string, double> &retention,
+                      size_t limit) {
+  std::vector<std::string> output;
+  auto now = time(nullptr);
+  double shortest = retention.at("*");
+  for (auto &rule : retention) {
+    shortest = std::min(shortest, rule.second);
+  }
+  std::unique_lock<std::mutex> guard(lock);
+  std::string data;
+  // Oldest first, stopping at the first job too young for any rule, so the
+  // jobs that are still live are never looked at
+  for (auto candidate = order.begin();
+       candidate != order.end() && output.size() < limit &&
+       now - candidate->first > shortest * 86400;
+       ++candidate) {
+    auto &status = index.at(candidate->second).status;
+    auto rule = retention.find(status);
+    auto days = rule == retention.end() ? retention.at("*") : rule->second;
+    if (now - candidate->first > days * 86400) {
+      output.push_back(candidate->second);
+    }
+  }
+  for (auto &key : output) {
+    data += encode(DeleteRecordType, key, "");
+  }
+  append(data);
+  return output;
+}
+
+void LogStateStore::compact() {
+  // Copy the live records to a new file without holding the lock, since
+  // existing records never change; then take the lock to copy anything written
+  // in the mean time and swap the files over.
+  std::vector<std::pair<std::string, Entry>> live;
+  off_t snapshot;
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    if ((size_t)end < compact_minimum || garbage < (size_t)end / 2) {
+      return;
+    }
+    live.assign(index.begin(), index.end());
+    snapshot = end;
+  }
+
+  auto compact_path = path + ".compact";
+  int compact_fd =
+      open(compact_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (compact_fd == -1) {
+    std::cerr << "Cannot open " << compact_path << ": " << strerror(errno)
+              << std::endl;
+    return;
+  }
+  std::string buffer;
+  std::string record;
+  for (auto &entry : live) {
+    for (auto location : {entry.second.job, entry.second.usage}) {
+      // Reading through the old descriptor is safe because only compaction
+      // replaces it and only one compaction runs at a time
+      if (location.length > 0 && read(location, record)) {
+        buffer += record;
+      }
+    }
+    if (buffer.size() > (1 << 16) || &entry == &live.back()) {
+      if (write(compact_fd, buffer.data(), buffer.size()) !=
+          (ssize_t)buffer.size()) {
+        std::cerr << "Cannot write " << compact_path << ": " << strerror(errno)
+                  << std::endl;
+        close(compact_fd);
+        unlink(compact_path.c_str());
+        return;
+      }
+      buffer.clear();
+    }
+  }
+
+  std::unique_lock<std::mutex> guard(lock);
+  buffer.resize(end - snapshot);
+  if (!buffer.empty() &&
+      (pread(fd, &buffer[0], buffer.size(), snapshot) !=
+           (ssize_t)buffer.size() ||
+       write(compact_fd, buffer.data(), buffer.size()) !=
+           (ssize_t)buffer.size())) {
+    std::cerr << "Cannot copy new records to " << compact_path << ": "
+              << strerror(errno) << std::endl;
+    close(compact_fd);
+    unlink(compact_path.c_str());
+    return;
+  }
+  auto compact_end = lseek(compact_fd, 0, SEEK_END);
+  Index compact_index;
+  Order compact_order;
+  size_t compact_garbage = 0;
+  if (replay(compact_fd, compact_end, compact_index, compact_order,
+             compact_garbage) !=
+          compact_end ||
+      fdatasync(compact_fd) != 0 ||
+      rename(compact_path.c_str(), path.c_str()) != 0) {
+    std::cerr << "Failed to replace " << path << " with compacted log"
+              << std::endl;
+    close(compact_fd);
+    unlink(compact_path.c_str());
+    return;
+  }
+  std::cerr << "Compacted " << path << " from " << end << " to " << compact_end
+            << " bytes" << std::endl;
+  close(fd);
+  fd = compact_fd;
+  end = compact_end;
+  garbage = compact_garbage;
+  index.swap(compact_index);
+  order.swap(compact_order);
+}
+
+size_t LogStateStore::size() {
+  std::unique_lock<std::mutex> guard(lock);
+  return index.size();
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <sys/types.h>
+#include "statestore.hpp"
+
+// A state store that appends every change to a log file and keeps an index of
+// where the latest record for each job lives in memory. Point lookups and
+// updates cost one pread or one write. Superseded records are dropped by
+// rewriting the log in the background once they make up most of the file.
+//
+// Every record is:
+//
+//   crc32 (u32) type (u8) key length (u16) payload length (u32) key payload
+//
+// where the checksum covers everything after it and the payload depends on the
+// type:
+//
+//   job: updated_at (i64) then drmaa, status, job name, job category, output
+//        path, error path, each as a length (u16) and bytes, cut short at
+//        65535 bytes; the paths may be missing from older records
+//   usage: count (u16) then for each, a name length (u16), name, value (f64)
+//   delete: nothing
+//
+// Integers are little-endian. On start up, the log is replayed to rebuild the
+// index and anything after the first damaged record is discarded.
+class LogStateStore : public StateStore {
+public:
+  explicit LogStateStore(const std::string &path);
+  ~LogStateStore();
+
+  bool get(const std::string &key, JobRecord &record);
+  void put(const std::string &key, const JobRecord &record);
+  void putAll(const std::vector<std::pair<std::string, JobRecord>> &records);
+  std::map<std::string, std::string>
+  statuses(const std::vector<std::string> &keys);
+  void putUsage(const std::string &key,
+                const std::map<std::string, double> &usage);
+  std::map<std::string, double> getUsage(const std::string &key);
+  std::vector<std::pair<std::string, JobRecord>>
+  list(const JobFilter &filter, const ListCursor &after, size_t limit);
+  void unfinished(
+      const std::function<void(const std::string &, const JobRecord &)>
+          &consumer);
+  std::vector<std::string> expire(const std::map<std::string, double> &retention,
+                                  size_t limit);
+  void compact();
+  size_t size();
+
+private:
+  struct Location {
+    off_t offset;
+    uint32_t length;
+  };
+  struct Entry {
+    Location job;
+    Location usage;
+    // Enough to answer status queries and expire jobs without reading
+    std::string status;
+    int64_t updated_at;
+  };
+  typedef std::unordered_map<std::string, Entry> Index;
+  // The updated_at and key of every job in the index, in listing order
+  typedef std::set<std::pair<int64_t, std::string>> Order;
+
+  // Must be called with the lock held
+  void append(const std::string &records);
+  bool read(const Location &location, std::string &record);
+  // Update an index with the record at offset in data, which is at position in
+  // the file
+  void apply(const std::string &data, size_t offset, off_t position,
+             Index &target, Order &target_order, size_t &waste);
+  // Apply every intact record in a file to an index, returning the offset
+  // after the last one
+  off_t replay(int source, off_t size, Index &target, Order &target_order,
+               size_t &waste);
+
+  std::string path;
+  std::mutex lock;
+  int fd;
+  off_t end;
+  size_t garbage;
+  Index index;
+  Order order;
+};
@@ -1,15 +1,38 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
+#include <thread>
 #include <pistache/endpoint.h>
 #include <pistache/router.h>
 #include <json/json.h>
 #include <openssl/sha.h>
+#include "capture.hpp"
+#include "cbor.hpp"
+#include "compression.hpp"
+#include "env.hpp"
+#include "joblogs.hpp"
+#include "peercred.hpp"
 #include "stateful.hpp"
+#include "tracing.hpp"
+#include "upgrade.hpp"
 #include "sys/types.h"
 #include "sys/sysinfo.h"
+#include "sys/stat.h"
 
 using namespace Pistache;
 
 const char *hexnum = "0123456789ABCDEF";
+static const auto cbor_type =
+    Http::Mime::MediaType::fromString("application/cbor");
 
 static int hexdigit(char c) {
   switch (c) {
@@ -58,53 +81,927 @@ static int hexdigit(char c) {
 
 class Controller {
 public:
-  Controller(const std::shared_ptr<StatefulDrmaa> &state) throw(
+  Controller(const std::shared_ptr<StatefulDrmaa> &state,
+             const std::shared_ptr<CaptureWriter> &capture_ = nullptr) throw(
       drmaa::exception)
-      : statefulDrmaa(state) {}
+      : statefulDrmaa(state), capture(capture_), active(0), draining(false),
+        submit_workers(envSize("DRMAAWS_WORKER_THREADS", 16),
+                       envSize("DRMAAWS_WORKER_QUEUE", 1024)),
+        read_workers(envSize("DRMAAWS_READ_THREADS", 4),
+                     envSize("DRMAAWS_READ_QUEUE", 4096)),
+        admin_workers(envSize("DRMAAWS_ADMIN_THREADS", 2),
+                      envSize("DRMAAWS_ADMIN_QUEUE", 64)),
+        log_workers(envSize("DRMAAWS_LOG_THREADS", 8),
+                    envSize("DRMAAWS_LOG_QUEUE", 8)),
+        tenant_workers(envSize(
+            "DRMAAWS_TENANT_WORKERS",
+            (envSize("DRMAAWS_WORKER_THREADS", 16) + 1) / 2)),
+        rejected(0), known_answers(0), tenant_limited(0),
+        max_body(envSize("DRMAAWS_MAX_BODY", 16 << 20)),
+        local_peers(getenv("DRMAAWS_LOCAL_UIDS")) {}
+
+  // Turn away new requests and wait for those in progress to finish. Returns
+  // false if they didn't finish in time.
+  bool drain(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> guard(drain_lock);
+    draining = true;
+    return drained.wait_for(guard, timeout, [this] { return active == 0; });
+  }
+
+  bool isDraining() {
+    std::unique_lock<std::mutex> guard(drain_lock);
+    return draining;
+  }
+
   void run(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, submit_workers);
+    if (!*admission) {
+      return;
+    }
+    auto trace = std::make_shared<tracing::Trace>("POST /run");
+    tracing::Scope scope(trace->id());
+    if (trace->id() != 0) {
+      writer.headers().addRaw(
+          Http::Header::Raw("X-Trace-Id", tracing::format(trace->id())));
+    }
+    JobRequest job;
+    {
+      tracing::Span span("auth");
+      if (!checkSignature(request, writer)) {
+        return;
+      }
+    }
+    {
+      tracing::Span span("decode");
+      if (!parseJob(request, writer, job)) {
+        return;
+      }
+    }
+    auto cbor = isCbor(request);
+    auto key = job.str();
+    // Most requests are clients asking again about jobs we already know, so
+    // answer those straight away instead of queueing them behind submissions
+    JobState state;
+    if (statefulDrmaa->cached(key, state)) {
+      known_answers++;
+      sendState(writer, key, state, cbor);
+      return;
+    }
+    // The submit lane is first come, first served, so one tenant flooding it
+    // would have everyone else's jobs wait behind its own before they ever
+    // got to the fair queue. Each tenant only gets so many places in it.
+    auto place =
+        std::make_shared<TenantPlace>(*this, statefulDrmaa->tenant(job));
+    if (!place->held) {
+      tenant_limited++;
+      sendState(writer, key, {"THROTTLED", time(nullptr), false}, cbor);
+      return;
+    }
+    offload(writer, admission, [this, job, key, trace, cbor,
+                                place](Http::ResponseWriter &writer) {
+      tracing::Scope scope(trace->id());
+      try {
+        sendState(writer, key, statefulDrmaa->run(job, key), cbor);
+      } catch (drmaa::exception &e) {
+        writer.send(Http::Code::Conflict, e.what());
+      }
+    });
+  }
+
+  void sendState(Http::ResponseWriter &writer, const std::string &key,
+                 const JobState &state, bool cbor) {
+    writer.headers().addRaw(Http::Header::Raw("X-Job-Key", key));
+    // How long ago DRMAA told us this, if it has since we started
+    if (state.checked_at > 0) {
+      writer.headers().addRaw(Http::Header::Raw(
+          "Age", std::to_string(std::max<int64_t>(
+                     0, time(nullptr) - state.checked_at))));
+    }
+    if (state.stale) {
+      writer.headers().addRaw(
+          Http::Header::Raw("Warning", "110 - \"Response is Stale\""));
+    }
+    if (cbor) {
+      writer.headers().add<Http::Header::ContentType>(cbor_type);
+      writer.send(Http::Code::Ok, CborWriter().text(state.status).str());
+      return;
+    }
+    writer.headers().add<Http::Header::ContentType>(MIME(Application, Json));
+    auto response = writer.stream(Http::Code::Ok);
+    response << "\"" << state.status.c_str() << "\"" << Http::ends;
+  }
+
+  void status(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, read_workers);
+    if (!*admission) {
+      return;
+    }
+    static const Json::ArrayIndex max_keys = 10000;
+    if (!checkSignature(request, writer)) {
+      return;
+    }
+    std::vector<std::string> keys;
+    auto cbor = isCbor(request);
+    if (cbor) {
+      std::string body;
+      if (!decodeBody(request, writer, body)) {
+        return;
+      }
+      try {
+        keys = readStrings(body);
+      } catch (CborError &e) {
+        writer.send(Http::Code::Bad_Request, e.what());
+        return;
+      }
+      if (keys.size() > max_keys) {
+        writer.send(Http::Code::Request_Entity_Too_Large,
+                    "Too many job keys requested.");
+        return;
+      }
+    } else {
+      Json::Value value;
+      if (!parseJson(request, writer, value)) {
+        return;
+      }
+      if (!value.isArray()) {
+        writer.send(Http::Code::Bad_Request, "Request is not a JSON array.");
+        return;
+      }
+      if (value.size() > max_keys) {
+        writer.send(Http::Code::Request_Entity_Too_Large,
+                    "Too many job keys requested.");
+        return;
+      }
+      for (auto item : value) {
+        if (!item.isString()) {
+          writer.send(Http::Code::Bad_Request,
+                      "Element in array is not a string.");
+          return;
+        }
+        keys.push_back(item.asString());
+      }
+    }
+
+    auto encoding = acceptedEncoding(request);
+    offload(writer, admission, [this, keys, encoding,
+                                cbor](Http::ResponseWriter &writer) {
+      if (!statefulDrmaa->drmaaAvailable()) {
+        writer.headers().addRaw(
+            Http::Header::Raw("Warning", "110 - \"Response is Stale\""));
+      }
+      auto statuses = statefulDrmaa->status(keys);
+      if (cbor) {
+        CborWriter output;
+        output.map(keys.size());
+        for (auto &key : keys) {
+          auto it = statuses.find(key);
+          output.text(key);
+          if (it == statuses.end()) {
+            output.null();
+          } else {
+            output.text(it->second);
+          }
+        }
+        sendBody(writer, encoding, cbor_type, output.str());
+        return;
+      }
+      Json::Value output(Json::objectValue);
+      for (auto &key : keys) {
+        auto it = statuses.find(key);
+        output[key] = it == statuses.end() ? Json::Value() : it->second;
+      }
+      Json::FastWriter jsonWriter;
+      sendJson(writer, encoding, jsonWriter.write(output));
+    });
+  }
+
+  void control(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, submit_workers);
+    if (!*admission) {
+      return;
+    }
+    static const std::map<std::string,
+                          std::pair<bool (drmaa::job::*)(), std::string>>
+        actions = {{"kill", {&drmaa::job::kill, "FAILED"}},
+                   {"suspend", {&drmaa::job::suspend, "WAITING"}},
+                   {"resume", {&drmaa::job::resume, "INFLIGHT"}},
+                   {"hold", {&drmaa::job::hold, "QUEUED"}},
+                   {"release", {&drmaa::job::release, "QUEUED"}}};
+    auto action = actions.find(request.param(":action").as<std::string>());
+    if (action == actions.end()) {
+      writer.send(Http::Code::Not_Found, "Unknown action.");
+      return;
+    }
+    Json::Value value;
+    if (!checkSignature(request, writer) ||
+        !parseJson(request, writer, value)) {
+      return;
+    }
+    if (!value.isObject()) {
+      writer.send(Http::Code::Bad_Request, "Request is not a JSON object");
+      return;
+    }
+
+    std::vector<std::string> keys;
+    // Finding jobs by name or category means reading the store, so it waits
+    // for the worker
+    auto by_name = false;
+    std::string job_name, job_category;
+    if (value.isMember("key") && value["key"].isString()) {
+      keys.push_back(value["key"].asString());
+    } else if (value.isMember("keys") && value["keys"].isArray()) {
+      for (auto item : value["keys"]) {
+        if (!item.isString()) {
+          writer.send(Http::Code::Bad_Request,
+                      "Element in array is not a string.");
+          return;
+        }
+        keys.push_back(item.asString());
+      }
+    } else if (value.get(drmaa::job_name, "").isString() &&
+               value.get(drmaa::job_category, "").isString() &&
+               (value.isMember(drmaa::job_name) ||
+                value.isMember(drmaa::job_category))) {
+      by_name = true;
+      job_name = value.get(drmaa::job_name, "").asString();
+      job_category = value.get(drmaa::job_category, "").asString();
+    } else {
+      writer.send(Http::Code::Bad_Request,
+                  "Request must have a key, keys, or a job name or category.");
+      return;
+    }
+
+    auto encoding = acceptedEncoding(request);
+    offload(writer, admission, [this, action, keys, by_name, job_name,
+                                job_category,
+                                encoding](Http::ResponseWriter &writer) {
+      auto targets =
+          by_name ? statefulDrmaa->select(job_name, job_category) : keys;
+      Json::Value output(Json::objectValue);
+      for (auto outcome : statefulDrmaa->control(
+               action->second.first, action->second.second, targets)) {
+        Json::Value result(Json::objectValue);
+        result["changed"] = outcome.second.changed;
+        if (!outcome.second.status.empty()) {
+          result["status"] = outcome.second.status;
+        }
+        if (!outcome.second.error.empty()) {
+          result["error"] = outcome.second.error;
+        }
+        output[outcome.first] = result;
+      }
+      Json::FastWriter jsonWriter;
+      sendJson(writer, encoding, jsonWriter.write(output));
+    });
+  }
+
+  void usage(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, read_workers);
+    if (!*admission) {
+      return;
+    }
+    JobRequest job;
+    if (!checkSignature(request, writer) || !parseJob(request, writer, job)) {
+      return;
+    }
+    auto cbor = isCbor(request);
+    offload(writer, admission, [this, job, cbor](Http::ResponseWriter &writer) {
+      auto usage = statefulDrmaa->usage(job);
+      if (usage.empty()) {
+        writer.send(Http::Code::Not_Found, "No resource usage recorded.");
+        return;
+      }
+      if (cbor) {
+        CborWriter output;
+        output.map(usage.size());
+        for (auto resource : usage) {
+          output.text(resource.first).number(resource.second);
+        }
+        writer.headers().add<Http::Header::ContentType>(cbor_type);
+        writer.send(Http::Code::Ok, output.str());
+        return;
+      }
+      Json::Value value(Json::objectValue);
+      for (auto resource : usage) {
+        value[resource.first] = resource.second;
+      }
+      Json::FastWriter jsonWriter;
+      auto json = jsonWriter.write(value);
+      writer.headers().add<Http::Header::ContentType>(MIME(Application, Json));
+      auto response = writer.stream(Http::Code::Ok);
+      response << json.c_str() << Http::ends;
+    });
+  }
+
+  void runGraph(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, submit_workers);
+    if (!*admission) {
+      return;
+    }
+    Json::Value value;
+    if (!checkSignature(request, writer) ||
+        !parseJson(request, writer, value)) {
+      return;
+    }
+    if (!value.isObject() || !value["jobs"].isObject() ||
+        !(value["dependencies"].isNull() ||
+          value["dependencies"].isObject())) {
+      writer.send(Http::Code::Bad_Request,
+                  "Request must have an object of jobs and may have an object "
+                  "of dependencies.");
+      return;
+    }
+    std::map<std::string, JobRequest> jobs;
+    std::map<std::string, std::vector<std::string>> dependencies;
+    auto &job_values = value["jobs"];
+    for (auto it = job_values.begin(); it != job_values.end(); it++) {
+      std::string error;
+      if (!jobFromJson(*it, jobs[it.name()], error)) {
+        writer.send(Http::Code::Bad_Request, it.name() + ": " + error);
+        return;
+      }
+    }
+    auto &dependency_values = value["dependencies"];
+    for (auto it = dependency_values.begin(); it != dependency_values.end();
+         it++) {
+      if (!it->isArray()) {
+        writer.send(Http::Code::Bad_Request,
+                    it.name() + ": Dependencies must be an array.");
+        return;
+      }
+      auto &parents = dependencies[it.name()];
+      for (auto parent : *it) {
+        if (!parent.isString()) {
+          writer.send(Http::Code::Bad_Request,
+                      "Element in array is not a string.");
+          return;
+        }
+        parents.push_back(parent.asString());
+      }
+    }
+
+    auto encoding = acceptedEncoding(request);
+    offload(writer, admission, [this, jobs, dependencies,
+                                encoding](Http::ResponseWriter &writer) {
+      std::vector<GraphNode> nodes;
+      std::string id;
+      try {
+        id = statefulDrmaa->runGraph(jobs, dependencies, nodes);
+      } catch (std::invalid_argument &e) {
+        writer.send(Http::Code::Bad_Request, e.what());
+        return;
+      }
+      sendGraph(writer, encoding, id, nodes);
+    });
+  }
+
+  void graph(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, read_workers);
+    if (!*admission) {
+      return;
+    }
+    if (!checkSignature(request, writer, request.resource())) {
+      return;
+    }
+    auto id = request.param(":id").as<std::string>();
+    auto encoding = acceptedEncoding(request);
+    offload(writer, admission, [this, id,
+                                encoding](Http::ResponseWriter &writer) {
+      std::vector<GraphNode> nodes;
+      if (!statefulDrmaa->graph(id, nodes)) {
+        writer.send(Http::Code::Not_Found, "Unknown graph.");
+        return;
+      }
+      sendGraph(writer, encoding, id, nodes);
+    });
+  }
+
+  // Where a graph has got to, along with the status of each job that has
+  // been submitted
+  void sendGraph(Http::ResponseWriter &writer, Encoding encoding,
+                 const std::string &id, const std::vector<GraphNode> &nodes) {
+    std::vector<std::string> keys;
+    for (auto &node : nodes) {
+      keys.push_back(node.key);
+    }
+    auto statuses = statefulDrmaa->status(keys);
+    Json::Value output(Json::objectValue);
+    output["graph"] = id;
+    auto running = false;
+    auto failed = false;
+    for (auto &node : nodes) {
+      Json::Value job(Json::objectValue);
+      job["key"] = node.key;
+      job["state"] = node.state;
+      auto status = statuses.find(node.key);
+      if (node.state != "WAITING" && node.state != "CANCELLED" &&
+          status != statuses.end()) {
+        job["status"] = status->second;
+      }
+      output["jobs"][node.name] = job;
+      running = running || node.state == "WAITING" || node.state == "READY" ||
+                node.state == "SUBMITTED";
+      failed = failed || node.state == "FAILED";
+    }
+    output["state"] = running ? "RUNNING" : failed ? "FAILED" : "SUCCEEDED";
+    Json::FastWriter jsonWriter;
+    sendJson(writer, encoding, jsonWriter.write(output));
+  }
+
+  void listJobs(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, admin_workers);
+    if (!*admission) {
+      return;
+    }
+    static const size_t page_size = 500;
+    static const size_t default_limit = 1000;
+    static const size_t max_limit = 100000;
+    static const char *parameters[] = {"status",   "since", "until", "job_name",
+                                       "drmaa",    "limit", "after"};
+    // There's no body to sign, so sign the path and whichever parameters are
+    // present, in a fixed order
+    std::map<std::string, std::string> values;
+    auto signed_data = request.resource();
+    auto separator = '?';
+    for (auto parameter : parameters) {
+      auto value = request.query().get(parameter);
+      if (!value.isEmpty()) {
+        values[parameter] = value.get();
+        signed_data += separator;
+        signed_data += parameter;
+        signed_data += '=';
+        signed_data += value.get();
+        separator = '&';
+      }
+    }
+    if (!checkSignature(request, writer, signed_data)) {
+      return;
+    }
+
+    JobFilter filter{values["status"], atoll(values["since"].c_str()),
+                     atoll(values["until"].c_str()), values["job_name"],
+                     values["drmaa"]};
+    // A limit of 0 would leave nothing to hang a cursor on, so it means the
+    // default like a missing one
+    size_t limit = std::min<size_t>(
+        strtoul(values["limit"].c_str(), nullptr, 10), max_limit);
+    if (limit == 0) {
+      limit = default_limit;
+    }
+    // Cursors are the update time and key of the last job sent
+    ListCursor cursor{0, ""};
+    if (!values["after"].empty()) {
+      auto dash = values["after"].find('-');
+      if (dash == std::string::npos || dash + 1 == values["after"].size()) {
+        writer.send(Http::Code::Bad_Request, "Invalid cursor.");
+        return;
+      }
+      cursor.updated_at = atoll(values["after"].c_str());
+      cursor.key = values["after"].substr(dash + 1);
+    }
+
+    // Send the list a page at a time, so neither we nor the store have to hold
+    // all of it at once
+    auto encoding = acceptedEncoding(request);
+    offload(writer, admission, [this, filter, limit, cursor, encoding](
+                                   Http::ResponseWriter &writer) mutable {
+      writer.headers().add<Http::Header::ContentType>(MIME(Application, Json));
+      writer.headers().addRaw(Http::Header::Raw("Vary", "Accept-Encoding"));
+      std::unique_ptr<Compressor> compressor;
+      if (encoding != Encoding::Identity) {
+        writer.headers().addRaw(
+            Http::Header::Raw("Content-Encoding", encodingName(encoding)));
+        compressor.reset(new Compressor(encoding));
+      }
+      auto response = writer.stream(Http::Code::Ok);
+      // Pages are compressed as they go, flushing each so the client can start
+      // on it straight away
+      auto send = [&response, &compressor](const std::string &data, bool last) {
+        auto output = data;
+        if (compressor) {
+          output = compressor->write(data, !last);
+          if (last) {
+            output += compressor->finish();
+          }
+        }
+        // An empty chunk would end the response
+        if (!output.empty()) {
+          response.write(output.data(), output.size());
+          response.flush();
+        }
+      };
+      std::string page = "{\"jobs\":[";
+      Json::FastWriter jsonWriter;
+      size_t sent = 0;
+      auto more = true;
+      while (more && sent < limit) {
+        auto requested = std::min(page_size, limit - sent);
+        auto jobs = statefulDrmaa->list(filter, cursor, requested);
+        for (auto &job : jobs) {
+          Json::Value value(Json::objectValue);
+          value["key"] = job.first;
+          value["drmaa"] = job.second.drmaa;
+          value["status"] = job.second.status;
+          value["updated_at"] = (Json::Int64)job.second.updated_at;
+          value["job_name"] = job.second.job_name;
+          value["job_category"] = job.second.job_category;
+          auto json = jsonWriter.write(value);
+          json.pop_back();
+          page += (sent++ == 0 ? "" : ",") + json;
+          cursor = {job.second.updated_at, job.first};
+        }
+        send(page, false);
+        page.clear();
+        more = jobs.size() == requested;
+      }
+      // Only hand out a cursor if there's something after it
+      if (more && !cursor.key.empty() &&
+          !statefulDrmaa->list(filter, cursor, 1).empty()) {
+        page += "],\"next\":\"" + std::to_string(cursor.updated_at) + "-" +
+                cursor.key + "\"}";
+      } else {
+        page += "]}";
+      }
+      send(page, true);
+      response << Http::ends;
+    });
+  }
+
+  // A job's output or error log, optionally following it as it grows
+  void log(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, log_workers);
+    if (!*admission) {
+      return;
+    }
+    auto key = request.param(":key").as<std::string>();
+    auto stream = request.param(":stream").as<std::string>();
+    if (stream != "output" && stream != "error") {
+      writer.send(Http::Code::Not_Found, "Logs are output or error.");
+      return;
+    }
+    auto signed_data = request.resource();
+    auto follow_value = request.query().get("follow");
+    if (!follow_value.isEmpty()) {
+      signed_data += "?follow=" + follow_value.get();
+    }
+    if (!checkSignature(request, writer, signed_data)) {
+      return;
+    }
+    auto error = stream == "error";
+    auto follow = !follow_value.isEmpty() && follow_value.get() != "0";
+    auto range_header = request.headers().tryGetRaw("Range");
+    auto range = range_header.isEmpty() ? "" : range_header.get().value();
+
+    // Sending a big log to a slow client, or following one, can take as long
+    // as it likes, so these get workers of their own
+    offload(log_workers, writer, admission,
+            [this, admission, key, error, follow,
+             range](Http::ResponseWriter &writer) {
+              JobRecord record;
+              if (!statefulDrmaa->lookup(key, record)) {
+                writer.send(Http::Code::Not_Found, "Unknown job.");
+                return;
+              }
+              auto &path = error ? record.error_path : record.output_path;
+              if (path.empty()) {
+                writer.send(Http::Code::Not_Found, "No log path recorded.");
+                return;
+              }
+              LogFile file(path);
+              if (!file) {
+                writer.send(Http::Code::Not_Found, "Log has not been written.");
+                return;
+              }
+              auto size = file.size();
+              uint64_t first = 0;
+              uint64_t last = size == 0 ? 0 : size - 1;
+              auto requested = parseRange(range, size, first, last);
+              auto socket = writer.peer()->fd();
+              if (follow) {
+                // A range picks where to start; one past the end waits for more
+                uint64_t offset = 0;
+                if (requested == RangeRequest::Partial) {
+                  offset = first;
+                } else if (requested == RangeRequest::Unsatisfiable) {
+                  offset = size;
+                }
+                auto sent = file.follow(socket, offset, [this, &key] {
+                  if (isDraining()) {
+                    return false;
+                  }
+                  auto status = statefulDrmaa->status({key});
+                  return !status.empty() &&
+                         !isFinished(status.begin()->second);
+                });
+                admission->sentDirectly(sent ? 200 : 0);
+              } else if (requested == RangeRequest::Unsatisfiable) {
+                writer.headers().addRaw(Http::Header::Raw(
+                    "Content-Range", "bytes */" + std::to_string(size)));
+                writer.send(Http::Code::Requested_Range_Not_Satisfiable);
+              } else {
+                auto partial = requested == RangeRequest::Partial;
+                auto sent = file.send(
+                    socket, first, size == 0 ? 0 : last - first + 1, partial);
+                admission->sentDirectly(!sent ? 0 : partial ? 206 : 200);
+              }
+            });
+  }
+
+  void listAttributes(const Rest::Request &request,
+                      Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, admin_workers);
+    if (!*admission) {
+      return;
+    }
+    offload(writer, admission, [this](Http::ResponseWriter &writer) {
+      try {
+        Json::Value value(Json::objectValue);
+
+        for (auto name : drmaa::attribute_names()) {
+          value[name] = false;
+        }
+        for (auto name : drmaa::attribute_namesv()) {
+          value[name] = true;
+        }
+        Json::StyledWriter jsonWriter;
+        auto json = jsonWriter.write(value);
+        writer.headers().add<Http::Header::ContentType>(
+            MIME(Application, Json));
+        auto response = writer.stream(Http::Code::Ok);
+        response << json.c_str() << Http::ends;
+      } catch (drmaa::exception &e) {
+        writer.send(Http::Code::Internal_Server_Error, e.what());
+      }
+    });
+  }
+  void metrics(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, admin_workers);
+    if (!*admission) {
+      return;
+    }
+    offload(writer, admission, [this](Http::ResponseWriter &writer) {
+      struct sysinfo memInfo;
+      sysinfo(&memInfo);
+
+      writer.headers().add<Http::Header::ContentType>(MIME(Text, Plain));
+      auto response = writer.stream(Http::Code::Ok);
+      response << "# TYPE drmaaws_cache_size gauge\ndrmaaws_cache_size "
+               << std::to_string(statefulDrmaa->cacheSize()).c_str() << "\n"
+               << "# TYPE drmaaws_cache_bytes_per_job gauge\n"
+               << "drmaaws_cache_bytes_per_job "
+               << std::to_string(
+                      statefulDrmaa->cacheBytes() /
+                      std::max<size_t>(statefulDrmaa->cacheSize(), 1))
+                      .c_str()
+               << "\n"
+               << "# TYPE drmaaws_db_size gauge\ndrmaaws_db_size "
+               << std::to_string(statefulDrmaa->dbSize()).c_str() << "\n"
+               << "# TYPE drmaaws_index_size gauge\ndrmaaws_index_size "
+               << std::to_string(statefulDrmaa->indexSize()).c_str() << "\n"
+               << "# TYPE drmaaws_ram gauge\ndrmaaws_ram "
+               << std::to_string(memInfo.totalram * memInfo.mem_unit).c_str()
+               << "\n"
+               << "# TYPE drmaaws_swap gauge\ndrmaaws_swap "
+               << std::to_string(memInfo.totalswap * memInfo.mem_unit).c_str()
+               << "\n"
+               << "# TYPE drmaaws_purged_rows counter\ndrmaaws_purged_rows "
+               << std::to_string(statefulDrmaa->purgedRows()).c_str() << "\n"
+               << "# TYPE drmaaws_archived_jobs counter\ndrmaaws_archived_jobs "
+               << std::to_string(statefulDrmaa->archivedJobs()).c_str() << "\n"
+               << "# TYPE drmaaws_polls_scheduled gauge\n"
+               << "drmaaws_polls_scheduled "
+               << std::to_string(statefulDrmaa->pollsScheduled()).c_str()
+               << "\n"
+               << "# TYPE drmaaws_poll_backlog gauge\ndrmaaws_poll_backlog "
+               << std::to_string(statefulDrmaa->pollBacklog()).c_str() << "\n"
+               << "# TYPE drmaaws_drmaa_polls counter\ndrmaaws_drmaa_polls "
+               << std::to_string(statefulDrmaa->drmaaPolls()).c_str() << "\n"
+               << "# TYPE drmaaws_drmaa_available gauge\n"
+               << "drmaaws_drmaa_available "
+               << (statefulDrmaa->drmaaAvailable() ? "1" : "0") << "\n"
+               << "# TYPE drmaaws_breaker_trips counter\ndrmaaws_breaker_trips "
+               << std::to_string(statefulDrmaa->breakerTrips()).c_str() << "\n"
+               << "# TYPE drmaaws_stale_responses counter\n"
+               << "drmaaws_stale_responses "
+               << std::to_string(statefulDrmaa->staleAnswers()).c_str() << "\n"
+               << "# TYPE drmaaws_parked_submissions gauge\n"
+               << "drmaaws_parked_submissions "
+               << std::to_string(statefulDrmaa->parkedSubmissions()).c_str()
+               << "\n"
+               << "# TYPE drmaaws_coalesced_requests counter\n"
+               << "drmaaws_coalesced_requests "
+               << std::to_string(statefulDrmaa->coalescedRequests()).c_str()
+               << "\n"
+               << "# TYPE drmaaws_throttled_submissions counter\n"
+               << "drmaaws_throttled_submissions "
+               << std::to_string(statefulDrmaa->throttledSubmissions()).c_str()
+               << "\n"
+               << "# TYPE drmaaws_array_jobs counter\ndrmaaws_array_jobs "
+               << std::to_string(statefulDrmaa->arrayJobs()).c_str() << "\n"
+               << "# TYPE drmaaws_coalesced_submissions counter\n"
+               << "drmaaws_coalesced_submissions "
+               << std::to_string(statefulDrmaa->coalescedSubmissions()).c_str()
+               << "\n"
+               << "# TYPE drmaaws_graphs_running gauge\n"
+               << "drmaaws_graphs_running "
+               << std::to_string(statefulDrmaa->runningGraphs()).c_str()
+               << "\n";
+        response << "# TYPE drmaaws_worker_rejected_requests counter\n"
+               << "drmaaws_worker_rejected_requests "
+               << std::to_string(rejected).c_str() << "\n"
+               << "# TYPE drmaaws_known_answers counter\n"
+               << "drmaaws_known_answers "
+               << std::to_string(known_answers).c_str() << "\n"
+               << "# TYPE drmaaws_tenant_limited_submissions counter\n"
+               << "drmaaws_tenant_limited_submissions "
+               << std::to_string(tenant_limited).c_str() << "\n"
+               << "# TYPE drmaaws_trace_rate gauge\ndrmaaws_trace_rate "
+               << std::to_string(tracing::rate()).c_str() << "\n";
+      const std::pair<const char *, Executor *> lanes[] = {
+          {"submit", &submit_workers},
+          {"read", &read_workers},
+          {"admin", &admin_workers},
+          {"log", &log_workers}};
+      response << "# TYPE drmaaws_worker_queue_depth gauge\n";
+      for (auto &lane : lanes) {
+        response << "drmaaws_worker_queue_depth{lane=\"" << lane.first
+                 << "\"} " << std::to_string(lane.second->depth()).c_str()
+                 << "\n";
+      }
+      response << "# TYPE drmaaws_worker_wait_seconds summary\n";
+      for (auto &lane : lanes) {
+        auto labels = std::string("{lane=\"") + lane.first + "\"} ";
+        response << "drmaaws_worker_wait_seconds_sum" << labels.c_str()
+                 << std::to_string(lane.second->waited()).c_str() << "\n"
+                 << "drmaaws_worker_wait_seconds_count" << labels.c_str()
+                 << std::to_string(lane.second->started()).c_str() << "\n";
+      }
+      auto queues = statefulDrmaa->submitQueues();
+      response << "# TYPE drmaaws_submit_queue_depth gauge\n";
+      for (auto queue : queues) {
+        response << "drmaaws_submit_queue_depth{tenant=\""
+                 << escapeLabel(queue.tenant).c_str() << "\"} "
+                 << std::to_string(queue.depth).c_str() << "\n";
+      }
+      response << "# TYPE drmaaws_submit_wait_seconds summary\n";
+      for (auto queue : queues) {
+        auto labels = "{tenant=\"" + escapeLabel(queue.tenant) + "\"} ";
+        response << "drmaaws_submit_wait_seconds_sum" << labels.c_str()
+                 << std::to_string(queue.waited).c_str() << "\n"
+                 << "drmaaws_submit_wait_seconds_count" << labels.c_str()
+                 << std::to_string(queue.started).c_str() << "\n";
+      }
+      auto clusters = statefulDrmaa->clusterStats();
+      if (clusters.size() > 1) {
+        response << "# TYPE drmaaws_cluster_depth gauge\n";
+        for (auto &cluster : clusters) {
+          response << "drmaaws_cluster_depth{cluster=\""
+                   << escapeLabel(cluster.name).c_str() << "\"} "
+                   << std::to_string(cluster.depth).c_str() << "\n";
+        }
+        response << "# TYPE drmaaws_cluster_submit_seconds gauge\n";
+        for (auto &cluster : clusters) {
+          response << "drmaaws_cluster_submit_seconds{cluster=\""
+                   << escapeLabel(cluster.name).c_str() << "\"} "
+                   << std::to_string(cluster.submit_seconds).c_str() << "\n";
+        }
+      }
+      if (capture) {
+        response << "# TYPE drmaaws_captured_requests counter\n"
+                 << "drmaaws_captured_requests "
+                 << std::to_string(capture->captured()).c_str() << "\n"
+                 << "# TYPE drmaaws_capture_dropped counter\n"
+                 << "drmaaws_capture_dropped "
+                 << std::to_string(capture->dropped()).c_str() << "\n";
+      }
+      response << "# TYPE drmaaws_job_usage summary\n";
+      for (auto summary : statefulDrmaa->usageSummaries()) {
+        auto labels = "{category=\"" + escapeLabel(summary.category) +
+                      "\",prefix=\"" + escapeLabel(summary.prefix) +
+                      "\",resource=\"" + escapeLabel(summary.resource) + "\"} ";
+        response << "drmaaws_job_usage_sum" << labels.c_str()
+                 << std::to_string(summary.sum).c_str() << "\n"
+                 << "drmaaws_job_usage_count" << labels.c_str()
+                 << std::to_string(summary.count).c_str() << "\n";
+      }
+      response << Http::ends;
+    });
+  }
+
+  // Recent spans of sampled requests, or just one of them, in Chrome's trace
+  // event format
+  void trace(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, admin_workers);
+    if (!*admission) {
+      return;
+    }
+    auto signed_data = request.resource();
+    auto id = request.query().get("trace");
+    if (!id.isEmpty()) {
+      signed_data += "?trace=" + id.get();
+    }
+    if (!checkSignature(request, writer, signed_data)) {
+      return;
+    }
+    auto trace = id.isEmpty() ? 0 : tracing::parse(id.get());
+    auto encoding = acceptedEncoding(request);
+    offload(writer, admission, [this, trace,
+                                encoding](Http::ResponseWriter &writer) {
+      std::ostringstream output;
+      tracing::dump(output, trace);
+      sendJson(writer, encoding, output.str());
+    });
+  }
+
+  void traceRate(const Rest::Request &request, Http::ResponseWriter writer) {
+    auto admission =
+        std::make_shared<Admission>(*this, request, writer, admin_workers);
+    if (!*admission) {
+      return;
+    }
+    Json::Value value;
+    if (!checkSignature(request, writer) ||
+        !parseJson(request, writer, value)) {
+      return;
+    }
+    if (!value.isObject() || !value["rate"].isNumeric()) {
+      writer.send(Http::Code::Bad_Request, "Expected a rate.");
+      return;
+    }
+    tracing::setRate(value["rate"].asDouble());
+    std::cerr << "Tracing " << tracing::rate() << " of requests" << std::endl;
+    writer.headers().add<Http::Header::ContentType>(MIME(Application, Json));
+    writer.send(Http::Code::Ok, std::to_string(tracing::rate()));
+  }
+
+private:
+  bool checkSignature(const Rest::Request &request,
+                      Http::ResponseWriter &writer) {
+    return checkSignature(request, writer, request.body());
+  }
+  // Check the signature covers some data; requests without a body sign the
+  // path and query instead
+  bool checkSignature(const Rest::Request &request,
+                      Http::ResponseWriter &writer, const std::string &data) {
     static const char *psk = getenv("DRMAA_PSK");
     static const size_t psk_length = strlen(psk);
 
+    // The kernel vouches for callers on the local socket, so there's no need
+    // to hash anything
+    if (local_peers.trusted(writer.peer()->fd())) {
+      return true;
+    }
+
     auto authheader = request.headers().tryGetRaw("Authorization");
     if (authheader.isEmpty()) {
       writer.send(Http::Code::Bad_Request, "Request is not signed.");
-      return;
+      return false;
     }
     auto authorization = authheader.get().value();
     if (authorization.compare(0, 7, "signed ") != 0) {
       writer.send(Http::Code::Bad_Request, "Request is not signed.");
-      return;
+      return false;
     }
     if (authorization.length() < 7 + 2 * SHA_DIGEST_LENGTH) {
       writer.send(Http::Code::Bad_Request, "Signature is too short.");
-      return;
+      return false;
     }
 
     SHA_CTX shaContext;
     if (!SHA1_Init(&shaContext)) {
       writer.send(Http::Code::Internal_Server_Error,
                   "Security checking error.");
-      return;
+      return false;
     }
     if (!SHA1_Update(&shaContext, psk, psk_length)) {
       writer.send(Http::Code::Internal_Server_Error,
                   "Security checking error.");
-      return;
+      return false;
     }
-    if (!SHA1_Update(&shaContext, request.body().c_str(),
-                     request.body().length())) {
+    if (!SHA1_Update(&shaContext, data.c_str(), data.length())) {
       writer.send(Http::Code::Internal_Server_Error,
                   "Security checking error.");
-      return;
+      return false;
     }
     unsigned char sum[SHA_DIGEST_LENGTH];
     if (!SHA1_Final(sum, &shaContext)) {
       writer.send(Http::Code::Internal_Server_Error,
                   "Security checking error.");
-      return;
+      return false;
     }
     std::cerr << "Checking hash: client=" << authorization << " "
-              << request.body().length() << " bytes server=signed ";
+              << data.length() << " bytes server=signed ";
     for (size_t i = 0; i < SHA_DIGEST_LENGTH; i++) {
       std::cerr << hexnum[sum[i] % 0xf] << hexnum[sum[i] >> 4];
     }
@@ -115,25 +1012,135 @@ public:
                       hexdigit(authorization[7 + i * 2 + 1]);
       if (sum[i] != provided) {
         writer.send(Http::Code::Unauthorized, "Invalid signature.");
-        return;
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // The request body, decompressed if the client compressed it. The signature
+  // covers the body as sent, so it can be checked first.
+  bool decodeBody(const Rest::Request &request, Http::ResponseWriter &writer,
+                  std::string &body) {
+    auto encoding = Encoding::Identity;
+    auto header = request.headers().tryGet<Http::Header::ContentEncoding>();
+    if (header) {
+      switch (header->encoding()) {
+      case Http::Header::Encoding::Identity:
+        break;
+      case Http::Header::Encoding::Gzip:
+        encoding = Encoding::Gzip;
+        break;
+      default:
+        // Pistache doesn't have a name for zstd, so go by its magic number
+        if (!isZstd(request.body())) {
+          writer.send(Http::Code::Unsupported_Media_Type,
+                      "Unsupported content encoding.");
+          return false;
+        }
+        encoding = Encoding::Zstd;
       }
     }
+    try {
+      body = decompress(encoding, request.body(), max_body);
+    } catch (std::length_error &) {
+      writer.send(Http::Code::Request_Entity_Too_Large,
+                  "Request is too large.");
+      return false;
+    } catch (std::runtime_error &e) {
+      writer.send(Http::Code::Bad_Request, e.what());
+      return false;
+    }
+    return true;
+  }
+
+  static Encoding acceptedEncoding(const Rest::Request &request) {
+    auto header = request.headers().tryGetRaw("Accept-Encoding");
+    return header.isEmpty() ? Encoding::Identity
+                            : negotiate(header.get().value());
+  }
+
+  // Send a response, compressed if the client can take it and it is big
+  // enough to be worth it
+  void sendBody(Http::ResponseWriter &writer, Encoding encoding,
+                const Http::Mime::MediaType &type, const std::string &body) {
+    static const size_t compress_minimum = 1024;
+    writer.headers().add<Http::Header::ContentType>(type);
+    writer.headers().addRaw(Http::Header::Raw("Vary", "Accept-Encoding"));
+    if (encoding == Encoding::Identity || body.size() < compress_minimum) {
+      writer.send(Http::Code::Ok, body);
+      return;
+    }
+    writer.headers().addRaw(
+        Http::Header::Raw("Content-Encoding", encodingName(encoding)));
+    writer.send(Http::Code::Ok, compress(encoding, body));
+  }
 
+  void sendJson(Http::ResponseWriter &writer, Encoding encoding,
+                const std::string &json) {
+    sendBody(writer, encoding, MIME(Application, Json), json);
+  }
+
+  // Clients that would rather not deal in JSON can send jobs and job keys as
+  // CBOR instead, and get CBOR back
+  static bool isCbor(const Rest::Request &request) {
+    auto header = request.headers().tryGet<Http::Header::ContentType>();
+    return header &&
+           header->mime().toString().compare(0, 16, "application/cbor") == 0;
+  }
+
+  bool parseJson(const Rest::Request &request, Http::ResponseWriter &writer,
+                 Json::Value &value) {
+    std::string body;
+    if (!decodeBody(request, writer, body)) {
+      return false;
+    }
     Json::CharReaderBuilder builder;
     builder["collectComments"] = false;
-    Json::Value value;
     JSONCPP_STRING errs;
-    std::istringstream is(request.body());
+    std::istringstream is(body);
     if (!Json::parseFromStream(builder, is, &value, &errs)) {
       writer.send(Http::Code::Bad_Request, errs);
-      return;
+      return false;
+    }
+    return true;
+  }
+
+  bool parseJob(const Rest::Request &request, Http::ResponseWriter &writer,
+                JobRequest &job) {
+    if (isCbor(request)) {
+      std::string body;
+      if (!decodeBody(request, writer, body)) {
+        return false;
+      }
+      try {
+        readJob(body, job);
+      } catch (CborError &e) {
+        writer.send(Http::Code::Bad_Request, e.what());
+        return false;
+      }
+      return true;
+    }
+    Json::Value value;
+    if (!parseJson(request, writer, value)) {
+      return false;
+    }
+    std::string error;
+    if (!jobFromJson(value, job, error)) {
+      writer.send(Http::Code::Bad_Request, error);
+      return false;
     }
+    return true;
+  }
+
+  static bool jobFromJson(const Json::Value &value, JobRequest &job,
+                          std::string &error) {
     if (!value.isObject()) {
-      writer.send(Http::Code::Bad_Request, "Request is not a JSON object");
-      return;
+      error = "Request is not a JSON object";
+      return false;
     }
 
-    JobRequest job;
     for (auto attribute = value.begin(); attribute != value.end();
          attribute++) {
       if (attribute->isString()) {
@@ -143,90 +1150,404 @@ public:
 
         for (auto item : *attribute) {
           if (!item.isString()) {
-            writer.send(Http::Code::Bad_Request,
-                        "Element in array is not a string.");
-            return;
+            error = "Element in array is not a string.";
+            return false;
           }
           items.push_back(item.asString());
         }
         job.v_attributes()[attribute.name()] = std::move(items);
       } else {
-        writer.send(Http::Code::Bad_Request,
-                    "Argument must be array or string.");
+        error = "Argument must be array or string.";
+        return false;
       }
     }
-    try {
-      auto status = statefulDrmaa->run(job);
-      writer.headers().add<Http::Header::ContentType>(MIME(Application, Json));
-      auto response = writer.stream(Http::Code::Ok);
-      response << "\"" << status.c_str() << "\"" << Http::ends;
-    } catch (drmaa::exception &e) {
-      writer.send(Http::Code::Conflict, e.what());
+    return true;
+  }
+
+  static std::string escapeLabel(const std::string &value) {
+    std::string output;
+    for (auto c : value) {
+      switch (c) {
+      case '\\':
+        output += "\\\\";
+        break;
+      case '"':
+        output += "\\\"";
+        break;
+      case '\n':
+        output += "\\n";
+        break;
+      default:
+        output += c;
+      }
     }
+    return output;
   }
 
-  void listAttributes(const Rest::Request &request,
-                      Http::ResponseWriter writer) {
-    try {
-      Json::Value value(Json::objectValue);
+  // The headers a request was sent with, as the client sent them
+  static std::vector<std::pair<std::string, std::string>>
+  sentHeaders(const Rest::Request &request) {
+    std::vector<std::pair<std::string, std::string>> headers;
+    for (auto &raw : request.headers().rawList()) {
+      headers.emplace_back(raw.second.name(), raw.second.value());
+    }
+    auto type = request.headers().tryGet<Http::Header::ContentType>();
+    if (type) {
+      headers.emplace_back("Content-Type", type->mime().toString());
+    }
+    // Pistache only keeps what it made of this one, so write that back. It has
+    // no name for zstd, so anything it didn't know is zstd only if decodeBody
+    // would have taken it for that, and otherwise stays as unknown as it was.
+    auto encoding = request.headers().tryGet<Http::Header::ContentEncoding>();
+    if (encoding &&
+        encoding->encoding() != Http::Header::Encoding::Identity) {
+      headers.emplace_back(
+          "Content-Encoding",
+          encoding->encoding() == Http::Header::Encoding::Unknown &&
+                  isZstd(request.body())
+              ? encodingName(Encoding::Zstd)
+              : Http::Header::encodingString(encoding->encoding()));
+    }
+    return headers;
+  }
 
-      for (auto name : drmaa::attribute_names()) {
-        value[name] = false;
+  // Counts a request as in progress for as long as it lives, or turns it away
+  // if we are draining. Each kind of request is finished on its own lane of
+  // workers. If we are capturing, the request is recorded along with the
+  // status it got once it is done.
+  class Admission {
+  public:
+    Admission(Controller &owner_, const Rest::Request &request,
+              Http::ResponseWriter &writer_, Executor &lane_)
+        : lane(lane_), owner(owner_), admitted(false), writer(&writer_),
+          direct_status(0) {
+      if (owner.capture) {
+        started = std::chrono::steady_clock::now();
+        record.reset(new CaptureRecord());
+        record->arrival =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count();
+        record->method = Http::methodString(request.method());
+        record->resource = request.resource() + request.query().as_str();
+        record->headers = sentHeaders(request);
+        record->body = request.body();
       }
-      for (auto name : drmaa::attribute_namesv()) {
-        value[name] = true;
+      {
+        std::unique_lock<std::mutex> guard(owner.drain_lock);
+        if (!owner.draining) {
+          owner.active++;
+          admitted = true;
+          return;
+        }
       }
-      Json::StyledWriter jsonWriter;
-      auto json = jsonWriter.write(value);
-      writer.headers().add<Http::Header::ContentType>(MIME(Application, Json));
-      auto response = writer.stream(Http::Code::Ok);
-      response << json.c_str() << Http::ends;
-    } catch (drmaa::exception &e) {
-      writer.send(Http::Code::Internal_Server_Error, e.what());
+      writer->headers().addRaw(Http::Header::Raw("Retry-After", "1"));
+      writer->send(Http::Code::Service_Unavailable, "Shutting down.");
+    }
+    ~Admission() {
+      if (record) {
+        record->status =
+            direct_status != 0
+                ? direct_status
+                : (uint16_t)(response ? response.get() : writer)->code();
+        record->latency =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - started)
+                .count();
+        owner.capture->append(std::move(*record));
+      }
+      if (admitted) {
+        std::unique_lock<std::mutex> guard(owner.drain_lock);
+        if (--owner.active == 0) {
+          owner.drained.notify_all();
+        }
+      }
+    }
+    explicit operator bool() const { return admitted; }
+
+    // For responses written straight to the socket, which the writer never
+    // sees: the status that was sent, or 0 if the client went away part way,
+    // which leaves the request out of the capture
+    void sentDirectly(uint16_t status) {
+      if (status == 0) {
+        record.reset();
+      }
+      direct_status = status;
+    }
+
+    Executor &lane;
+    // Set once the writer has been handed to a worker
+    std::shared_ptr<Http::ResponseWriter> response;
+
+  private:
+    Controller &owner;
+    bool admitted;
+    Http::ResponseWriter *writer;
+    std::unique_ptr<CaptureRecord> record;
+    std::chrono::steady_clock::time_point started;
+    uint16_t direct_status;
+  };
+
+  // One of a tenant's places in the submit lane, held for as long as this
+  // lives if there was one free
+  class TenantPlace {
+  public:
+    TenantPlace(Controller &owner_, const std::string &tenant_)
+        : held(false), owner(owner_), tenant(tenant_) {
+      std::unique_lock<std::mutex> guard(owner.tenant_lock);
+      auto &count = owner.tenant_places[tenant];
+      if (count < owner.tenant_workers) {
+        count++;
+        held = true;
+      }
+    }
+    ~TenantPlace() {
+      std::unique_lock<std::mutex> guard(owner.tenant_lock);
+      auto it = owner.tenant_places.find(tenant);
+      if (held) {
+        it->second--;
+      }
+      if (it->second == 0) {
+        owner.tenant_places.erase(it);
+      }
+    }
+
+    bool held;
+
+  private:
+    Controller &owner;
+    std::string tenant;
+  };
+
+  // Finish a request on a worker in its lane. The request counts as in
+  // progress until the work is done.
+  void offload(Http::ResponseWriter &writer,
+               const std::shared_ptr<Admission> &admission,
+               const std::function<void(Http::ResponseWriter &)> &work) {
+    offload(admission->lane, writer, admission, work);
+  }
+  void offload(Executor &pool, Http::ResponseWriter &writer,
+               const std::shared_ptr<Admission> &admission,
+               const std::function<void(Http::ResponseWriter &)> &work) {
+    auto response = std::make_shared<Http::ResponseWriter>(std::move(writer));
+    admission->response = response;
+    auto queued = pool.trySubmit([response, admission, work] {
+      try {
+        work(*response);
+      } catch (std::exception &e) {
+        response->send(Http::Code::Internal_Server_Error, e.what());
+      }
+    });
+    if (!queued) {
+      rejected++;
+      response->headers().addRaw(Http::Header::Raw("Retry-After", "1"));
+      response->send(Http::Code::Service_Unavailable, "Too busy.");
     }
   }
-  void metrics(const Rest::Request &request, Http::ResponseWriter writer) {
-    struct sysinfo memInfo;
-    sysinfo(&memInfo);
 
-    writer.headers().add<Http::Header::ContentType>(MIME(Text, Plain));
-    auto response = writer.stream(Http::Code::Ok);
-    response << "# TYPE drmaaws_cache_size gauge\ndrmaaws_cache_size "
-             << std::to_string(statefulDrmaa->cacheSize()).c_str() << "\n"
-             << "# TYPE drmaaws_db_size gauge\ndrmaaws_db_size "
-             << std::to_string(statefulDrmaa->dbSize()).c_str() << "\n"
-             << "# TYPE drmaaws_ram gauge\ndrmaaws_ram "
-             << std::to_string(memInfo.totalram * memInfo.mem_unit).c_str()
-             << "\n"
-             << "# TYPE drmaaws_swap gauge\ndrmaaws_swap "
-             << std::to_string(memInfo.totalswap * memInfo.mem_unit).c_str()
-             << "\n" << Http::ends;
+  std::shared_ptr<StatefulDrmaa> statefulDrmaa;
+  // Where requests are recorded, if anywhere
+  std::shared_ptr<CaptureWriter> capture;
+  std::mutex drain_lock;
+  std::condition_variable drained;
+  size_t active;
+  bool draining;
+  // Anything that might wait on DRMAA runs here, so the Pistache I/O threads
+  // only parse, check signatures and write responses
+  Executor submit_workers;
+  // Reads of the store and admin requests have workers of their own, so a
+  // flood of submissions can't hold them up
+  Executor read_workers;
+  Executor admin_workers;
+  Executor log_workers;
+  // The most /run requests each tenant may have in the submit lane
+  size_t tenant_workers;
+  std::mutex tenant_lock;
+  std::map<std::string, size_t> tenant_places;
+  std::atomic<size_t> rejected;
+  std::atomic<size_t> known_answers;
+  std::atomic<size_t> tenant_limited;
+  // The most a request body may decompress to
+  size_t max_body;
+  // Who may skip signing requests on the local socket
+  PeerCredentials local_peers;
+};
+
+// Stands in for the real handler while we start up, so the port can be
+// listened on before the old process has let go of it. Requests wait here,
+// much as they would in the kernel's backlog, until we are ready for them.
+class StartupGate : public Http::Handler {
+public:
+  HTTP_PROTOTYPE(StartupGate)
+
+  StartupGate() : state(std::make_shared<State>()) {}
+
+  void open(const std::shared_ptr<Http::Handler> &target) {
+    {
+      std::unique_lock<std::mutex> guard(state->lock);
+      state->target = target;
+    }
+    state->ready.notify_all();
+  }
+
+  void onRequest(const Http::Request &request,
+                 Http::ResponseWriter writer) override {
+    std::shared_ptr<Http::Handler> target;
+    {
+      std::unique_lock<std::mutex> guard(state->lock);
+      state->ready.wait(guard, [this] { return state->target != nullptr; });
+      target = state->target;
+    }
+    target->onRequest(request, std::move(writer));
   }
 
 private:
-  std::shared_ptr<StatefulDrmaa> statefulDrmaa;
+  // Shared between the copies made for each I/O thread
+  struct State {
+    std::mutex lock;
+    std::condition_variable ready;
+    std::shared_ptr<Http::Handler> target;
+  };
+  std::shared_ptr<State> state;
 };
 
-int main() {
+int main(int argc, char **argv) {
   if (getenv("DRMAA_PSK") == nullptr) {
     std::cerr << "No preshared key set via DRMAA_PSK." << std::endl;
     return 1;
   }
-  auto statefulDrmaa = std::make_shared<StatefulDrmaa>();
-  Controller controller(statefulDrmaa);
-
-  Rest::Router router;
-  Rest::Routes::Post(router, "/run",
-                     Rest::Routes::bind(&Controller::run, &controller));
-  Rest::Routes::Get(
-      router, "/attributes",
-      Rest::Routes::bind(&Controller::listAttributes, &controller));
-  Rest::Routes::Get(router, "/metrics",
-                    Rest::Routes::bind(&Controller::metrics, &controller));
-  auto options = Http::Endpoint::options().threads(1);
-  Address address = "*:9080";
-  Http::Endpoint endpoint(address);
-  endpoint.init(options);
-  endpoint.setHandler(router.handler());
-  endpoint.serve();
+  auto upgrade = argc > 1 && strcmp(argv[1], "--upgrade") == 0;
+  std::string control_path = getenv("DRMAAWS_CONTROL_SOCKET") == nullptr
+                                 ? "drmaaws.sock"
+                                 : getenv("DRMAAWS_CONTROL_SOCKET");
+  UpgradeSocket::blockSignals();
+  // Logs are sent to clients with sendfile, which would otherwise kill us if
+  // one hangs up
+  signal(SIGPIPE, SIG_IGN);
+
+  // Starting the DRMAA sessions is the slow part, so get it done before
+  // asking the old process to leave. Workers for other clusters are forked, so
+  // they have to be started before anything else is.
+  auto cluster_list = getenv("DRMAAWS_CLUSTERS");
+  auto clusters =
+      cluster_list == nullptr
+          ? std::make_shared<Clusters>(std::make_shared<drmaa::session>())
+          : std::make_shared<Clusters>(cluster_list);
+  // Requests can be recorded so the same load can be replayed elsewhere
+  std::shared_ptr<CaptureWriter> capture;
+  auto capture_path = getenv("DRMAAWS_CAPTURE");
+  if (capture_path != nullptr) {
+    try {
+      capture = std::make_shared<CaptureWriter>(capture_path);
+    } catch (std::runtime_error &e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // Requests are held at the gate until the state store is open. When
+  // upgrading, we listen on the port alongside the old process, so there's
+  // never a moment when connections are refused; an old process that didn't
+  // share the port has to be gone before we can have it.
+  auto threads = getenv("DRMAAWS_THREADS");
+  auto options =
+      Http::Endpoint::options()
+          .threads(threads == nullptr ? 1 : std::max(1, atoi(threads)))
+          .flags(Tcp::Options::ReusePort);
+  const int port = 9080;
+  Address address = "*:" + std::to_string(port);
+  auto gate = std::make_shared<StartupGate>();
+  std::unique_ptr<Http::Endpoint> endpoint;
+  auto listen = [&] {
+    endpoint.reset(new Http::Endpoint(address));
+    endpoint->init(options);
+    endpoint->setHandler(gate);
+    endpoint->serveThreaded();
+  };
+  if (upgrade) {
+    try {
+      listen();
+    } catch (std::runtime_error &e) {
+      std::cerr << "Waiting for the port: " << e.what() << std::endl;
+      endpoint.reset();
+    }
+    if (!UpgradeSocket::takeOver(control_path)) {
+      std::cerr << "No running process to take over from." << std::endl;
+    }
+  }
+  std::unique_ptr<UpgradeSocket> upgrades;
+  try {
+    upgrades.reset(new UpgradeSocket(control_path));
+  } catch (std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (!endpoint) {
+    listen();
+  }
+
+  {
+    auto statefulDrmaa = std::make_shared<StatefulDrmaa>(clusters);
+    Controller controller(statefulDrmaa, capture);
+    Rest::Router router;
+    Rest::Routes::Post(router, "/run",
+                       Rest::Routes::bind(&Controller::run, &controller));
+    Rest::Routes::Post(router, "/status",
+                       Rest::Routes::bind(&Controller::status, &controller));
+    Rest::Routes::Post(router, "/control/:action",
+                       Rest::Routes::bind(&Controller::control, &controller));
+    Rest::Routes::Post(router, "/usage",
+                       Rest::Routes::bind(&Controller::usage, &controller));
+    Rest::Routes::Get(
+        router, "/attributes",
+        Rest::Routes::bind(&Controller::listAttributes, &controller));
+    Rest::Routes::Post(router, "/graphs",
+                       Rest::Routes::bind(&Controller::runGraph, &controller));
+    Rest::Routes::Get(router, "/graphs/:id",
+                      Rest::Routes::bind(&Controller::graph, &controller));
+    Rest::Routes::Get(router, "/jobs",
+                      Rest::Routes::bind(&Controller::listJobs, &controller));
+    Rest::Routes::Get(router, "/jobs/:key/:stream",
+                      Rest::Routes::bind(&Controller::log, &controller));
+    Rest::Routes::Get(router, "/metrics",
+                      Rest::Routes::bind(&Controller::metrics, &controller));
+    Rest::Routes::Get(router, "/debug/trace",
+                      Rest::Routes::bind(&Controller::trace, &controller));
+    Rest::Routes::Post(router, "/debug/trace",
+                       Rest::Routes::bind(&Controller::traceRate, &controller));
+    gate->open(router.handler());
+    // Clients on the same host can skip TCP and signing altogether. Anyone may
+    // connect, but only trusted users get away without a signature.
+    auto local_path = getenv("DRMAAWS_LOCAL_SOCKET");
+    std::unique_ptr<Http::Endpoint> local;
+    if (local_path != nullptr) {
+      unlink(local_path);
+      local.reset(new Http::Endpoint(Address(local_path)));
+      local->init(options);
+      local->setHandler(router.handler());
+      local->serveThreaded();
+      chmod(local_path, 0666);
+    }
+
+    upgrades->wait();
+    // New connections go to the new process from now on, or are refused if
+    // there isn't one; only those we already have are drained
+    UpgradeSocket::stopAccepting(port, local ? local_path : "");
+    auto drain_timeout = getenv("DRMAAWS_DRAIN_TIMEOUT");
+    if (!controller.drain(std::chrono::seconds(
+            drain_timeout == nullptr ? 30 : atoi(drain_timeout)))) {
+      std::cerr << "Gave up waiting for requests to finish." << std::endl;
+    }
+    // Give the last responses a moment to be written out
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    endpoint->shutdown();
+    if (local) {
+      // The new process only starts once we are gone, so this is still ours
+      local->shutdown();
+      unlink(local_path);
+    }
+  }
+  // Only once the state is flushed and the DRMAA sessions closed can the new
+  // process start
+  clusters.reset();
+  upgrades->release();
 }
@@ -0,0 +1,36 @@
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "peercred.hpp"
+
+PeerCredentials::PeerCredentials(const char *list) {
+  if (list != nullptr) {
+    std::stringstream input(list);
+    std::string uid;
+    while (std::getline(input, uid, ',')) {
+      if (!uid.empty()) {
+        uids.insert(strtoul(uid.c_str(), nullptr, 10));
+      }
+    }
+  }
+  if (uids.empty()) {
+    uids.insert(getuid());
+  }
+}
+
+bool PeerCredentials::trusted(int fd) const {
+  sockaddr_storage address;
+  socklen_t length = sizeof(address);
+  if (fd < 0 || getsockname(fd, (sockaddr *)&address, &length) != 0 ||
+      address.ss_family != AF_UNIX) {
+    return false;
+  }
+  ucred credentials;
+  length = sizeof(credentials);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+    return false;
+  }
+  return uids.count(credentials.uid) != 0;
+}
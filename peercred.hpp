@@ -0,0 +1,19 @@
+#pragma once
+
+#include <set>
+#include <sys/types.h>
+
+// Works out who is on the other end of a Unix-domain socket from the kernel's
+// peer credentials, so local callers can be trusted by user instead of having
+// to sign each request.
+class PeerCredentials {
+public:
+  // A list of user ids like 1000,1001; if there is none, just our own
+  explicit PeerCredentials(const char *uids);
+
+  // Whether the connection is on a Unix-domain socket, from one of the users
+  bool trusted(int fd) const;
+
+private:
+  std::set<uid_t> uids;
+};
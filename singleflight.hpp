@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Ensures only one call for a given key is in progress at a time; anyone else
+// asking for the same key while it is running gets the same answer
+template <typename T> class SingleFlight {
+public:
+  SingleFlight() : duplicates(0) {}
+
+  T run(const std::string &key, const std::function<T()> &call) {
+    std::shared_ptr<std::promise<T>> leader;
+    std::shared_future<T> result;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      auto it = calls.find(key);
+      if (it == calls.end()) {
+        leader = std::make_shared<std::promise<T>>();
+        result = leader->get_future().share();
+        calls[key] = result;
+      } else {
+        result = it->second;
+        duplicates++;
+      }
+    }
+    if (leader) {
+      try {
+        leader->set_value(call());
+      } catch (...) {
+        leader->set_exception(std::current_exception());
+      }
+      std::unique_lock<std::mutex> guard(lock);
+      calls.erase(key);
+    }
+    return result.get();
+  }
+
+  size_t coalesced() const { return duplicates; }
+
+private:
+  std::mutex lock;
+  std::map<std::string, std::shared_future<T>> calls;
+  std::atomic<size_t> duplicates;
+};
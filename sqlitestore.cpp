@@ -0,0 +1,351 @@
+#include <algorithm>
+#include "sqlitestore.hpp"
+#include "tracing.hpp"
+
+// The smallest string greater than everything starting with prefix, or empty
+// if there isn't one
+static std::string prefixEnd(std::string prefix) {
+  while (!prefix.empty() && (unsigned char)prefix.back() == 0xFF) {
+    prefix.pop_back();
+  }
+  if (!prefix.empty()) {
+    prefix.back()++;
+  }
+  return prefix;
+}
+
+SqliteStateStore::SqliteStateStore(const std::string &path)
+    : db(path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE) {
+  // Deleted rows should give their pages back to the file system, which needs
+  // a one-off full vacuum to switch on in an existing database
+  int vacuum_mode = 0;
+  {
+    SQLite::Statement query(db, "PRAGMA auto_vacuum");
+    if (query.executeStep()) {
+      vacuum_mode = query.getColumn(0).getInt();
+    }
+  }
+  if (vacuum_mode != 2) {
+    db.exec("PRAGMA auto_vacuum = INCREMENTAL");
+    db.exec("VACUUM");
+  }
+  // When we start up, we need to initialise the database, if it isn't already
+  db.exec("CREATE TABLE IF NOT EXISTS jobs (name text NOT NULL, drmaa text NOT "
+          "NULL, status text NOT NULL DEFAULT 'UNKNOWN', updated_at DATETIME "
+          "DEFAULT CURRENT_TIMESTAMP)");
+  db.exec("CREATE INDEX IF NOT EXISTS jobs_name ON jobs (name)");
+  // Listings page through jobs in order of update, optionally for one status
+  db.exec("DROP INDEX IF EXISTS jobs_updated_at");
+  db.exec("CREATE INDEX IF NOT EXISTS jobs_listing ON jobs (updated_at, name)");
+  db.exec("CREATE INDEX IF NOT EXISTS jobs_status ON jobs (status, updated_at, "
+          "name)");
+  db.exec("CREATE INDEX IF NOT EXISTS jobs_drmaa ON jobs (drmaa)");
+  db.exec("CREATE TABLE IF NOT EXISTS labels (name text PRIMARY KEY, job_name "
+          "text NOT NULL DEFAULT '', job_category text NOT NULL DEFAULT '')");
+  db.exec("CREATE INDEX IF NOT EXISTS labels_job_name ON labels (job_name)");
+  db.exec("CREATE TABLE IF NOT EXISTS usage (name text NOT NULL, resource text "
+          "NOT NULL, value real NOT NULL, PRIMARY KEY (name, resource))");
+  db.exec("CREATE TABLE IF NOT EXISTS logs (name text PRIMARY KEY, "
+          "output_path text NOT NULL DEFAULT '', error_path text NOT NULL "
+          "DEFAULT '')");
+  db.exec("DELETE FROM labels WHERE name NOT IN (SELECT name FROM jobs)");
+  db.exec("DELETE FROM logs WHERE name NOT IN (SELECT name FROM jobs)");
+  db.exec("DELETE FROM usage WHERE name NOT IN (SELECT name FROM jobs)");
+  // Scratch space for bulk status lookups
+  db.exec("CREATE TEMP TABLE IF NOT EXISTS lookup (name text PRIMARY KEY)");
+}
+
+bool SqliteStateStore::get(const std::string &key, JobRecord &record) {
+  tracing::Span span("sqlite get");
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Statement query(
+      db, "SELECT jobs.drmaa, jobs.status, CAST(strftime('%s', "
+          "jobs.updated_at) AS INTEGER), labels.job_name, labels.job_category, "
+          "logs.output_path, logs.error_path FROM jobs LEFT JOIN labels ON "
+          "jobs.name = labels.name LEFT JOIN logs ON jobs.name = logs.name "
+          "WHERE jobs.name = ? ORDER BY jobs.updated_at DESC LIMIT 1");
+  query.bind(1, key);
+  if (!query.executeStep()) {
+    return false;
+  }
+  record.drmaa = query.getColumn(0).getString();
+  record.status = query.getColumn(1).getString();
+  record.updated_at = query.getColumn(2).getInt64();
+  record.job_name = query.getColumn(3).getString();
+  record.job_category = query.getColumn(4).getString();
+  record.output_path = query.getColumn(5).getString();
+  record.error_path = query.getColumn(6).getString();
+  return true;
+}
+
+void SqliteStateStore::put(const std::string &key, const JobRecord &record) {
+  tracing::Span span("sqlite put");
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Transaction transaction(db);
+  write(key, record);
+  transaction.commit();
+}
+
+void SqliteStateStore::putAll(
+    const std::vector<std::pair<std::string, JobRecord>> &records) {
+  tracing::Span span("sqlite put all");
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Transaction transaction(db);
+  for (auto &record : records) {
+    write(record.first, record.second);
+  }
+  transaction.commit();
+}
+
+void SqliteStateStore::write(const std::string &key, const JobRecord &record) {
+  SQLite::Statement update(db, "UPDATE jobs SET updated_at = datetime(?, "
+                               "'unixepoch'), status = ?, drmaa = ? WHERE "
+                               "name = ?");
+  update.bind(1, (long long)record.updated_at);
+  update.bind(2, record.status);
+  update.bind(3, record.drmaa);
+  update.bind(4, key);
+  if (update.exec() == 0) {
+    SQLite::Statement insert(db, "INSERT INTO jobs (name, drmaa, status, "
+                                 "updated_at) VALUES (?, ?, ?, datetime(?, "
+                                 "'unixepoch'))");
+    insert.bind(1, key);
+    insert.bind(2, record.drmaa);
+    insert.bind(3, record.status);
+    insert.bind(4, (long long)record.updated_at);
+    insert.exec();
+  }
+  SQLite::Statement label(db, "INSERT OR REPLACE INTO labels (name, job_name, "
+                              "job_category) VALUES (?, ?, ?)");
+  label.bind(1, key);
+  label.bind(2, record.job_name);
+  label.bind(3, record.job_category);
+  label.exec();
+  // Only jobs submitted with somewhere to write their output have these
+  if (!record.output_path.empty() || !record.error_path.empty()) {
+    SQLite::Statement paths(db, "INSERT OR REPLACE INTO logs (name, "
+                                "output_path, error_path) VALUES (?, ?, ?)");
+    paths.bind(1, key);
+    paths.bind(2, record.output_path);
+    paths.bind(3, record.error_path);
+    paths.exec();
+  }
+}
+
+std::map<std::string, std::string>
+SqliteStateStore::statuses(const std::vector<std::string> &keys) {
+  std::map<std::string, std::string> output;
+  tracing::Span span("sqlite statuses");
+  std::unique_lock<std::mutex> guard(lock);
+  // Go through a scratch table so the database is only queried once
+  SQLite::Transaction transaction(db);
+  db.exec("DELETE FROM lookup");
+  SQLite::Statement insert(db, "INSERT OR IGNORE INTO lookup (name) VALUES (?)");
+  for (auto &key : keys) {
+    insert.bind(1, key);
+    insert.exec();
+    insert.reset();
+  }
+  SQLite::Statement query(db, "SELECT jobs.name, jobs.status FROM jobs JOIN "
+                              "lookup ON jobs.name = lookup.name");
+  while (query.executeStep()) {
+    output[query.getColumn(0).getString()] = query.getColumn(1).getString();
+  }
+  db.exec("DELETE FROM lookup");
+  transaction.commit();
+  return output;
+}
+
+void SqliteStateStore::putUsage(const std::string &key,
+                                const std::map<std::string, double> &usage) {
+  tracing::Span span("sqlite put usage");
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Transaction transaction(db);
+  SQLite::Statement insert(db, "INSERT OR REPLACE INTO usage (name, resource, "
+                               "value) VALUES (?, ?, ?)");
+  for (auto resource : usage) {
+    insert.bind(1, key);
+    insert.bind(2, resource.first);
+    insert.bind(3, resource.second);
+    insert.exec();
+    insert.reset();
+  }
+  transaction.commit();
+}
+
+std::map<std::string, double>
+SqliteStateStore::getUsage(const std::string &key) {
+  std::map<std::string, double> output;
+  tracing::Span span("sqlite get usage");
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Statement query(db,
+                          "SELECT resource, value FROM usage WHERE name = ?");
+  query.bind(1, key);
+  while (query.executeStep()) {
+    output[query.getColumn(0).getString()] = query.getColumn(1).getDouble();
+  }
+  return output;
+}
+
+std::vector<std::pair<std::string, JobRecord>>
+SqliteStateStore::list(const JobFilter &filter, const ListCursor &after,
+                       size_t limit) {
+  // Only mention the filters in use, so SQLite picks the best index for them
+  std::string sql =
+      "SELECT jobs.name, jobs.drmaa, jobs.status, CAST(strftime('%s', "
+      "jobs.updated_at) AS INTEGER), labels.job_name, labels.job_category "
+      "FROM jobs LEFT JOIN labels ON jobs.name = labels.name WHERE 1";
+  if (!after.key.empty()) {
+    sql += " AND (jobs.updated_at, jobs.name) > (datetime(?, 'unixepoch'), ?)";
+  }
+  if (!filter.status.empty()) {
+    sql += " AND jobs.status = ?";
+  }
+  if (filter.since != 0) {
+    sql += " AND jobs.updated_at >= datetime(?, 'unixepoch')";
+  }
+  if (filter.until != 0) {
+    sql += " AND jobs.updated_at < datetime(?, 'unixepoch')";
+  }
+  if (!filter.drmaa.empty()) {
+    sql += " AND jobs.drmaa = ?";
+  }
+  auto name_end = prefixEnd(filter.job_name_prefix);
+  if (!filter.job_name_prefix.empty()) {
+    sql += " AND labels.job_name >= ?";
+    if (!name_end.empty()) {
+      sql += " AND labels.job_name < ?";
+    }
+  }
+  sql += " ORDER BY jobs.updated_at, jobs.name LIMIT ?";
+
+  std::vector<std::pair<std::string, JobRecord>> output;
+  tracing::Span span("sqlite list");
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Statement query(db, sql);
+  int index = 1;
+  if (!after.key.empty()) {
+    query.bind(index++, (long long)after.updated_at);
+    query.bind(index++, after.key);
+  }
+  if (!filter.status.empty()) {
+    query.bind(index++, filter.status);
+  }
+  if (filter.since != 0) {
+    query.bind(index++, (long long)filter.since);
+  }
+  if (filter.until != 0) {
+    query.bind(index++, (long long)filter.until);
+  }
+  if (!filter.drmaa.empty()) {
+    query.bind(index++, filter.drmaa);
+  }
+  if (!filter.job_name_prefix.empty()) {
+    query.bind(index++, filter.job_name_prefix);
+    if (!name_end.empty()) {
+      query.bind(index++, name_end);
+    }
+  }
+  query.bind(index++, (long long)limit);
+  while (query.executeStep()) {
+    output.push_back(std::make_pair(
+        query.getColumn(0).getString(),
+        JobRecord{query.getColumn(1).getString(),
+                  query.getColumn(2).getString(),
+                  query.getColumn(3).getInt64(), query.getColumn(4).getString(),
+                  query.getColumn(5).getString()}));
+  }
+  return output;
+}
+
+void SqliteStateStore::unfinished(
+    const std::function<void(const std::string &, const JobRecord &)>
+        &consumer) {
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Statement query(
+      db, "SELECT jobs.name, jobs.drmaa, jobs.status, CAST(strftime('%s', "
+          "jobs.updated_at) AS INTEGER), labels.job_name, labels.job_category "
+          "FROM jobs LEFT JOIN labels ON jobs.name = labels.name WHERE "
+          "jobs.status NOT IN ('SUCCEEDED', 'FAILED')");
+  while (query.executeStep()) {
+    consumer(query.getColumn(0).getString(),
+             {query.getColumn(1).getString(), query.getColumn(2).getString(),
+              query.getColumn(3).getInt64(), query.getColumn(4).getString(),
+              query.getColumn(5).getString()});
+  }
+}
+
+std::vector<std::string>
+SqliteStateStore::expire(const std::map<std::string, double> &retention,
+                         size_t limit) {
+  // Work out how long each row gets to live based on its status; the oldest
+  // possible cut off lets SQLite use the index on updated_at
+  std::string expiry;
+  double shortest = retention.at("*");
+  for (auto rule : retention) {
+    shortest = std::min(shortest, rule.second);
+    if (rule.first != "*") {
+      expiry += " WHEN ? THEN ?";
+    }
+  }
+  expiry = expiry.empty() ? "?" : "CASE status" + expiry + " ELSE ? END";
+
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Statement query(db, "SELECT rowid, name FROM jobs WHERE updated_at < "
+                              "datetime(julianday('now') - ?) AND "
+                              "julianday('now') - julianday(updated_at) > " +
+                                  expiry + " LIMIT ?");
+  int index = 1;
+  query.bind(index++, shortest);
+  for (auto rule : retention) {
+    if (rule.first != "*") {
+      query.bind(index++, rule.first);
+      query.bind(index++, rule.second);
+    }
+  }
+  query.bind(index++, retention.at("*"));
+  query.bind(index++, (long long)limit);
+  std::vector<std::pair<long long, std::string>> expired;
+  while (query.executeStep()) {
+    expired.push_back(std::make_pair(query.getColumn(0).getInt64(),
+                                     query.getColumn(1).getString()));
+  }
+
+  std::vector<std::string> output;
+  SQLite::Transaction transaction(db);
+  SQLite::Statement remove(db, "DELETE FROM jobs WHERE rowid = ?");
+  SQLite::Statement remove_labels(db, "DELETE FROM labels WHERE name = ?");
+  SQLite::Statement remove_usage(db, "DELETE FROM usage WHERE name = ?");
+  SQLite::Statement remove_logs(db, "DELETE FROM logs WHERE name = ?");
+  for (auto &row : expired) {
+    remove.bind(1, row.first);
+    remove.exec();
+    remove.reset();
+    remove_labels.bind(1, row.second);
+    remove_labels.exec();
+    remove_labels.reset();
+    remove_usage.bind(1, row.second);
+    remove_usage.exec();
+    remove_usage.reset();
+    remove_logs.bind(1, row.second);
+    remove_logs.exec();
+    remove_logs.reset();
+    output.push_back(row.second);
+  }
+  transaction.commit();
+  return output;
+}
+
+void SqliteStateStore::compact() {
+  std::unique_lock<std::mutex> guard(lock);
+  db.exec("PRAGMA incremental_vacuum(1000)");
+}
+
+size_t SqliteStateStore::size() {
+  std::unique_lock<std::mutex> guard(lock);
+  SQLite::Statement query(db, "SELECT COUNT(*) FROM jobs");
+  if (query.executeStep()) {
+    return query.getColumn(0).getInt();
+  }
+  return 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <mutex>
+#include <SQLiteCpp/SQLiteCpp.h>
+#include "statestore.hpp"
+
+class SqliteStateStore : public StateStore {
+public:
+  explicit SqliteStateStore(const std::string &path);
+
+  bool get(const std::string &key, JobRecord &record);
+  void put(const std::string &key, const JobRecord &record);
+  void putAll(const std::vector<std::pair<std::string, JobRecord>> &records);
+  std::map<std::string, std::string>
+  statuses(const std::vector<std::string> &keys);
+  void putUsage(const std::string &key,
+                const std::map<std::string, double> &usage);
+  std::map<std::string, double> getUsage(const std::string &key);
+  std::vector<std::pair<std::string, JobRecord>>
+  list(const JobFilter &filter, const ListCursor &after, size_t limit);
+  void unfinished(
+      const std::function<void(const std::string &, const JobRecord &)>
+          &consumer);
+  std::vector<std::string> expire(const std::map<std::string, double> &retention,
+                                  size_t limit);
+  void compact();
+  size_t size();
+
+private:
+  // Must be called with the lock held
+  void write(const std::string &key, const JobRecord &record);
+
+  std::mutex lock;
+  SQLite::Database db;
+};
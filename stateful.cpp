@@ -1,10 +1,21 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <iostream>
-#include <numeric>
+#include <iterator>
 #include <sstream>
+#include <stdexcept>
+#include "drmaa.h"
+#include "env.hpp"
+#include "joblogs.hpp"
 #include "stateful.hpp"
+#include "tracing.hpp"
 
-static const char *determineStatus(drmaa::job &job) {
-  auto status = job.wait();
+static const char *
+determineStatus(drmaa::job &job, std::shared_ptr<drmaa::job_result> &status) {
+  status = job.wait();
   if (status) {
     if (status->exited().second && status->exited().first == 0) {
       return "SUCCEEDED";
@@ -28,136 +39,1232 @@ static const char *determineStatus(drmaa::job &job) {
   return nullptr;
 }
 
-JobRequest::JobRequest() {}
+// How often the poller looks for jobs that are due to be checked
+static const std::chrono::milliseconds poll_tick(100);
 
-std::map<std::string, std::string> &JobRequest::attributes() { return attrs; }
-std::map<std::string, std::vector<std::string>> &JobRequest::v_attributes() {
-  return v_attrs;
+// Parse a list like SUCCEEDED=3,FAILED=30,*=10 into a number for each name,
+// where "*" covers everything else
+static std::map<std::string, double> parseRules(const char *value,
+                                                double fallback) {
+  std::map<std::string, double> output{{"*", fallback}};
+  if (value == nullptr) {
+    return output;
+  }
+  std::stringstream input(value);
+  std::string rule;
+  while (std::getline(input, rule, ',')) {
+    auto equals = rule.find('=');
+    if (equals == std::string::npos) {
+      std::cerr << "Ignoring rule without a value: " << rule << std::endl;
+      continue;
+    }
+    output[rule.substr(0, equals)] = atof(rule.c_str() + equals + 1);
+  }
+  return output;
 }
-const std::map<std::string, std::string> &JobRequest::attributes() const {
-  return attrs;
+
+// Jobs are summarised by the start of their name, since most pipelines stick
+// a sample or run identifier on the end
+static std::string namePrefix(const std::string &name) {
+  return name.substr(0, name.find_first_of("_-.:"));
 }
-const std::map<std::string, std::vector<std::string>> &
-JobRequest::v_attributes() const {
-  return v_attrs;
+
+static std::string attribute(const JobRequest &job, const std::string &name) {
+  auto it = job.attributes().find(name);
+  return it == job.attributes().end() ? "" : it->second;
 }
 
-std::string JobRequest::str() const {
-  std::stringstream output;
-  for (auto attr : attrs) {
-    output << (std::hash<std::string>{}(attr.second) * 31 +
-               std::hash<std::string>{}(attr.first));
-  }
-  for (auto attr : v_attrs) {
+StatefulDrmaa::StatefulDrmaa(
+    const std::shared_ptr<drmaa::session> &session) throw(drmaa::exception)
+    : StatefulDrmaa(std::make_shared<Clusters>(session)) {}
 
-    output << (std::accumulate(
-                   attr.second.begin(), attr.second.end(), (size_t)0,
-                   [](size_t a, const std::string &value) {
-                     return a * 31 + std::hash<std::string>{}(value);
-                   }) *
-                   31 +
-               std::hash<std::string>{}(attr.first));
+StatefulDrmaa::StatefulDrmaa(
+    const std::shared_ptr<Clusters> &clusters_) throw(drmaa::exception)
+    : clusters(clusters_), store(openStateStore()),
+      index(new JobIndex(getenv("DRMAAWS_INDEX") == nullptr
+                             ? "drmaaws.idx"
+                             : getenv("DRMAAWS_INDEX"))),
+      control_pool(envSize("DRMAAWS_CONTROL_THREADS", 16),
+                   4 * envSize("DRMAAWS_CONTROL_THREADS", 16)),
+      retention(parseRules(getenv("DRMAAWS_RETENTION"), 10)), purged(0),
+      tenant_attribute(getenv("DRMAAWS_TENANT_ATTRIBUTE") == nullptr
+                           ? drmaa::job_category
+                           : getenv("DRMAAWS_TENANT_ATTRIBUTE")),
+      submissions(envSize("DRMAAWS_SUBMIT_THREADS", 4),
+                  parseRules(getenv("DRMAAWS_TENANT_WEIGHTS"), 1)),
+      submit_timeout(
+          std::chrono::seconds(envSize("DRMAAWS_SUBMIT_TIMEOUT", 30))),
+      throttled(0),
+      batch_window(envSize("DRMAAWS_BATCH_WINDOW", 0)),
+      batch_max(envSize("DRMAAWS_BATCH_MAX", 1000)),
+      task_variable(getenv("DRMAAWS_TASK_ID_VARIABLE") == nullptr
+                        ? "SGE_TASK_ID"
+                        : getenv("DRMAAWS_TASK_ID_VARIABLE")),
+      arrays(0), coalesced(0),
+      drmaa_budget(envSize("DRMAAWS_POLL_RATE", 20)),
+      poll_interval(std::chrono::seconds(envSize("DRMAAWS_POLL_INTERVAL", 5))),
+      poll_max(std::chrono::seconds(envSize("DRMAAWS_POLL_MAX", 300))),
+      polls(0),
+      stale_answers(0), park_max(envSize("DRMAAWS_PARK_MAX", 10000)),
+      graphs(new GraphStore(getenv("DRMAAWS_GRAPH_DB") == nullptr
+                                ? "drmaaws-graphs.db3"
+                                : getenv("DRMAAWS_GRAPH_DB"))),
+      replay_parked(false),
+      graph_pool(envSize("DRMAAWS_GRAPH_THREADS", 4), 1024),
+      stopping(false) {
+  // Jobs that haven't finished are kept much longer than "*", so we don't
+  // forget one that's merely slow, but they don't live forever either
+  auto unfinished_days = envSize("DRMAAWS_UNFINISHED_RETENTION", 90);
+  for (uint8_t code = 1; *statusName(code) != '\0'; code++) {
+    if (!isFinished(statusName(code))) {
+      retention.insert(std::make_pair(statusName(code), unfinished_days));
+    }
+  }
+  for (auto &cluster : clusters->stats()) {
+    auto name = cluster.name;
+    breakers[name].reset(new CircuitBreaker(
+        name.empty() ? "DRMAA" : "Cluster " + name,
+        envSize("DRMAAWS_BREAKER_FAILURES", 5),
+        std::chrono::seconds(envSize("DRMAAWS_BREAKER_SLOW", 10)),
+        std::chrono::seconds(envSize("DRMAAWS_BREAKER_PROBE", 10)),
+        [this, name] {
+          if (this->clusters->reachable(name)) {
+            return true;
+          }
+          // Keep new jobs going elsewhere while it's down
+          this->clusters->unreachable(name);
+          return false;
+        },
+        [this] {
+          {
+            std::unique_lock<std::mutex> guard(poll_lock);
+            std::cerr << "Catching up on " << poll_held.size()
+                      << " job checks" << std::endl;
+            poll_backlog.insert(poll_backlog.end(), poll_held.begin(),
+                                poll_held.end());
+            poll_held.clear();
+          }
+          {
+            std::unique_lock<std::mutex> guard(graph_lock);
+            replay_parked = true;
+          }
+          graph_wake.notify_all();
+        }));
+  }
+  auto archive_dir = getenv("DRMAAWS_ARCHIVE_DIR");
+  if (archive_dir != nullptr) {
+    archive.reset(new ArchiveWriter(archive_dir));
+  }
+  // In-flight jobs from when we were last running get picked up from the
+  // index as they are asked about. If the index is new, it has to be filled in
+  // from the store once.
+  if (index->fresh()) {
+    size_t count = 0;
+    store->unfinished(
+        [this, &count](const std::string &key, const JobRecord &record) {
+          index->put(key, record.drmaa, record.status, record.updated_at);
+          count++;
+        });
+    std::cerr << "Indexed " << count << " unfinished jobs" << std::endl;
   }
-  return output.str();
-}
 
-StatefulDrmaa::StatefulDrmaa() throw(drmaa::exception)
-    : sess(std::make_shared<drmaa::session>()),
-      db("drmaaws.db3", SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE) {
-  // When we start up, we need to initialise the database, if it isn't already
-  db.exec("CREATE TABLE IF NOT EXISTS jobs (name text NOT NULL, drmaa text NOT "
-          "NULL, status text NOT NULL DEFAULT 'UNKNOWN', updated_at DATETIME "
-          "DEFAULT CURRENT_TIMESTAMP)");
-  // And purge any ancient cruft
-  db.exec(
-      "DELETE FROM jobs WHERE julianday('now') - julianday(updated_at) > 10");
+  // From now on, keep purging as things expire, and keep checking on jobs
+  maintenance = std::thread(&StatefulDrmaa::maintain, this);
+  poller = std::thread(&StatefulDrmaa::poll, this);
+  grapher = std::thread(&StatefulDrmaa::followGraphs, this);
+}
 
-  // We've restarted from a crash and we need to figure out the status of all
-  // in-flight jobs from when we were last running.
-  SQLite::Statement query(db, "SELECT name, drmaa FROM jobs WHERE status IN "
-                              "('INFLIGHT', 'QUEUED', 'THROTTLED', "
-                              "'UNKNOWN', 'WAITING')");
-  if (query.executeStep()) {
-    jobs[query.getColumn(0).getString()] =
-        std::make_shared<drmaa::job>(sess, query.getColumn(1).getString());
+StatefulDrmaa::~StatefulDrmaa() {
+  {
+    std::unique_lock<std::mutex> guard(maintenance_lock);
+    std::unique_lock<std::mutex> poll_guard(poll_lock);
+    std::unique_lock<std::mutex> graph_guard(graph_lock);
+    stopping = true;
   }
+  maintenance_wake.notify_all();
+  poll_wake.notify_all();
+  graph_wake.notify_all();
+  maintenance.join();
+  poller.join();
+  grapher.join();
 }
 
-std::string StatefulDrmaa::run(const JobRequest &job) throw(drmaa::exception) {
-  auto job_id = job.str();
-
-  auto it = jobs.find(job_id);
-  if (it != jobs.end()) {
-    std::cerr << job_id << ": Job exists in DRMAA: " << it->second->name()
-              << std::endl;
+void StatefulDrmaa::maintain() {
+  auto interval = std::chrono::seconds(
+      envSize("DRMAAWS_MAINTENANCE_INTERVAL", 60));
+  std::unique_lock<std::mutex> guard(maintenance_lock);
+  // The first round, which clears out anything that expired while we were
+  // stopped, runs straight away rather than holding up starting
+  do {
+    guard.unlock();
     try {
-      auto strstatus = determineStatus(*it->second);
-
-      if (strstatus != nullptr) {
-        SQLite::Statement count(db, "SELECT * FROM jobs WHERE name = ?");
-        count.bind(1, job_id);
-        if (count.executeStep()) {
-          SQLite::Statement update(db, "UPDATE jobs SET updated_at = "
-                                       "datetime('now'),status = ?, drmaa = ? "
-                                       "WHERE name = ? ");
-          update.bind(1, strstatus);
-          update.bind(2, it->second->name());
-          update.bind(3, job_id);
-          update.exec();
-        } else {
-          SQLite::Statement insert(db, "INSERT jobs (name, "
-                                       "drmaa, status) VALUES (?, ?, ?)");
-          insert.bind(1, job_id);
-          insert.bind(2, it->second->name());
-          insert.bind(3, strstatus);
-          insert.exec();
+      auto count = purgeExpired();
+      if (count > 0) {
+        std::cerr << "Purged " << count << " expired jobs" << std::endl;
+      }
+      // Graphs last as long as the longest lived of their finished jobs might
+      double graph_retention = 0;
+      for (auto &rule : retention) {
+        if (rule.first == "*" || isFinished(rule.first)) {
+          graph_retention = std::max(graph_retention, rule.second);
         }
-        std::cerr << job_id << ": Status from DRMAA: " << strstatus
-                  << std::endl;
-        return strstatus;
       }
+      count = graphs->expire(graph_retention);
+      if (count > 0) {
+        std::cerr << "Purged " << count << " expired graphs" << std::endl;
+      }
+      if (archive) {
+        archive->flush();
+      }
+      store->compact();
     } catch (std::exception &e) {
-      // If the DRMAA client doesn't know what we're talking about, then stop
-      // asking it and just rely on what's in the DB
-      jobs.erase(job_id);
-      std::cerr << job_id << ": DRMAA error for " << it->second->name() << ": "
-                << e.what() << std::endl;
+      std::cerr << "Error during database maintenance: " << e.what()
+                << std::endl;
+    }
+    guard.lock();
+  } while (!maintenance_wake.wait_for(guard, interval,
+                                      [this] { return stopping; }));
+}
+
+size_t StatefulDrmaa::purgeExpired() {
+  static const size_t batch_size = 500;
+  size_t total = 0;
+  while (true) {
+    // Delete in small batches so requests can get at the store in between
+    std::unique_lock<std::mutex> guard(lock);
+    auto expired = store->expire(retention, batch_size);
+    for (auto &key : expired) {
+      // Forgetting a job we're still following would mean submitting it again
+      // the next time it's asked for
+      auto tracked = jobs.status(key);
+      if (tracked != nullptr && !isFinished(tracked)) {
+        continue;
+      }
+      {
+        std::unique_lock<std::mutex> table_guard(table_lock);
+        jobs.erase(key);
+      }
+      index->erase(key);
+    }
+    total += expired.size();
+    purged += expired.size();
+    if (expired.size() < batch_size) {
+      return total;
+    }
+  }
+}
+
+std::string StatefulDrmaa::tenant(const JobRequest &job) const {
+  return attribute(job, tenant_attribute);
+}
+
+JobState StatefulDrmaa::run(const JobRequest &job) throw(drmaa::exception) {
+  std::string job_id;
+  {
+    tracing::Span span("hash key");
+    job_id = job.str();
+  }
+  return run(job, job_id);
+}
+
+JobState StatefulDrmaa::run(const JobRequest &job,
+                            const std::string &job_id) throw(drmaa::exception) {
+  // Clients retry aggressively, so make sure only one request per job is
+  // talking to DRMAA at a time and everyone else gets its answer
+  return inflight.run(job_id, [this, &job_id, &job] {
+    return runOnce(job_id, job);
+  });
+}
+
+bool StatefulDrmaa::cached(const std::string &job_id, JobState &state) {
+  TrackedJob tracked;
+  IndexEntry entry;
+  // Not the main lock, which is held across writes to the store
+  std::unique_lock<std::mutex> guard(table_lock);
+  if (jobs.get(job_id, tracked)) {
+    // Picked up from before a restart, so it needs checking first
+    if (tracked.checked_at == 0) {
+      return false;
     }
+    state = {tracked.status, tracked.checked_at, !available(tracked.drmaa)};
+  } else if (index->get(job_id, entry) && isFinished(entry.status)) {
+    state = {entry.status, entry.updated_at, false};
+  } else {
+    // Unfinished jobs in the index have to be tracked again, which run does
+    return false;
   }
+  guard.unlock();
+  if (state.stale) {
+    stale_answers++;
+  }
+  std::cerr << job_id << ": Known status: " << state.status
+            << (state.stale ? " (stale)" : "") << std::endl;
+  return true;
+}
 
-  SQLite::Statement query(db, "SELECT status FROM jobs WHERE name = ?");
-  query.bind(1, job_id);
-  if (query.executeStep()) {
-    auto status = query.getColumn(0).getString();
-    std::cerr << job_id << ": Cached status: " << status << std::endl;
-    return status;
+JobState StatefulDrmaa::runOnce(const std::string &job_id,
+                                const JobRequest &job) throw(
+    drmaa::exception) {
+  TrackedJob tracked;
+  JobState settled{"", 0, false};
+  bool known;
+  {
+    tracing::Span span("lookup tracked");
+    std::unique_lock<std::mutex> guard(lock);
+    known = !track(job_id, &settled).empty() && jobs.get(job_id, tracked);
+  }
+  if (known && tracked.checked_at == 0 && !available(tracked.drmaa)) {
+    // Nothing to do but tell them what we last knew, and check once DRMAA is
+    // back
+    schedulePoll(job_id, 0, 0);
+  } else if (known && tracked.checked_at == 0) {
+    // We've only just picked this up from before a restart, so find out where
+    // it has got to before answering; after this, the poller keeps it fresh
+    drmaa_budget.acquire();
+    bool changed;
+    int64_t checked_at = 0;
+    if (refresh(job_id, checked_at, changed)) {
+      schedulePoll(job_id, 0, checked_at);
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    known = !track(job_id, &settled).empty() && jobs.get(job_id, tracked);
+  }
+  if (!known && !settled.status.empty()) {
+    std::cerr << job_id << ": Cached status: " << settled.status << std::endl;
+    return settled;
+  }
+  if (known) {
+    auto stale = tracked.checked_at == 0 || !available(tracked.drmaa);
+    if (stale) {
+      stale_answers++;
+    }
+    std::cerr << job_id << ": Tracked status: " << tracked.status
+              << (stale ? " (stale)" : "") << std::endl;
+    return {tracked.status, tracked.checked_at, stale};
   }
 
   // This isn't something we know about, then it must be new. How exciting!
-  drmaa::job_template tmpl(sess);
+  auto tenant = attribute(job, tenant_attribute);
+  // Placement avoids clusters that are down, so this only happens when the one
+  // a job asks for is, or all of them are
+  auto cluster = clusters->place(job);
+  if (!breakers.at(cluster)->closed()) {
+    throttled++;
+    std::unique_lock<std::mutex> guard(parked_lock);
+    if (parked.size() < park_max) {
+      parked.emplace(job_id, job);
+      std::cerr << job_id << ": Parked until DRMAA is available" << std::endl;
+    }
+    return {"THROTTLED", time(nullptr), false};
+  }
+  std::string drmaa_id;
+  bool submitted;
+  {
+    tracing::Span span("submit");
+    submitted = submit(job, tenant, cluster, drmaa_id);
+  }
+  if (!submitted) {
+    // Nothing was submitted or recorded, so the client will try again
+    throttled++;
+    std::cerr << job_id << ": Throttled submission for tenant \"" << tenant
+              << "\"" << std::endl;
+    return {"THROTTLED", time(nullptr), false};
+  }
+  // Work these out before taking the lock, since they may touch the disk
+  auto output_path = logPath(job, drmaa_id, false);
+  auto error_path = logPath(job, drmaa_id, true);
+  auto now = time(nullptr);
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    {
+      std::unique_lock<std::mutex> table_guard(table_lock);
+      jobs.put(job_id, {drmaa_id, "QUEUED", now});
+    }
+    // Index it first, so that if we die in between, we at least don't lose
+    // track of the job in DRMAA
+    index->put(job_id, drmaa_id, "WAITING", now);
+    store->put(job_id, {drmaa_id, "WAITING", now,
+                        attribute(job, drmaa::job_name),
+                        attribute(job, drmaa::job_category),
+                        output_path, error_path});
+    std::cerr << job_id << ": Started as " << drmaa_id << std::endl;
+  }
+  schedulePoll(job_id, 0, now);
+  return {"QUEUED", now, false};
+}
+
+static void fill(drmaa::job_template &tmpl, const JobRequest &job) {
   for (auto attr : job.attributes()) {
+    if (attr.first == cluster_attribute) {
+      continue;
+    }
     tmpl.set(attr.first, attr.second);
   }
   for (auto attr : job.v_attributes()) {
     tmpl.setv(attr.first, attr.second);
   }
+}
+
+bool StatefulDrmaa::submit(const JobRequest &job, const std::string &tenant,
+                           const std::string &cluster,
+                           std::string &drmaa_id) throw(drmaa::exception) {
+  // Submissions wait their turn behind those of other tenants, so one busy
+  // pipeline can't hog DRMAA. The calls are made on another thread, so take
+  // the trace along.
+  auto trace = tracing::current();
+  if (batch_window.count() == 0) {
+    return submissions.run(tenant,
+                           [this, &job, &cluster, &drmaa_id, trace] {
+                             tracing::Scope scope(trace);
+                             guarded(cluster, [this, &job, &cluster,
+                                               &drmaa_id] {
+                               drmaa_id = submitTo(cluster, job, 1).at(0);
+                             });
+                           },
+                           submit_timeout);
+  }
+
+  auto pending = std::make_shared<PendingSubmission>();
+  pending->job = &job;
+  pending->tenant = tenant;
+  pending->cluster = cluster;
+  pending->ready = false;
+  pending->done = false;
+  pending->submitted = false;
+  std::unique_lock<std::mutex> guard(batch_lock);
+  auto leader = batch_pending.empty();
+  batch_pending.push_back(pending);
+  if (batch_pending.size() >= batch_max) {
+    batch_full.notify_all();
+  }
+  if (leader) {
+    // Whoever opens the window gathers up everything that arrives before it
+    // closes, and works out which submissions can go together
+    batch_full.wait_for(guard, batch_window,
+                        [this] { return batch_pending.size() >= batch_max; });
+    std::vector<std::shared_ptr<PendingSubmission>> gathered;
+    gathered.swap(batch_pending);
+    guard.unlock();
+    // Only jobs for the same tenant and cluster can go together
+    std::map<std::pair<std::string, std::string>,
+             std::vector<std::shared_ptr<PendingSubmission>>>
+        groups;
+    for (auto &submission : gathered) {
+      groups[std::make_pair(submission->tenant, submission->cluster)]
+          .push_back(submission);
+    }
+    std::vector<std::pair<std::shared_ptr<PendingSubmission>, ArrayJob>>
+        batches;
+    for (auto &group : groups) {
+      std::vector<const JobRequest *> requests;
+      for (auto &submission : group.second) {
+        requests.push_back(submission->job);
+      }
+      for (auto &array : coalesce(requests, batch_max, task_variable)) {
+        auto owner = group.second[array.members[0]];
+        for (auto member : array.members) {
+          owner->tasks.push_back(group.second[member]);
+        }
+        batches.emplace_back(owner, std::move(array));
+      }
+    }
+    guard.lock();
+    // Each array is submitted by the first of its members
+    for (auto &batch : batches) {
+      batch.first->array.reset(new ArrayJob(std::move(batch.second)));
+    }
+    for (auto &submission : gathered) {
+      submission->ready = true;
+    }
+    batch_ready.notify_all();
+  }
+
+  batch_ready.wait(guard, [&pending] { return pending->ready; });
+  if (pending->array) {
+    std::unique_ptr<ArrayJob> array(std::move(pending->array));
+    auto tasks = std::move(pending->tasks);
+    guard.unlock();
+    std::vector<std::string> ids;
+    bool submitted = false;
+    std::exception_ptr error;
+    try {
+      submitted = submissions.run(
+          tenant,
+          [this, &array, &tasks, &ids, &cluster, trace] {
+            tracing::Scope scope(trace);
+            guarded(cluster, [this, &array, &tasks, &ids, &cluster] {
+              ids = submitTo(cluster, array->shape, tasks.size());
+            });
+          },
+          submit_timeout);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    if (submitted && tasks.size() > 1) {
+      arrays++;
+      coalesced += tasks.size();
+      std::cerr << "Submitted " << tasks.size() << " jobs as array job "
+                << (ids.empty() ? "" : ids[0]) << std::endl;
+    }
+    guard.lock();
+    for (size_t i = 0; i < tasks.size(); i++) {
+      tasks[i]->done = true;
+      tasks[i]->submitted = submitted;
+      tasks[i]->error = error;
+      if (i < ids.size()) {
+        tasks[i]->drmaa = ids[i];
+      } else if (submitted && !error) {
+        tasks[i]->error = std::make_exception_ptr(drmaa::exception(
+            DRMAA_ERRNO_INTERNAL_ERROR, "DRMAA returned too few task ids"));
+      }
+    }
+    batch_ready.notify_all();
+  }
+  batch_ready.wait(guard, [&pending] { return pending->done; });
+  if (pending->error) {
+    std::rethrow_exception(pending->error);
+  }
+  drmaa_id = pending->drmaa;
+  return pending->submitted;
+}
+
+std::vector<std::string>
+StatefulDrmaa::submitTo(const std::string &cluster, const JobRequest &job,
+                        size_t tasks) throw(drmaa::exception) {
+  std::vector<std::string> ids;
+  auto session = clusters->session(cluster);
+  auto started = std::chrono::steady_clock::now();
+  drmaa::job_template tmpl(session);
+  fill(tmpl, job);
+  if (tasks == 1) {
+    ids.push_back(clusters->qualify(cluster, tmpl.run()->name()));
+  } else {
+    for (auto &task : tmpl.run_bulk(1, tasks, 1)) {
+      ids.push_back(clusters->qualify(cluster, task->name()));
+    }
+  }
+  clusters->submitted(cluster, ids.size(),
+                      std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - started)
+                          .count());
+  return ids;
+}
+
+bool StatefulDrmaa::refresh(const std::string &job_id, int64_t &checked_at,
+                            bool &changed) {
+  changed = false;
+  TrackedJob tracked;
+  {
+    std::unique_lock<std::mutex> guard(table_lock);
+    // If it has been checked since this was scheduled, then someone else has
+    // already scheduled the next check
+    if (!jobs.get(job_id, tracked) || tracked.checked_at != checked_at) {
+      return false;
+    }
+  }
+  auto job = clusters->job(tracked.drmaa);
+  std::string unqualified;
+  auto cluster = clusters->owner(tracked.drmaa, unqualified);
+  std::shared_ptr<drmaa::job_result> result;
+  const char *strstatus;
+  polls++;
+  try {
+    guarded(cluster, [&job, &result, &strstatus] {
+      strstatus = determineStatus(job, result);
+    });
+  } catch (drmaa::exception &e) {
+    std::cerr << job_id << ": DRMAA error for " << tracked.drmaa << ": "
+              << e.what() << std::endl;
+    if (e.code() != DRMAA_ERRNO_INVALID_JOB) {
+      // Most likely the DRM is having a bad day, so try again later
+      return true;
+    }
+    // If the DRMAA client doesn't know what we're talking about, then it
+    // never will, so record the job as failed. Otherwise we'd pick it up
+    // again from the store after a restart and keep asking, and it would
+    // never expire.
+    auto now = time(nullptr);
+    std::unique_lock<std::mutex> guard(lock);
+    if (!isFinished(tracked.status)) {
+      archiveFinished(job_id, tracked.drmaa, "FAILED", nullptr);
+      clusters->finished(tracked.drmaa);
+      graphFinished(job_id, false);
+      JobRecord record{};
+      store->get(job_id, record);
+      record.drmaa = tracked.drmaa;
+      record.status = "FAILED";
+      record.updated_at = now;
+      store->put(job_id, record);
+      index->put(job_id, record.drmaa, record.status, record.updated_at);
+      changed = true;
+      std::cerr << job_id << ": Lost by DRMAA, so FAILED" << std::endl;
+    }
+    std::unique_lock<std::mutex> table_guard(table_lock);
+    jobs.erase(job_id);
+    return false;
+  }
+
+  auto now = time(nullptr);
+  std::unique_lock<std::mutex> guard(lock);
+  {
+    std::unique_lock<std::mutex> table_guard(table_lock);
+    if (!jobs.update(job_id, strstatus == nullptr ? tracked.status : strstatus,
+                     now)) {
+      // Purged while we were asking
+      return false;
+    }
+  }
+  checked_at = now;
+  JobRecord record{};
+  auto stored = store->get(job_id, record);
+  if (result) {
+    recordUsage(job_id, record, *result);
+  }
+  if (strstatus == nullptr) {
+    return true;
+  }
+  changed = tracked.status != strstatus;
+  if (isFinished(strstatus)) {
+    if (!isFinished(tracked.status)) {
+      archiveFinished(job_id, tracked.drmaa, strstatus, result.get());
+      clusters->finished(tracked.drmaa);
+      graphFinished(job_id, strcmp(strstatus, "SUCCEEDED") == 0);
+    }
+    // The index can answer for it from here on
+    std::unique_lock<std::mutex> table_guard(table_lock);
+    jobs.erase(job_id);
+  }
+  // Only write when something has changed, so a long-running job keeps the
+  // updated_at of its last change. That's safe because unfinished jobs are
+  // kept for a long time, and if one we're still tracking does expire,
+  // purgeExpired() doesn't forget it and this writes it back.
+  if (!stored || record.status != strstatus) {
+    record.drmaa = tracked.drmaa;
+    record.status = strstatus;
+    record.updated_at = now;
+    store->put(job_id, record);
+    index->put(job_id, record.drmaa, record.status, record.updated_at);
+    std::cerr << job_id << ": Status from DRMAA: " << strstatus << std::endl;
+  }
+  return !isFinished(strstatus);
+}
+
+void StatefulDrmaa::schedulePoll(const std::string &job_id, unsigned backoff,
+                                 int64_t checked_at) {
+  // Back off exponentially while nothing changes
+  backoff = std::min(backoff, 16u);
+  auto delay = std::min(poll_interval * (1 << backoff), poll_max);
+  std::unique_lock<std::mutex> guard(poll_lock);
+  poll_wheel.schedule(poll_wheel.now() + delay / poll_tick,
+                      {job_id, backoff, checked_at});
+}
+
+void StatefulDrmaa::poll() {
+  auto start = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> guard(poll_lock);
+  while (!poll_wake.wait_for(guard, poll_tick, [this] { return stopping; })) {
+    std::vector<PollTimer> due;
+    poll_wheel.advance((std::chrono::steady_clock::now() - start) / poll_tick,
+                       due);
+    poll_backlog.insert(poll_backlog.end(), due.begin(), due.end());
+    if (!poll_held.empty() && drmaaAvailable()) {
+      // In case a cluster came back while we were setting one of its aside
+      poll_backlog.insert(poll_backlog.end(), poll_held.begin(),
+                          poll_held.end());
+      poll_held.clear();
+    }
+    // Whatever we don't have the budget for now waits for the next tick, and
+    // checks on jobs whose cluster is down wait until it recovers
+    while (!poll_backlog.empty() && !stopping) {
+      auto timer = poll_backlog.front();
+      poll_backlog.pop_front();
+      guard.unlock();
+      if (!trackedAvailable(timer.job_id)) {
+        guard.lock();
+        poll_held.push_back(timer);
+        continue;
+      }
+      if (!drmaa_budget.tryAcquire()) {
+        guard.lock();
+        poll_backlog.push_front(timer);
+        break;
+      }
+      try {
+        bool changed;
+        auto checked_at = timer.checked_at;
+        if (refresh(timer.job_id, checked_at, changed)) {
+          schedulePoll(timer.job_id, changed ? 0 : timer.backoff + 1,
+                       checked_at);
+        }
+      } catch (std::exception &e) {
+        std::cerr << timer.job_id << ": Error while polling: " << e.what()
+                  << std::endl;
+      }
+      guard.lock();
+    }
+  }
+}
 
-  auto j = tmpl.run();
-  jobs[job_id] = j;
-  SQLite::Statement insert(db, "INSERT OR REPLACE INTO jobs (name, drmaa, "
-                               "status) VALUES (?, ?, 'WAITING')");
-  insert.bind(1, job_id);
-  insert.bind(2, j->name());
-  insert.exec();
-  std::cerr << job_id << ": Started as " << j->name() << std::endl;
-  return "QUEUED";
+size_t StatefulDrmaa::cacheSize() const {
+  std::unique_lock<std::mutex> guard(table_lock);
+  return jobs.size();
+}
+size_t StatefulDrmaa::purgedRows() const { return purged; }
+size_t StatefulDrmaa::archivedJobs() const {
+  return archive ? archive->archived() : 0;
 }
+size_t StatefulDrmaa::coalescedRequests() const { return inflight.coalesced(); }
+size_t StatefulDrmaa::dbSize() { return store->size(); }
+size_t StatefulDrmaa::indexSize() { return index->size(); }
+size_t StatefulDrmaa::cacheBytes() const {
+  std::unique_lock<std::mutex> guard(table_lock);
+  return jobs.bytes();
+}
+
+std::string StatefulDrmaa::track(const std::string &job_id,
+                                 JobState *settled) {
+  TrackedJob tracked;
+  if (jobs.get(job_id, tracked)) {
+    return tracked.drmaa;
+  }
+  IndexEntry entry;
+  auto indexed = index->get(job_id, entry);
+  if (indexed && isFinished(entry.status)) {
+    if (settled != nullptr) {
+      *settled = {entry.status, entry.updated_at, false};
+    }
+    return "";
+  }
+  if (indexed && !entry.drmaa.empty()) {
+    std::unique_lock<std::mutex> table_guard(table_lock);
+    jobs.put(job_id, {entry.drmaa, entry.status, 0});
+    return entry.drmaa;
+  }
+  // Either the index only knows that the id was too long to fit, or it lost
+  // the job to a slot torn in a crash; the store has it either way
+  JobRecord record;
+  if (!store->get(job_id, record)) {
+    if (indexed && settled != nullptr) {
+      *settled = {entry.status, entry.updated_at, false};
+    }
+    return "";
+  }
+  if (isFinished(record.status)) {
+    if (settled != nullptr) {
+      *settled = {record.status, record.updated_at, false};
+    }
+    return "";
+  }
+  if (!indexed) {
+    std::cerr << job_id << ": Picked up " << record.drmaa << " from the store"
+              << std::endl;
+    index->put(job_id, record.drmaa, record.status, record.updated_at);
+  }
+  std::unique_lock<std::mutex> table_guard(table_lock);
+  jobs.put(job_id, {record.drmaa, record.status, 0});
+  return record.drmaa;
+}
+
+size_t StatefulDrmaa::pollsScheduled() {
+  std::unique_lock<std::mutex> guard(poll_lock);
+  return poll_wheel.size();
+}
+size_t StatefulDrmaa::pollBacklog() {
+  std::unique_lock<std::mutex> guard(poll_lock);
+  return poll_backlog.size();
+}
+size_t StatefulDrmaa::drmaaPolls() const { return polls; }
+
+std::vector<TenantStats> StatefulDrmaa::submitQueues() {
+  return submissions.stats();
+}
+
+size_t StatefulDrmaa::throttledSubmissions() const { return throttled; }
 
-size_t StatefulDrmaa::cacheSize() const { return jobs.size(); }
-size_t StatefulDrmaa::dbSize() {
-  SQLite::Statement query(db, "SELECT COUNT(*) FROM jobs");
-  if (query.executeStep()) {
-    return query.getColumn(0).getInt();
+size_t StatefulDrmaa::arrayJobs() const { return arrays; }
+
+size_t StatefulDrmaa::coalescedSubmissions() const { return coalesced; }
+
+bool StatefulDrmaa::drmaaAvailable() const {
+  for (auto &breaker : breakers) {
+    if (!breaker.second->closed()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t StatefulDrmaa::breakerTrips() const {
+  size_t trips = 0;
+  for (auto &breaker : breakers) {
+    trips += breaker.second->trips();
+  }
+  return trips;
+}
+
+size_t StatefulDrmaa::staleAnswers() const { return stale_answers; }
+
+size_t StatefulDrmaa::parkedSubmissions() {
+  std::unique_lock<std::mutex> guard(parked_lock);
+  return parked.size();
+}
+
+void StatefulDrmaa::replayParked() {
+  std::map<std::string, JobRequest> replay;
+  {
+    std::unique_lock<std::mutex> guard(parked_lock);
+    replay.swap(parked);
+  }
+  if (!replay.empty()) {
+    std::cerr << "Submitting " << replay.size() << " parked jobs" << std::endl;
+  }
+  // If the client has asked again in the mean time, run() finds the job
+  // already going and doesn't submit it twice; if DRMAA goes away again, it
+  // is parked again
+  for (auto &entry : replay) {
+    auto job = entry.second;
+    graph_pool.submit([this, job] {
+      try {
+        run(job);
+      } catch (drmaa::exception &e) {
+        std::cerr << "Failed to submit parked job: " << e.what() << std::endl;
+      }
+    });
+  }
+}
+
+size_t StatefulDrmaa::runningGraphs() { return graphs->running(); }
+
+std::vector<ClusterStats> StatefulDrmaa::clusterStats() {
+  return clusters->stats();
+}
+
+void StatefulDrmaa::guarded(const std::string &cluster,
+                            const std::function<void()> &call) {
+  auto &breaker = *breakers.at(cluster);
+  auto started = std::chrono::steady_clock::now();
+  try {
+    call();
+  } catch (drmaa::exception &e) {
+    if (e.unreachable()) {
+      clusters->unreachable(cluster);
+    }
+    breaker.record(started, !e.unreachable());
+    throw;
+  }
+  breaker.record(started, true);
+}
+
+bool StatefulDrmaa::available(const std::string &drmaa_id) const {
+  std::string unqualified;
+  return breakers.at(clusters->owner(drmaa_id, unqualified))->closed();
+}
+
+bool StatefulDrmaa::trackedAvailable(const std::string &job_id) const {
+  TrackedJob tracked;
+  std::unique_lock<std::mutex> guard(table_lock);
+  return !jobs.get(job_id, tracked) || available(tracked.drmaa);
+}
+
+void StatefulDrmaa::recordUsage(const std::string &job_id,
+                                const JobRecord &record,
+                                drmaa::job_result &result) {
+  auto &category = record.job_category;
+  auto prefix = namePrefix(record.job_name);
+  store->putUsage(job_id, result.usage());
+  for (auto resource : result.usage()) {
+    auto &total = usage_totals[std::make_tuple(category, prefix,
+                                               resource.first)];
+    total.first++;
+    total.second += resource.second;
+  }
+  std::cerr << job_id << ": Recorded " << result.usage().size()
+            << " resource usage values" << std::endl;
+}
+
+void StatefulDrmaa::archiveFinished(const std::string &job_id,
+                                    const std::string &drmaa_id,
+                                    const std::string &status,
+                                    drmaa::job_result *result) {
+  if (!archive) {
+    return;
+  }
+  ArchiveRecord record{job_id, drmaa_id, status, "", "", time(nullptr), -1,
+                       "",     false};
+  JobRecord stored;
+  if (store->get(job_id, stored)) {
+    record.job_name = stored.job_name;
+    record.job_category = stored.job_category;
+  }
+  if (result != nullptr) {
+    if (result->exited().second) {
+      record.exit_status = result->exited().first;
+    }
+    if (result->signalled().second) {
+      record.signal = result->signalled().first;
+    }
+    record.aborted = result->aborted();
+  }
+  archive->append(record);
+}
+
+std::map<std::string, double> StatefulDrmaa::usage(const JobRequest &job) {
+  return store->getUsage(job.str());
+}
+
+bool StatefulDrmaa::lookup(const std::string &key, JobRecord &record) {
+  return store->get(key, record);
+}
+
+std::map<std::string, std::string>
+StatefulDrmaa::status(const std::vector<std::string> &keys) {
+  std::map<std::string, std::string> output;
+  std::vector<std::string> missing;
+  {
+    // Anything we are tracking or have indexed, we can answer from memory;
+    // everything else goes to the store in one batch. As in cached(), that
+    // doesn't need the main lock, which is held across writes to the store.
+    std::unique_lock<std::mutex> guard(table_lock);
+    for (auto &key : keys) {
+      auto tracked = jobs.status(key);
+      IndexEntry entry;
+      if (tracked != nullptr) {
+        output[key] = tracked;
+      } else if (index->get(key, entry)) {
+        output[key] = entry.status;
+      } else {
+        missing.push_back(key);
+      }
+    }
+  }
+  if (!missing.empty()) {
+    auto stored = store->statuses(missing);
+    output.insert(stored.begin(), stored.end());
+  }
+  return output;
+}
+
+std::map<std::string, ControlOutcome>
+StatefulDrmaa::control(bool (drmaa::job::*action)(),
+                       const std::string &new_status,
+                       const std::vector<std::string> &keys) {
+  std::map<std::string, ControlOutcome> output;
+  std::vector<std::pair<std::string, std::string>> targets;
+  std::unique_lock<std::mutex> guard(lock);
+  for (auto &key : keys) {
+    auto drmaa_id = track(key);
+    if (!drmaa_id.empty()) {
+      targets.push_back(std::make_pair(key, drmaa_id));
+      continue;
+    }
+    // We may have stopped tracking it after a DRMAA error, but the DRM might
+    // still know what it is
+    JobRecord record;
+    if (!store->get(key, record)) {
+      output[key] = {false, "", "Unknown job."};
+    } else if (isFinished(record.status)) {
+      output[key] = {false, record.status, "Job has already finished."};
+    } else {
+      targets.push_back(std::make_pair(key, record.drmaa));
+    }
+  }
+
+  guard.unlock();
+
+  // Jobs on a cluster that is down get an answer now rather than a timeout
+  auto down = std::remove_if(
+      targets.begin(), targets.end(),
+      [this, &output](const std::pair<std::string, std::string> &target) {
+        if (available(target.second)) {
+          return false;
+        }
+        output[target.first] = {false, "", "DRMAA is unavailable."};
+        return true;
+      });
+  targets.erase(down, targets.end());
+  if (targets.empty()) {
+    return output;
+  }
+
+  // Each drmaa_control call is a round trip to the DRM, so do lots at once
+  std::vector<ControlOutcome> outcomes(targets.size());
+  Latch latch(targets.size());
+  for (size_t i = 0; i < targets.size(); i++) {
+    auto drmaa_id = targets[i].second;
+    auto outcome = &outcomes[i];
+    control_pool.submit([this, drmaa_id, outcome, action, &new_status,
+                         &latch] {
+      try {
+        auto target = clusters->job(drmaa_id);
+        std::string unqualified;
+        auto cluster = clusters->owner(drmaa_id, unqualified);
+        guarded(cluster, [&target, action, outcome] {
+          outcome->changed = (target.*action)();
+        });
+        outcome->status = outcome->changed ? new_status : "";
+      } catch (std::exception &e) {
+        outcome->changed = false;
+        outcome->error = e.what();
+      }
+      latch.countDown();
+    });
+  }
+  latch.wait();
+
+  guard.lock();
+  auto now = time(nullptr);
+  std::vector<std::pair<std::string, JobRecord>> changes;
+  std::vector<std::string> tracked;
+  for (size_t i = 0; i < targets.size(); i++) {
+    auto &key = targets[i].first;
+    output[key] = outcomes[i];
+    if (!outcomes[i].changed) {
+      continue;
+    }
+    auto tracked_status = jobs.status(key);
+    if (tracked_status != nullptr) {
+      if (isFinished(new_status) && !isFinished(tracked_status)) {
+        archiveFinished(key, targets[i].second, new_status, nullptr);
+        clusters->finished(targets[i].second);
+      }
+      std::unique_lock<std::mutex> table_guard(table_lock);
+      jobs.update(key, new_status, now);
+      tracked.push_back(key);
+    }
+    if (isFinished(new_status)) {
+      graphFinished(key, new_status == "SUCCEEDED");
+    }
+    JobRecord record;
+    if (store->get(key, record)) {
+      record.status = new_status;
+      record.updated_at = now;
+      changes.push_back(std::make_pair(key, record));
+    }
+    std::cerr << key << ": Changed to " << new_status << " by request"
+              << std::endl;
+  }
+  store->putAll(changes);
+  for (auto &change : changes) {
+    index->put(change.first, change.second.drmaa, change.second.status,
+               change.second.updated_at);
+  }
+  guard.unlock();
+  // Check up on them soon, to see that it took and to collect the usage of
+  // anything we killed
+  for (auto &key : tracked) {
+    schedulePoll(key, 0, now);
+  }
+  return output;
+}
+
+std::vector<std::string> StatefulDrmaa::select(const std::string &job_name,
+                                               const std::string &job_category) {
+  std::vector<std::string> output;
+  store->unfinished([&](const std::string &key, const JobRecord &record) {
+    if ((job_name.empty() || record.job_name == job_name) &&
+        (job_category.empty() || record.job_category == job_category)) {
+      output.push_back(key);
+    }
+  });
+  return output;
+}
+
+std::vector<std::pair<std::string, JobRecord>>
+StatefulDrmaa::list(const JobFilter &filter, const ListCursor &after,
+                    size_t limit) {
+  return store->list(filter, after, limit);
+}
+
+std::vector<UsageSummary> StatefulDrmaa::usageSummaries() const {
+  std::vector<UsageSummary> output;
+  std::unique_lock<std::mutex> guard(lock);
+  for (auto total : usage_totals) {
+    output.push_back({std::get<0>(total.first), std::get<1>(total.first),
+                      std::get<2>(total.first), total.second.first,
+                      total.second.second});
+  }
+  return output;
+}
+
+std::string StatefulDrmaa::runGraph(
+    const std::map<std::string, JobRequest> &graph_jobs,
+    const std::map<std::string, std::vector<std::string>> &dependencies,
+    std::vector<GraphNode> &nodes) {
+  static const size_t max_jobs = envSize("DRMAAWS_GRAPH_MAX_JOBS", 10000);
+  if (graph_jobs.empty()) {
+    throw std::invalid_argument("Graph has no jobs.");
+  }
+  if (graph_jobs.size() > max_jobs) {
+    throw std::invalid_argument("Too many jobs in graph.");
+  }
+  nodes.clear();
+  std::vector<std::pair<std::string, std::string>> edges;
+  std::map<std::string, size_t> waiting;
+  std::map<std::string, std::vector<std::string>> children;
+  for (auto &dependency : dependencies) {
+    if (graph_jobs.count(dependency.first) == 0) {
+      throw std::invalid_argument("Unknown job in dependencies: " +
+                                  dependency.first);
+    }
+    for (auto &parent : dependency.second) {
+      if (graph_jobs.count(parent) == 0) {
+        throw std::invalid_argument("Unknown job in dependencies: " + parent);
+      }
+      edges.push_back(std::make_pair(parent, dependency.first));
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+  edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+  for (auto &edge : edges) {
+    waiting[edge.second]++;
+    children[edge.first].push_back(edge.second);
+  }
+  // Take away jobs with nothing left to wait for until there are none; if
+  // anything is left over, it's waiting on itself somehow
+  std::vector<std::string> free;
+  for (auto &job : graph_jobs) {
+    if (waiting[job.first] == 0) {
+      free.push_back(job.first);
+    }
+  }
+  size_t ordered = 0;
+  while (!free.empty()) {
+    auto name = free.back();
+    free.pop_back();
+    ordered++;
+    for (auto &child : children[name]) {
+      if (--waiting[child] == 0) {
+        free.push_back(child);
+      }
+    }
+  }
+  if (ordered != graph_jobs.size()) {
+    throw std::invalid_argument("Dependencies form a cycle.");
+  }
+
+  // The same graph of the same jobs always gets the same id, so it can be
+  // resubmitted as safely as a single job
+  std::stringstream description;
+  for (auto &job : graph_jobs) {
+    nodes.push_back({"", job.first, job.second.str(), "", job.second});
+    description << job.first << '\0' << nodes.back().key << '\0';
+  }
+  for (auto &edge : edges) {
+    description << edge.first << '\0' << edge.second << '\0';
+  }
+  auto id = std::to_string(std::hash<std::string>{}(description.str()));
+  for (auto &node : nodes) {
+    node.graph = id;
+  }
+
+  if (graphs->create(id, nodes, edges)) {
+    std::cerr << "Graph " << id << ": Created with " << nodes.size()
+              << " jobs and " << edges.size() << " dependencies" << std::endl;
+    // Starting them can take a while for a wide graph, so leave it to the
+    // graph thread and answer now
+    std::unique_lock<std::mutex> guard(graph_lock);
+    for (auto &node : nodes) {
+      auto parents = dependencies.find(node.name);
+      if (parents == dependencies.end() || parents->second.empty()) {
+        graph_roots.push_back(node);
+      }
+    }
+    graph_wake.notify_one();
+  }
+  nodes.clear();
+  graphs->get(id, nodes);
+  return id;
+}
+
+bool StatefulDrmaa::graph(const std::string &id,
+                          std::vector<GraphNode> &nodes) {
+  return graphs->get(id, nodes);
+}
+
+void StatefulDrmaa::graphFinished(const std::string &job_id, bool succeeded) {
+  std::unique_lock<std::mutex> guard(graph_lock);
+  graph_events.push_back(std::make_pair(job_id, succeeded));
+  graph_wake.notify_one();
+}
+
+void StatefulDrmaa::startGraphJob(const GraphNode &node) {
+  {
+    // Anything still queued when we stop is started again by the sweep after
+    // the restart
+    std::unique_lock<std::mutex> guard(graph_lock);
+    if (stopping) {
+      return;
+    }
+  }
+  JobState state;
+  try {
+    state = run(node.job);
+  } catch (drmaa::exception &e) {
+    std::cerr << node.key << ": Cannot start " << node.name << " in graph "
+              << node.graph << ": " << e.what() << std::endl;
+    // If DRMAA is there but won't take it, it never will
+    if (!e.unreachable()) {
+      graphFinished(node.key, false);
+    }
+    return;
+  }
+  if (isFinished(state.status)) {
+    // It had already run, from this graph or another
+    graphFinished(node.key, state.status == "SUCCEEDED");
+  } else if (state.status != "THROTTLED") {
+    graphs->submitted(node.graph, node.name);
+  }
+}
+
+void StatefulDrmaa::followGraphs() {
+  // Every so often, go over every job that should be running, in case it was
+  // throttled or we lost track of it; the first time round picks up where we
+  // left off before a restart
+  static const std::chrono::seconds sweep_interval(60);
+  auto last_sweep = std::chrono::steady_clock::now() - sweep_interval;
+  std::unique_lock<std::mutex> guard(graph_lock);
+  while (!stopping) {
+    graph_wake.wait_until(guard, last_sweep + sweep_interval, [this] {
+      return stopping || !graph_events.empty() || !graph_roots.empty() ||
+             replay_parked;
+    });
+    if (stopping) {
+      break;
+    }
+    std::deque<std::pair<std::string, bool>> events;
+    events.swap(graph_events);
+    std::vector<GraphNode> ready(graph_roots.begin(), graph_roots.end());
+    graph_roots.clear();
+    auto replay = replay_parked;
+    replay_parked = false;
+    auto now = std::chrono::steady_clock::now();
+    auto sweep = now - last_sweep >= sweep_interval;
+    if (sweep) {
+      last_sweep = now;
+    }
+    guard.unlock();
+    if (replay) {
+      replayParked();
+    }
+    try {
+      for (auto &event : events) {
+        auto released = graphs->finish(event.first, event.second);
+        for (auto &node : released) {
+          std::cerr << node.key << ": Ready to start " << node.name
+                    << " in graph " << node.graph << std::endl;
+        }
+        std::move(released.begin(), released.end(), std::back_inserter(ready));
+      }
+      if (sweep) {
+        auto active = graphs->active();
+        std::move(active.begin(), active.end(), std::back_inserter(ready));
+      }
+      for (auto &node : ready) {
+        graph_pool.submit([this, node] { startGraphJob(node); });
+      }
+    } catch (std::exception &e) {
+      std::cerr << "Error while following graphs: " << e.what() << std::endl;
+    }
+    guard.lock();
   }
-  return 0;
 }
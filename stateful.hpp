@@ -1,38 +1,260 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
-#include <SQLiteCpp/SQLiteCpp.h>
+#include "archive.hpp"
+#include "arrayjobs.hpp"
+#include "breaker.hpp"
+#include "clusters.hpp"
 #include "drmaapp.hpp"
+#include "executor.hpp"
+#include "fairqueue.hpp"
+#include "graphstore.hpp"
+#include "jobindex.hpp"
+#include "jobrequest.hpp"
+#include "jobtable.hpp"
+#include "singleflight.hpp"
+#include "statestore.hpp"
+#include "timerwheel.hpp"
 
-class JobRequest {
-public:
-  JobRequest();
+// What we know about a job and when we last heard it from DRMAA, in seconds
+// since the epoch
+struct JobState {
+  std::string status;
+  int64_t checked_at;
+  // Whether DRMAA couldn't be asked, so this may be out of date
+  bool stale;
+};
 
-  std::map<std::string, std::string> &attributes();
-  std::map<std::string, std::vector<std::string>> &v_attributes();
-  const std::map<std::string, std::string> &attributes() const;
-  const std::map<std::string, std::vector<std::string>> &v_attributes() const;
-  std::string str() const;
+struct ControlOutcome {
+  bool changed;
+  std::string status;
+  std::string error;
+};
 
-private:
-  std::map<std::string, std::string> attrs;
-  std::map<std::string, std::vector<std::string>> v_attrs;
+struct UsageSummary {
+  std::string category;
+  std::string prefix;
+  std::string resource;
+  size_t count;
+  double sum;
 };
 
 class StatefulDrmaa {
 public:
-  StatefulDrmaa() throw(drmaa::exception);
+  explicit StatefulDrmaa(const std::shared_ptr<drmaa::session> &session) throw(
+      drmaa::exception);
+  explicit StatefulDrmaa(const std::shared_ptr<Clusters> &clusters) throw(
+      drmaa::exception);
+  ~StatefulDrmaa();
 
-  std::string run(const JobRequest &job) throw(drmaa::exception);
+  JobState run(const JobRequest &job) throw(drmaa::exception);
+  // The same, for a caller that already has the job's key
+  JobState run(const JobRequest &job,
+               const std::string &job_id) throw(drmaa::exception);
+  // The tenant a job's submission is queued for
+  std::string tenant(const JobRequest &job) const;
+  // What run would say about a job if it can answer from memory without
+  // waiting on anything; false if it would have to ask DRMAA or submit it
+  bool cached(const std::string &job_id, JobState &state);
+  std::map<std::string, double> usage(const JobRequest &job);
+  // What the store has on a job
+  bool lookup(const std::string &key, JobRecord &record);
+  std::map<std::string, std::string>
+  status(const std::vector<std::string> &keys);
+  std::map<std::string, ControlOutcome>
+  control(bool (drmaa::job::*action)(), const std::string &new_status,
+          const std::vector<std::string> &keys);
+  std::vector<std::string> select(const std::string &job_name,
+                                  const std::string &job_category);
+  std::vector<std::pair<std::string, JobRecord>>
+  list(const JobFilter &filter, const ListCursor &after, size_t limit);
+  // Take a graph of jobs, given by name along with the names of the jobs each
+  // depends on, and start whatever doesn't depend on anything. The rest are
+  // started as what they depend on succeeds. Returns the graph's id and its
+  // jobs; throws std::invalid_argument if the dependencies aren't acyclic.
+  std::string
+  runGraph(const std::map<std::string, JobRequest> &graph_jobs,
+           const std::map<std::string, std::vector<std::string>> &dependencies,
+           std::vector<GraphNode> &nodes);
+  bool graph(const std::string &id, std::vector<GraphNode> &nodes);
 
   size_t cacheSize() const;
+  size_t cacheBytes() const;
+  size_t coalescedRequests() const;
   size_t dbSize();
+  size_t indexSize();
+  size_t purgedRows() const;
+  size_t archivedJobs() const;
+  std::vector<UsageSummary> usageSummaries() const;
+  size_t pollsScheduled();
+  size_t pollBacklog();
+  size_t drmaaPolls() const;
+  std::vector<TenantStats> submitQueues();
+  size_t throttledSubmissions() const;
+  size_t arrayJobs() const;
+  size_t coalescedSubmissions() const;
+  bool drmaaAvailable() const;
+  size_t breakerTrips() const;
+  size_t staleAnswers() const;
+  size_t parkedSubmissions();
+  size_t runningGraphs();
+  std::vector<ClusterStats> clusterStats();
 
 private:
-  std::shared_ptr<drmaa::session> sess;
-  SQLite::Database db;
-  std::map<std::string, std::shared_ptr<drmaa::job>> jobs;
+  struct PollTimer {
+    std::string job_id;
+    unsigned backoff;
+    // When the job was last checked as of scheduling this; if it has been
+    // checked since, this timer is stale
+    int64_t checked_at;
+  };
+
+  struct PendingSubmission {
+    const JobRequest *job;
+    std::string tenant;
+    std::string cluster;
+    // Set once the batching window has closed and it has been put in an array
+    bool ready;
+    // For the first submission in each array, the array and everyone in it
+    std::unique_ptr<ArrayJob> array;
+    std::vector<std::shared_ptr<PendingSubmission>> tasks;
+    bool done;
+    bool submitted;
+    std::string drmaa;
+    std::exception_ptr error;
+  };
+
+  JobState runOnce(const std::string &job_id,
+                   const JobRequest &job) throw(drmaa::exception);
+  // Hand a new job to DRMAA, giving back its id, or false if it wasn't
+  // submitted in time
+  bool submit(const JobRequest &job, const std::string &tenant,
+              const std::string &cluster,
+              std::string &drmaa_id) throw(drmaa::exception);
+  // Submit a job, or an array of that many tasks, to a cluster and return
+  // the qualified ids
+  std::vector<std::string> submitTo(const std::string &cluster,
+                                    const JobRequest &job,
+                                    size_t tasks) throw(drmaa::exception);
+  // Make a DRMAA call to a cluster, letting its breaker know how it went
+  void guarded(const std::string &cluster, const std::function<void()> &call);
+  // Whether the cluster a job id belongs to is being called
+  bool available(const std::string &drmaa_id) const;
+  // The same, for a tracked job; true if it isn't tracked
+  bool trackedAvailable(const std::string &job_id) const;
+  void maintain();
+  void poll();
+  // Ask DRMAA about a job and record any change. Returns whether it should be
+  // checked again, and updates checked_at to when this check happened
+  bool refresh(const std::string &job_id, int64_t &checked_at, bool &changed);
+  void schedulePoll(const std::string &job_id, unsigned backoff,
+                    int64_t checked_at);
+  // Find the DRMAA id of a job we should be asking the DRM about, picking it
+  // back up from the index or the store if need be. If there isn't one but we
+  // know of the job, settled is set to what we last heard. Must be called with
+  // the lock held
+  std::string track(const std::string &job_id, JobState *settled = nullptr);
+  size_t purgeExpired();
+  // Must be called with the lock held
+  void recordUsage(const std::string &job_id, const JobRecord &record,
+                   drmaa::job_result &result);
+  void archiveFinished(const std::string &job_id, const std::string &drmaa_id,
+                       const std::string &status, drmaa::job_result *result);
+  // Submit whatever was parked while DRMAA was unavailable. Only called from
+  // the graph thread, which a breaker wakes when its cluster is back.
+  void replayParked();
+  // Let any graphs a job is in know that it has finished
+  void graphFinished(const std::string &job_id, bool succeeded);
+  void startGraphJob(const GraphNode &node);
+  void followGraphs();
+
+  std::shared_ptr<Clusters> clusters;
+  // Guards the jobs table, along with table_lock for changes, and the usage
+  // totals, and keeps the store consistent with them; never held while waiting
+  // on the DRM
+  mutable std::mutex lock;
+  SingleFlight<JobState> inflight;
+  std::unique_ptr<StateStore> store;
+  // Which jobs were still running, so we can pick them up again after a
+  // restart without reading the whole store
+  std::unique_ptr<JobIndex> index;
+  JobTable jobs;
+  // Also needed to change the jobs table, but never held across anything
+  // slower, so it can be read without waiting on the store
+  mutable std::mutex table_lock;
+  Executor control_pool;
+  std::unique_ptr<ArchiveWriter> archive;
+  std::map<std::tuple<std::string, std::string, std::string>,
+           std::pair<size_t, double>>
+      usage_totals;
+  // Days to keep rows in each status; "*" applies to anything not listed
+  std::map<std::string, double> retention;
+  std::atomic<size_t> purged;
+  // New jobs are queued for submission by the value of this attribute
+  std::string tenant_attribute;
+  FairQueue submissions;
+  std::chrono::milliseconds submit_timeout;
+  std::atomic<size_t> throttled;
+  // Submissions waiting for the batching window to close, so similar ones can
+  // be sent as array jobs
+  std::chrono::milliseconds batch_window;
+  size_t batch_max;
+  std::string task_variable;
+  std::mutex batch_lock;
+  std::condition_variable batch_full;
+  std::condition_variable batch_ready;
+  std::vector<std::shared_ptr<PendingSubmission>> batch_pending;
+  std::atomic<size_t> arrays;
+  std::atomic<size_t> coalesced;
+  std::mutex maintenance_lock;
+  std::condition_variable maintenance_wake;
+  // Jobs waiting for their next check, and those that are due but we don't
+  // yet have the budget for
+  std::mutex poll_lock;
+  std::condition_variable poll_wake;
+  TimerWheel<PollTimer> poll_wheel;
+  std::deque<PollTimer> poll_backlog;
+  // Checks on jobs whose cluster is unavailable, until it recovers
+  std::deque<PollTimer> poll_held;
+  RateLimiter drmaa_budget;
+  std::chrono::milliseconds poll_interval;
+  std::chrono::milliseconds poll_max;
+  std::atomic<size_t> polls;
+  std::atomic<size_t> stale_answers;
+  // New jobs asked for while DRMAA was unavailable, by key, to be submitted
+  // once it's back
+  std::mutex parked_lock;
+  std::map<std::string, JobRequest> parked;
+  size_t park_max;
+  // Jobs whose graphs need to hear that they have finished, and the threads
+  // that start the jobs that can go next
+  std::unique_ptr<GraphStore> graphs;
+  std::mutex graph_lock;
+  std::condition_variable graph_wake;
+  std::deque<std::pair<std::string, bool>> graph_events;
+  // Jobs of new graphs that can start straight away
+  std::deque<GraphNode> graph_roots;
+  bool replay_parked;
+  // One for each cluster, tripping when it stops answering, so we answer from
+  // what we know about its jobs instead of waiting on it. They wake the graph
+  // thread when their cluster is back, so have to be stopped before the above
+  // goes away, but outlive the graph pool, whose jobs they are asked about.
+  std::map<std::string, std::unique_ptr<CircuitBreaker>> breakers;
+  Executor graph_pool;
+  bool stopping;
+  std::thread maintenance;
+  std::thread poller;
+  std::thread grapher;
 };
@@ -0,0 +1,42 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include "logstore.hpp"
+#include "sqlitestore.hpp"
+#include "statestore.hpp"
+
+static const char *const status_names[] = {
+    "", "QUEUED", "INFLIGHT", "WAITING", "SUCCEEDED", "FAILED", "THROTTLED",
+    "UNKNOWN"};
+static const size_t status_count =
+    sizeof(status_names) / sizeof(status_names[0]);
+
+StateStore::~StateStore() {}
+
+bool isFinished(const std::string &status) {
+  return status == "SUCCEEDED" || status == "FAILED";
+}
+
+uint8_t statusCode(const std::string &status) {
+  for (size_t i = 1; i < status_count; i++) {
+    if (status == status_names[i]) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+const char *statusName(uint8_t code) {
+  return code < status_count ? status_names[code] : "";
+}
+
+std::unique_ptr<StateStore> openStateStore() {
+  auto kind = getenv("DRMAAWS_STORE");
+  if (kind == nullptr || strcmp(kind, "sqlite") == 0) {
+    return std::unique_ptr<StateStore>(new SqliteStateStore("drmaaws.db3"));
+  }
+  if (strcmp(kind, "log") == 0) {
+    return std::unique_ptr<StateStore>(new LogStateStore("drmaaws.log"));
+  }
+  throw std::runtime_error(std::string("Unknown state store: ") + kind);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct JobRecord {
+  std::string drmaa;
+  std::string status;
+  // Seconds since the epoch
+  int64_t updated_at;
+  std::string job_name;
+  std::string job_category;
+  // Where its output and error streams are written, if we know
+  std::string output_path;
+  std::string error_path;
+};
+
+// Which jobs to list; empty strings and zero times match anything
+struct JobFilter {
+  std::string status;
+  // Updated at or after since, and before until
+  int64_t since;
+  int64_t until;
+  std::string job_name_prefix;
+  std::string drmaa;
+};
+
+// Where a listing is up to: the last job returned, or an empty key to start
+// from the beginning
+struct ListCursor {
+  int64_t updated_at;
+  std::string key;
+};
+
+// Persistent storage for everything we know about jobs, indexed by job key.
+// Implementations must be safe to call from multiple threads.
+class StateStore {
+public:
+  virtual ~StateStore();
+
+  virtual bool get(const std::string &key, JobRecord &record) = 0;
+  virtual void put(const std::string &key, const JobRecord &record) = 0;
+  // Write several records at once, atomically if the store can
+  virtual void
+  putAll(const std::vector<std::pair<std::string, JobRecord>> &records) = 0;
+  // Look up the status of many jobs; unknown keys are left out
+  virtual std::map<std::string, std::string>
+  statuses(const std::vector<std::string> &keys) = 0;
+
+  virtual void putUsage(const std::string &key,
+                        const std::map<std::string, double> &usage) = 0;
+  virtual std::map<std::string, double> getUsage(const std::string &key) = 0;
+
+  // List up to limit matching jobs after a cursor, ordered by when they were
+  // last updated and then by key
+  virtual std::vector<std::pair<std::string, JobRecord>>
+  list(const JobFilter &filter, const ListCursor &after, size_t limit) = 0;
+  // Visit every job that hasn't succeeded or failed
+  virtual void unfinished(
+      const std::function<void(const std::string &, const JobRecord &)>
+          &consumer) = 0;
+  // Delete up to limit jobs older than the number of days given for their
+  // status ("*" for any other status) and return their keys
+  virtual std::vector<std::string>
+  expire(const std::map<std::string, double> &retention, size_t limit) = 0;
+  // Reclaim space; called periodically from a background thread
+  virtual void compact() = 0;
+  virtual size_t size() = 0;
+};
+
+bool isFinished(const std::string &status);
+// Number every status we use from 1, for anything that wants to store them in
+// a byte; 0 is any other string
+uint8_t statusCode(const std::string &status);
+const char *statusName(uint8_t code);
+
+// Create the store selected by DRMAAWS_STORE: sqlite (the default) or log
+std::unique_ptr<StateStore> openStateStore();
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// A hierarchical timing wheel, for scheduling lots of values to come due at
+// some tick in the future. The first level has a slot for each of the next 256
+// ticks; each further level has 64 slots, each covering a whole turn of the
+// level below, and is emptied into it as that comes round. Scheduling is
+// constant time, and so is advancing by a tick, apart from the occasional
+// cascade. Anything further out than the top level can reach (about 67 million
+// ticks) is scheduled at the furthest tick it can.
+//
+// Not thread-safe.
+template <typename T> class TimerWheel {
+public:
+  TimerWheel() : current(0), count(0) {
+    levels.resize(level_count);
+    levels[0].resize(1 << first_bits);
+    for (size_t i = 1; i < level_count; i++) {
+      levels[i].resize(1 << level_bits);
+    }
+  }
+
+  uint64_t now() const { return current; }
+  size_t size() const { return count; }
+
+  // Schedule a value for a tick; anything already due goes out on the next one
+  void schedule(uint64_t tick, const T &value) {
+    count++;
+    place(tick <= current ? current + 1 : tick, value);
+  }
+
+  // Move forward to a tick, adding everything that has come due to output
+  void advance(uint64_t tick, std::vector<T> &output) {
+    while (current < tick) {
+      current++;
+      if ((current & first_mask) == 0) {
+        cascade(1);
+      }
+      auto &slot = levels[0][current & first_mask];
+      count -= slot.size();
+      for (auto &entry : slot) {
+        output.push_back(entry.second);
+      }
+      slot.clear();
+    }
+  }
+
+private:
+  static const size_t level_count = 4;
+  static const unsigned first_bits = 8;
+  static const unsigned level_bits = 6;
+  static const uint64_t first_mask = (1 << first_bits) - 1;
+  static const uint64_t level_mask = (1 << level_bits) - 1;
+
+  static unsigned shift(size_t level) {
+    return level == 0 ? 0 : first_bits + (level - 1) * level_bits;
+  }
+
+  void place(uint64_t tick, const T &value) {
+    auto limit = (uint64_t)1 << shift(level_count);
+    if (tick - current >= limit) {
+      tick = current + limit - 1;
+    }
+    for (size_t level = 0; level < level_count; level++) {
+      if (tick - current < ((uint64_t)1 << shift(level + 1))) {
+        auto mask = level == 0 ? first_mask : level_mask;
+        levels[level][(tick >> shift(level)) & mask].push_back(
+            std::make_pair(tick, value));
+        return;
+      }
+    }
+  }
+
+  // The level below has just wrapped, so move the next slot of this level down
+  void cascade(size_t level) {
+    if (level >= level_count) {
+      return;
+    }
+    auto index = (current >> shift(level)) & level_mask;
+    if (index == 0) {
+      cascade(level + 1);
+    }
+    Slot entries;
+    entries.swap(levels[level][index]);
+    for (auto &entry : entries) {
+      place(entry.first, entry.second);
+    }
+  }
+
+  typedef std::vector<std::pair<uint64_t, T>> Slot;
+
+  uint64_t current;
+  size_t count;
+  std::vector<std::vector<Slot>> levels;
+};
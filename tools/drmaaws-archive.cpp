@@ -0,0 +1,73 @@
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include "archive.hpp"
+
+// Dump archived jobs as tab-separated values, reading only the columns asked
+// for
+int main(int argc, char **argv) {
+  std::vector<std::string> selected;
+  bool header = true;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:Hh")) != -1) {
+    switch (opt) {
+    case 'c': {
+      std::stringstream input(optarg);
+      std::string column;
+      while (std::getline(input, column, ',')) {
+        selected.push_back(column);
+      }
+      break;
+    }
+    case 'H':
+      header = false;
+      break;
+    default:
+      std::cerr << "Usage: " << argv[0] << " [-c column,column...] [-H] "
+                << "segment.dwa..." << std::endl
+                << "Columns:";
+      for (auto &column : archive_columns) {
+        std::cerr << " " << column.first;
+      }
+      std::cerr << std::endl;
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (selected.empty()) {
+    for (auto &column : archive_columns) {
+      selected.push_back(column.first);
+    }
+  }
+  if (header) {
+    for (size_t c = 0; c < selected.size(); c++) {
+      std::cout << (c == 0 ? "" : "\t") << selected[c];
+    }
+    std::cout << std::endl;
+  }
+
+  std::set<std::string> columns(selected.begin(), selected.end());
+  int status = 0;
+  for (int i = optind; i < argc; i++) {
+    ArchiveReader reader(argv[i], columns);
+    if (!reader.good()) {
+      std::cerr << "Cannot open " << argv[i] << std::endl;
+      status = 1;
+      continue;
+    }
+    ArchiveBlock block;
+    while (reader.next(block)) {
+      for (size_t row = 0; row < block.rows(); row++) {
+        for (size_t c = 0; c < selected.size(); c++) {
+          std::cout << (c == 0 ? "" : "\t");
+          if (block.isString(selected[c])) {
+            std::cout << block.strings(selected[c])[row];
+          } else if (block.has(selected[c])) {
+            std::cout << block.integers(selected[c])[row];
+          }
+        }
+        std::cout << "\n";
+      }
+    }
+  }
+  return status;
+}
@@ -0,0 +1,514 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "drmaa.h"
+
+// An in-memory stand-in for a DRM, linked into drmaaws-mock in place of the
+// real DRMAA library so the service can be benchmarked without a cluster.
+// Jobs queue for DRMAAWS_MOCK_QUEUE_MS (100) and then run for
+// DRMAAWS_MOCK_RUN_MS (500); jobs whose command ends in "false" fail. Every
+// call to the DRM takes DRMAAWS_MOCK_LATENCY_MS (0), and while the file named
+// by DRMAAWS_MOCK_OUTAGE_FILE exists the DRM can't be reached.
+
+struct drmaa_job_template_s {
+  std::map<std::string, std::string> attributes;
+  std::map<std::string, std::vector<std::string>> v_attributes;
+};
+
+struct drmaa_attr_names_s {
+  std::vector<std::string> values;
+  size_t next;
+};
+
+struct drmaa_attr_values_s {
+  std::vector<std::string> values;
+  size_t next;
+};
+
+struct drmaa_job_ids_s {
+  std::vector<std::string> values;
+  size_t next;
+};
+
+namespace {
+
+enum Phase { Queued, Running, Finished };
+
+struct MockJob {
+  std::chrono::steady_clock::time_point submitted;
+  bool held;
+  bool suspended;
+  bool killed;
+  // Whether it has been waited for, after which DRMAA forgets it
+  bool reaped;
+  int exit_code;
+  // Time spent on hold doesn't count towards queueing or running
+  std::chrono::milliseconds held_for;
+  std::chrono::steady_clock::time_point held_at;
+};
+
+std::mutex lock;
+std::map<std::string, MockJob> jobs;
+long next_id = 1000;
+bool active = false;
+
+long envLong(const char *name, long default_value) {
+  auto value = getenv(name);
+  return value == nullptr ? default_value : atol(value);
+}
+
+void delay() {
+  auto latency = envLong("DRMAAWS_MOCK_LATENCY_MS", 0);
+  if (latency > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+  }
+}
+
+bool outage() {
+  auto path = getenv("DRMAAWS_MOCK_OUTAGE_FILE");
+  return path != nullptr && access(path, F_OK) == 0;
+}
+
+void copy(char *output, size_t length, const std::string &value) {
+  if (output != nullptr && length > 0) {
+    strncpy(output, value.c_str(), length - 1);
+    output[length - 1] = '\0';
+  }
+}
+
+int fail(int code, char *diagnosis, size_t length) {
+  copy(diagnosis, length, drmaa_strerror(code));
+  return code;
+}
+
+Phase phase(const MockJob &job) {
+  if (job.killed) {
+    return Finished;
+  }
+  if (job.held) {
+    return Queued;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - job.submitted) -
+                 job.held_for;
+  auto queued_for =
+      std::chrono::milliseconds(envLong("DRMAAWS_MOCK_QUEUE_MS", 100));
+  auto runs_for =
+      std::chrono::milliseconds(envLong("DRMAAWS_MOCK_RUN_MS", 500));
+  if (elapsed < queued_for) {
+    return Queued;
+  }
+  if (elapsed < queued_for + runs_for || job.suspended) {
+    return Running;
+  }
+  return Finished;
+}
+
+void submit(const drmaa_job_template_t *jt, const std::string &id) {
+  MockJob job;
+  job.submitted = std::chrono::steady_clock::now();
+  auto state = jt->attributes.find(DRMAA_JS_STATE);
+  job.held = state != jt->attributes.end() &&
+             state->second == DRMAA_SUBMISSION_STATE_HOLD;
+  job.suspended = false;
+  job.killed = false;
+  job.reaped = false;
+  job.held_for = std::chrono::milliseconds(0);
+  job.held_at = job.submitted;
+  auto command = jt->attributes.find(DRMAA_REMOTE_COMMAND);
+  job.exit_code = command != jt->attributes.end() &&
+                          command->second.size() >= 5 &&
+                          command->second.compare(command->second.size() - 5,
+                                                  5, "false") == 0
+                      ? 1
+                      : 0;
+  jobs[id] = job;
+}
+
+template <typename T>
+int nextValue(T *values, char *value, size_t length) {
+  if (values->next >= values->values.size()) {
+    return DRMAA_ERRNO_NO_MORE_ELEMENTS;
+  }
+  copy(value, length, values->values[values->next++]);
+  return DRMAA_ERRNO_SUCCESS;
+}
+}
+
+extern "C" {
+
+int drmaa_get_next_attr_name(drmaa_attr_names_t *values, char *value,
+                             size_t value_len) {
+  return nextValue(values, value, value_len);
+}
+
+int drmaa_get_next_attr_value(drmaa_attr_values_t *values, char *value,
+                              size_t value_len) {
+  return nextValue(values, value, value_len);
+}
+
+int drmaa_get_next_job_id(drmaa_job_ids_t *values, char *value,
+                          size_t value_len) {
+  return nextValue(values, value, value_len);
+}
+
+int drmaa_get_num_attr_names(drmaa_attr_names_t *values, int *size) {
+  *size = values->values.size();
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_get_num_attr_values(drmaa_attr_values_t *values, int *size) {
+  *size = values->values.size();
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_get_num_job_ids(drmaa_job_ids_t *values, int *size) {
+  *size = values->values.size();
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+void drmaa_release_attr_names(drmaa_attr_names_t *values) { delete values; }
+
+void drmaa_release_attr_values(drmaa_attr_values_t *values) { delete values; }
+
+void drmaa_release_job_ids(drmaa_job_ids_t *values) { delete values; }
+
+int drmaa_init(const char *, char *error_diagnosis, size_t error_diag_len) {
+  std::unique_lock<std::mutex> guard(lock);
+  if (active) {
+    return fail(DRMAA_ERRNO_ALREADY_ACTIVE_SESSION, error_diagnosis,
+                error_diag_len);
+  }
+  active = true;
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_exit(char *error_diagnosis, size_t error_diag_len) {
+  std::unique_lock<std::mutex> guard(lock);
+  if (!active) {
+    return fail(DRMAA_ERRNO_NO_ACTIVE_SESSION, error_diagnosis,
+                error_diag_len);
+  }
+  active = false;
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_allocate_job_template(drmaa_job_template_t **jt, char *, size_t) {
+  *jt = new drmaa_job_template_t();
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_delete_job_template(drmaa_job_template_t *jt, char *, size_t) {
+  delete jt;
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_set_attribute(drmaa_job_template_t *jt, const char *name,
+                        const char *value, char *, size_t) {
+  jt->attributes[name] = value;
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_get_attribute(drmaa_job_template_t *jt, const char *name,
+                        char *value, size_t value_len, char *, size_t) {
+  copy(value, value_len, jt->attributes[name]);
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_set_vector_attribute(drmaa_job_template_t *jt, const char *name,
+                               const char *value[], char *, size_t) {
+  auto &items = jt->v_attributes[name];
+  items.clear();
+  for (size_t i = 0; value[i] != nullptr; i++) {
+    items.push_back(value[i]);
+  }
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_get_vector_attribute(drmaa_job_template_t *jt, const char *name,
+                               drmaa_attr_values_t **values, char *, size_t) {
+  *values = new drmaa_attr_values_t{jt->v_attributes[name], 0};
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_get_attribute_names(drmaa_attr_names_t **values, char *, size_t) {
+  *values = new drmaa_attr_names_t{
+      {DRMAA_REMOTE_COMMAND, DRMAA_JS_STATE, DRMAA_WD, DRMAA_JOB_CATEGORY,
+       DRMAA_NATIVE_SPECIFICATION, DRMAA_JOB_NAME, DRMAA_OUTPUT_PATH,
+       DRMAA_ERROR_PATH, DRMAA_JOIN_FILES},
+      0};
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_get_vector_attribute_names(drmaa_attr_names_t **values, char *,
+                                     size_t) {
+  *values =
+      new drmaa_attr_names_t{{DRMAA_V_ARGV, DRMAA_V_ENV, DRMAA_V_EMAIL}, 0};
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_run_job(char *job_id, size_t job_id_len,
+                  const drmaa_job_template_t *jt, char *error_diagnosis,
+                  size_t error_diag_len) {
+  delay();
+  std::unique_lock<std::mutex> guard(lock);
+  if (outage()) {
+    return fail(DRMAA_ERRNO_DRM_COMMUNICATION_FAILURE, error_diagnosis,
+                error_diag_len);
+  }
+  auto id = std::to_string(next_id++);
+  submit(jt, id);
+  copy(job_id, job_id_len, id);
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_run_bulk_jobs(drmaa_job_ids_t **jobids,
+                        const drmaa_job_template_t *jt, int start, int end,
+                        int incr, char *error_diagnosis,
+                        size_t error_diag_len) {
+  delay();
+  std::unique_lock<std::mutex> guard(lock);
+  if (outage()) {
+    return fail(DRMAA_ERRNO_DRM_COMMUNICATION_FAILURE, error_diagnosis,
+                error_diag_len);
+  }
+  auto base = std::to_string(next_id++);
+  *jobids = new drmaa_job_ids_t{{}, 0};
+  for (int i = start; i <= end; i += incr) {
+    auto id = base + "." + std::to_string(i);
+    submit(jt, id);
+    (*jobids)->values.push_back(id);
+  }
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_control(const char *jobid, int action, char *error_diagnosis,
+                  size_t error_diag_len) {
+  delay();
+  std::unique_lock<std::mutex> guard(lock);
+  if (outage()) {
+    return fail(DRMAA_ERRNO_DRM_COMMUNICATION_FAILURE, error_diagnosis,
+                error_diag_len);
+  }
+  auto found = jobs.find(jobid);
+  if (found == jobs.end() || found->second.reaped) {
+    return fail(DRMAA_ERRNO_INVALID_JOB, error_diagnosis, error_diag_len);
+  }
+  auto &job = found->second;
+  auto now = phase(job);
+  switch (action) {
+  case DRMAA_CONTROL_SUSPEND:
+    if (now != Running || job.suspended) {
+      return fail(DRMAA_ERRNO_SUSPEND_INCONSISTENT_STATE, error_diagnosis,
+                  error_diag_len);
+    }
+    job.suspended = true;
+    break;
+  case DRMAA_CONTROL_RESUME:
+    if (!job.suspended) {
+      return fail(DRMAA_ERRNO_RESUME_INCONSISTENT_STATE, error_diagnosis,
+                  error_diag_len);
+    }
+    job.suspended = false;
+    break;
+  case DRMAA_CONTROL_HOLD:
+    if (now != Queued || job.held) {
+      return fail(DRMAA_ERRNO_HOLD_INCONSISTENT_STATE, error_diagnosis,
+                  error_diag_len);
+    }
+    job.held = true;
+    job.held_at = std::chrono::steady_clock::now();
+    break;
+  case DRMAA_CONTROL_RELEASE:
+    if (!job.held) {
+      return fail(DRMAA_ERRNO_RELEASE_INCONSISTENT_STATE, error_diagnosis,
+                  error_diag_len);
+    }
+    job.held = false;
+    job.held_for += std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - job.held_at);
+    break;
+  case DRMAA_CONTROL_TERMINATE:
+    if (now == Finished) {
+      return fail(DRMAA_ERRNO_INVALID_JOB, error_diagnosis, error_diag_len);
+    }
+    job.killed = true;
+    break;
+  }
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_synchronize(const char *[], signed long, int, char *error_diagnosis,
+                      size_t error_diag_len) {
+  return fail(DRMAA_ERRNO_INTERNAL_ERROR, error_diagnosis, error_diag_len);
+}
+
+// Exit statuses of killed jobs are marked with this bit
+static const int killed_stat = 0x10000;
+
+int drmaa_wait(const char *job_id, char *job_id_out, size_t job_id_out_len,
+               int *stat, signed long, drmaa_attr_values_t **rusage,
+               char *error_diagnosis, size_t error_diag_len) {
+  delay();
+  std::unique_lock<std::mutex> guard(lock);
+  if (outage()) {
+    return fail(DRMAA_ERRNO_DRM_COMMUNICATION_FAILURE, error_diagnosis,
+                error_diag_len);
+  }
+  auto any = strcmp(job_id, DRMAA_JOB_IDS_SESSION_ANY) == 0;
+  for (auto &entry : jobs) {
+    if (!any && entry.first != job_id) {
+      continue;
+    }
+    auto &job = entry.second;
+    if (job.reaped) {
+      if (any) {
+        continue;
+      }
+      return fail(DRMAA_ERRNO_INVALID_JOB, error_diagnosis, error_diag_len);
+    }
+    if (phase(job) != Finished) {
+      if (any) {
+        continue;
+      }
+      return DRMAA_ERRNO_EXIT_TIMEOUT;
+    }
+    job.reaped = true;
+    copy(job_id_out, job_id_out_len, entry.first);
+    *stat = job.killed ? killed_stat : job.exit_code;
+    if (rusage != nullptr) {
+      auto wallclock = envLong("DRMAAWS_MOCK_RUN_MS", 500) / 1000.0;
+      *rusage = new drmaa_attr_values_t{
+          {"cpu=1.2500", "maxvmem=104857600.0000",
+           "ru_wallclock=" + std::to_string(wallclock), "io=0.0100"},
+          0};
+    }
+    return DRMAA_ERRNO_SUCCESS;
+  }
+  if (any) {
+    return DRMAA_ERRNO_EXIT_TIMEOUT;
+  }
+  return fail(DRMAA_ERRNO_INVALID_JOB, error_diagnosis, error_diag_len);
+}
+
+int drmaa_wifexited(int *exited, int stat, char *, size_t) {
+  *exited = !(stat & killed_stat);
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_wexitstatus(int *exit_status, int stat, char *, size_t) {
+  *exit_status = stat & 0xFF;
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_wifsignaled(int *signaled, int stat, char *, size_t) {
+  *signaled = !!(stat & killed_stat);
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_wtermsig(char *signal, size_t signal_len, int, char *, size_t) {
+  copy(signal, signal_len, "SIGKILL");
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_wcoredump(int *core_dumped, int, char *, size_t) {
+  *core_dumped = 0;
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_wifaborted(int *aborted, int stat, char *, size_t) {
+  *aborted = !!(stat & killed_stat);
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_job_ps(const char *job_id, int *remote_ps, char *error_diagnosis,
+                 size_t error_diag_len) {
+  delay();
+  std::unique_lock<std::mutex> guard(lock);
+  if (outage()) {
+    return fail(DRMAA_ERRNO_DRM_COMMUNICATION_FAILURE, error_diagnosis,
+                error_diag_len);
+  }
+  auto found = jobs.find(job_id);
+  if (found == jobs.end() || found->second.reaped) {
+    return fail(DRMAA_ERRNO_INVALID_JOB, error_diagnosis, error_diag_len);
+  }
+  auto &job = found->second;
+  switch (phase(job)) {
+  case Queued:
+    *remote_ps = job.held ? DRMAA_PS_USER_ON_HOLD : DRMAA_PS_QUEUED_ACTIVE;
+    break;
+  case Running:
+    *remote_ps = job.suspended ? DRMAA_PS_USER_SUSPENDED : DRMAA_PS_RUNNING;
+    break;
+  case Finished:
+    *remote_ps =
+        job.killed || job.exit_code != 0 ? DRMAA_PS_FAILED : DRMAA_PS_DONE;
+    break;
+  }
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+const char *drmaa_strerror(int drmaa_errno) {
+  static const char *messages[] = {"Success",
+                                   "Internal error",
+                                   "DRM communication failure",
+                                   "Authorization failure",
+                                   "Invalid argument",
+                                   "No active session",
+                                   "No memory",
+                                   "Invalid contact string",
+                                   "Default contact string error",
+                                   "No default contact string selected",
+                                   "DRMS init failed",
+                                   "Already active session",
+                                   "DRMS exit error",
+                                   "Invalid attribute format",
+                                   "Invalid attribute value",
+                                   "Conflicting attribute values",
+                                   "Try later",
+                                   "Denied by DRM",
+                                   "Invalid job",
+                                   "Resume inconsistent state",
+                                   "Suspend inconsistent state",
+                                   "Hold inconsistent state",
+                                   "Release inconsistent state",
+                                   "Exit timeout",
+                                   "No rusage",
+                                   "No more elements"};
+  if (drmaa_errno < 0 ||
+      drmaa_errno >= (int)(sizeof(messages) / sizeof(messages[0]))) {
+    return "Unknown error";
+  }
+  return messages[drmaa_errno];
+}
+
+int drmaa_get_contact(char *contact, size_t contact_len, char *, size_t) {
+  copy(contact, contact_len, "mock");
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_version(unsigned int *major, unsigned int *minor, char *, size_t) {
+  *major = 1;
+  *minor = 0;
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_get_DRM_system(char *drm_system, size_t drm_system_len, char *,
+                         size_t) {
+  copy(drm_system, drm_system_len, "mock");
+  return DRMAA_ERRNO_SUCCESS;
+}
+
+int drmaa_get_DRMAA_implementation(char *drmaa_impl, size_t drmaa_impl_len,
+                                   char *, size_t) {
+  copy(drmaa_impl, drmaa_impl_len, "mock");
+  return DRMAA_ERRNO_SUCCESS;
+}
+}
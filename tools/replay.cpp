@@ -0,0 +1,389 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "capture.hpp"
+
+// Replay requests captured with DRMAAWS_CAPTURE against a running service,
+// keeping the gaps between them but sped up, and report how long the
+// responses took. Usually pointed at drmaaws-mock, so a production load can be
+// benchmarked without a cluster.
+//
+// Latency is measured from when a request was due to be sent, not when a
+// connection was free to send it, so a server that falls behind can't hide
+// it by slowing the replay down.
+
+typedef std::chrono::steady_clock Clock;
+
+struct Sample {
+  std::string route;
+  double seconds;
+  bool mismatched;
+};
+
+// One keep-alive connection to the service, over TCP or a Unix socket
+class Connection {
+public:
+  explicit Connection(const std::string &target_)
+      : target(target_), fd(-1) {}
+  ~Connection() { disconnect(); }
+
+  // Returns the status of the response, or 0 if there wasn't one
+  int request(const CaptureRecord &record) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+      if (fd < 0 && !connect()) {
+        return 0;
+      }
+      if (send(record)) {
+        int status;
+        bool keep_alive;
+        if (response(record.method == "HEAD", status, keep_alive)) {
+          if (!keep_alive) {
+            disconnect();
+          }
+          return status;
+        }
+      }
+      // The server may have closed an idle connection, so try once more
+      disconnect();
+    }
+    return 0;
+  }
+
+private:
+  bool connect() {
+    if (target.find('/') != std::string::npos) {
+      struct sockaddr_un address;
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      strncpy(address.sun_path, target.c_str(), sizeof(address.sun_path) - 1);
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 &&
+          ::connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        disconnect();
+      }
+    } else {
+      auto colon = target.rfind(':');
+      auto host = target.substr(0, colon);
+      auto port =
+          colon == std::string::npos ? "9080" : target.substr(colon + 1);
+      struct addrinfo hints, *addresses;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+        return false;
+      }
+      for (auto address = addresses; address != nullptr && fd < 0;
+           address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype,
+                    address->ai_protocol);
+        if (fd >= 0 &&
+            ::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+          disconnect();
+        }
+      }
+      freeaddrinfo(addresses);
+    }
+    buffer.clear();
+    return fd >= 0;
+  }
+
+  void disconnect() {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  static bool sameName(const std::string &name, const char *expected) {
+    return strcasecmp(name.c_str(), expected) == 0;
+  }
+
+  bool send(const CaptureRecord &record) {
+    auto output = record.method + " " + record.resource +
+                  " HTTP/1.1\r\nHost: drmaaws\r\n";
+    for (auto &header : record.headers) {
+      if (sameName(header.first, "Host") ||
+          sameName(header.first, "Content-Length") ||
+          sameName(header.first, "Connection")) {
+        continue;
+      }
+      output += header.first + ": " + header.second + "\r\n";
+    }
+    output += "Content-Length: " + std::to_string(record.body.size()) +
+              "\r\n\r\n" + record.body;
+    size_t sent = 0;
+    while (sent < output.size()) {
+      auto written = ::send(fd, output.data() + sent, output.size() - sent,
+                            MSG_NOSIGNAL);
+      if (written <= 0) {
+        return false;
+      }
+      sent += written;
+    }
+    return true;
+  }
+
+  bool fill() {
+    char chunk[65536];
+    auto received = recv(fd, chunk, sizeof(chunk), 0);
+    if (received <= 0) {
+      return false;
+    }
+    buffer.append(chunk, received);
+    return true;
+  }
+
+  bool line(std::string &output) {
+    size_t end;
+    while ((end = buffer.find("\r\n")) == std::string::npos) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    output = buffer.substr(0, end);
+    buffer.erase(0, end + 2);
+    return true;
+  }
+
+  bool skip(size_t length) {
+    while (buffer.size() < length) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    buffer.erase(0, length);
+    return true;
+  }
+
+  bool response(bool head, int &status, bool &keep_alive) {
+    std::string text;
+    if (!line(text) || text.size() < 12 || text.compare(0, 5, "HTTP/") != 0) {
+      return false;
+    }
+    status = atoi(text.c_str() + 9);
+    keep_alive = true;
+    long length = -1;
+    bool chunked = false;
+    while (line(text) && !text.empty()) {
+      auto colon = text.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      auto name = text.substr(0, colon);
+      auto start = text.find_first_not_of(' ', colon + 1);
+      auto value = start == std::string::npos ? "" : text.substr(start);
+      if (sameName(name, "Content-Length")) {
+        length = atol(value.c_str());
+      } else if (sameName(name, "Transfer-Encoding")) {
+        chunked = strcasecmp(value.c_str(), "chunked") == 0;
+      } else if (sameName(name, "Connection")) {
+        keep_alive = strcasecmp(value.c_str(), "close") != 0;
+      }
+    }
+    if (head || status == 204 || status == 304) {
+      return true;
+    }
+    if (chunked) {
+      while (line(text)) {
+        auto size = strtoul(text.c_str(), nullptr, 16);
+        if (size == 0) {
+          // Any trailers, then the blank line that ends them
+          while (line(text) && !text.empty()) {
+          }
+          return true;
+        }
+        if (!skip(size + 2)) {
+          return false;
+        }
+      }
+      return false;
+    }
+    if (length >= 0) {
+      return skip(length);
+    }
+    // The body runs until the server hangs up
+    while (fill()) {
+    }
+    buffer.clear();
+    keep_alive = false;
+    return true;
+  }
+
+  std::string target;
+  int fd;
+  std::string buffer;
+};
+
+// Requests for the same kind of thing are reported together
+static std::string routeOf(const CaptureRecord &record) {
+  auto path = record.resource.substr(0, record.resource.find('?'));
+  if (path.compare(0, 8, "/graphs/") == 0) {
+    path = "/graphs/:id";
+  } else if (path.compare(0, 6, "/jobs/") == 0) {
+    path = "/jobs/:key/:stream";
+  }
+  return record.method + " " + path;
+}
+
+static double percentile(const std::vector<double> &sorted, double fraction) {
+  auto index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void report(const std::string &route, std::vector<double> &seconds,
+                   size_t mismatched) {
+  std::sort(seconds.begin(), seconds.end());
+  printf("%-28s %8zu %9.2f %9.2f %9.2f %9.2f %9.2f %8zu\n", route.c_str(),
+         seconds.size(), 1000 * percentile(seconds, 0.5),
+         1000 * percentile(seconds, 0.9), 1000 * percentile(seconds, 0.99),
+         1000 * percentile(seconds, 0.999), 1000 * seconds.back(), mismatched);
+}
+
+int main(int argc, char **argv) {
+  double speed = 1;
+  size_t connections = 16;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+    switch (opt) {
+    case 's':
+      speed = atof(optarg);
+      break;
+    case 'c':
+      connections = strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      optind = argc + 1;
+    }
+  }
+  if (optind + 2 != argc) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-s speed] [-c connections] capture host:port|socket"
+              << std::endl;
+    return 1;
+  }
+  if (speed < 1 || speed > 100 || connections == 0) {
+    std::cerr << "Speed must be from 1 to 100, with at least one connection."
+              << std::endl;
+    return 1;
+  }
+  std::string target = argv[optind + 1];
+
+  CaptureReader reader(argv[optind]);
+  if (!reader.good()) {
+    std::cerr << "Cannot read capture " << argv[optind] << std::endl;
+    return 1;
+  }
+  std::vector<CaptureRecord> records;
+  size_t skipped = 0;
+  CaptureRecord record;
+  while (reader.next(record)) {
+    // Following a log would hold a connection until the job finished
+    if (record.resource.find("follow=") != std::string::npos) {
+      skipped++;
+      continue;
+    }
+    records.push_back(record);
+  }
+  if (records.empty()) {
+    std::cerr << "Nothing to replay." << std::endl;
+    return 1;
+  }
+  // Requests are captured as they finish, so put them back in the order they
+  // arrived
+  std::stable_sort(records.begin(), records.end(),
+                   [](const CaptureRecord &a, const CaptureRecord &b) {
+                     return a.arrival < b.arrival;
+                   });
+
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<std::pair<size_t, Clock::time_point>> due;
+  bool finished = false;
+  std::vector<Sample> samples;
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < connections; i++) {
+    workers.emplace_back([&] {
+      Connection connection(target);
+      std::unique_lock<std::mutex> guard(lock);
+      while (true) {
+        ready.wait(guard, [&] { return finished || !due.empty(); });
+        if (due.empty()) {
+          return;
+        }
+        auto next = due.front();
+        due.pop_front();
+        guard.unlock();
+        auto &request = records[next.first];
+        auto status = connection.request(request);
+        Sample sample = {
+            routeOf(request),
+            std::chrono::duration<double>(Clock::now() - next.second).count(),
+            status != request.status};
+        guard.lock();
+        samples.push_back(sample);
+      }
+    });
+  }
+
+  auto start = Clock::now();
+  auto first = records.front().arrival;
+  for (size_t i = 0; i < records.size(); i++) {
+    auto at = start + std::chrono::microseconds((int64_t)(
+                          (records[i].arrival - first) / speed));
+    std::this_thread::sleep_until(at);
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      due.emplace_back(i, at);
+    }
+    ready.notify_one();
+  }
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    finished = true;
+  }
+  ready.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  auto captured = (records.back().arrival - first) / 1e6;
+
+  std::map<std::string, std::vector<double>> by_route;
+  std::map<std::string, size_t> mismatches;
+  std::vector<double> all;
+  size_t mismatched = 0;
+  for (auto &sample : samples) {
+    by_route[sample.route].push_back(sample.seconds);
+    mismatches[sample.route] += sample.mismatched;
+    all.push_back(sample.seconds);
+    mismatched += sample.mismatched;
+  }
+  printf("%zu requests captured over %.1f s, replayed at %gx in %.1f s",
+         records.size(), captured, speed, elapsed);
+  if (skipped > 0) {
+    printf(", %zu following logs skipped", skipped);
+  }
+  printf("\n\n%-28s %8s %9s %9s %9s %9s %9s %8s\n", "route", "requests",
+         "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms", "changed");
+  for (auto &route : by_route) {
+    report(route.first, route.second, mismatches[route.first]);
+  }
+  report("all", all, mismatched);
+  return 0;
+}
@@ -0,0 +1,120 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <unistd.h>
+#include "logstore.hpp"
+#include "sqlitestore.hpp"
+
+// Run the same drmaaws-like workload against each state store: submit many
+// jobs, poll random ones (a lookup and an update each), do bulk status
+// queries, scan for unfinished jobs as on a restart, and finally expire
+// everything.
+
+static const char *statuses[] = {"QUEUED", "INFLIGHT", "WAITING", "SUCCEEDED",
+                                 "FAILED"};
+
+template <typename F>
+static void measure(const char *store, const char *phase, size_t operations,
+                    F body) {
+  auto start = std::chrono::steady_clock::now();
+  body();
+  auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  printf("%-8s %-10s %10zu ops %10.3f s %12.0f ops/s\n", store, phase,
+         operations, elapsed, operations / elapsed);
+}
+
+static void run(const char *name, StateStore &store, size_t jobs,
+                size_t polls, size_t bulk) {
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < jobs; i++) {
+    keys.push_back(std::to_string(std::hash<size_t>{}(i) * 31 + i) +
+                   std::to_string(i * 7919));
+  }
+  std::mt19937 random(42);
+  std::uniform_int_distribution<size_t> pick(0, jobs - 1);
+
+  measure(name, "submit", jobs, [&] {
+    for (size_t i = 0; i < jobs; i++) {
+      store.put(keys[i], {std::to_string(1000000 + i), "WAITING", time(nullptr),
+                          "bench_" + std::to_string(i % 100), "bench"});
+    }
+  });
+  measure(name, "poll", polls, [&] {
+    for (size_t i = 0; i < polls; i++) {
+      auto &key = keys[pick(random)];
+      JobRecord record;
+      if (store.get(key, record)) {
+        record.status = statuses[i % 5];
+        record.updated_at = time(nullptr);
+        store.put(key, record);
+      }
+    }
+  });
+  measure(name, "status", bulk * 1000, [&] {
+    for (size_t i = 0; i < bulk; i++) {
+      std::vector<std::string> batch;
+      for (size_t j = 0; j < 1000; j++) {
+        batch.push_back(keys[pick(random)]);
+      }
+      store.statuses(batch);
+    }
+  });
+  size_t unfinished = 0;
+  measure(name, "restart", jobs, [&] {
+    store.unfinished(
+        [&](const std::string &, const JobRecord &) { unfinished++; });
+  });
+  measure(name, "expire", jobs, [&] {
+    while (store.expire({{"*", -1}}, 500).size() > 0) {
+    }
+  });
+  measure(name, "compact", 1, [&] { store.compact(); });
+}
+
+int main(int argc, char **argv) {
+  size_t jobs = 20000;
+  size_t polls = 100000;
+  size_t bulk = 100;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:p:b:")) != -1) {
+    switch (opt) {
+    case 'n':
+      jobs = strtoul(optarg, nullptr, 10);
+      break;
+    case 'p':
+      polls = strtoul(optarg, nullptr, 10);
+      break;
+    case 'b':
+      bulk = strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      std::cerr << "Usage: " << argv[0]
+                << " [-n jobs] [-p polls] [-b bulk status queries]"
+                << std::endl;
+      return 1;
+    }
+  }
+  if (jobs == 0) {
+    std::cerr << "Need at least one job." << std::endl;
+    return 1;
+  }
+
+  // Always start from nothing in the current directory
+  unlink("bench.db3");
+  unlink("bench.log");
+  {
+    SqliteStateStore sqlite("bench.db3");
+    run("sqlite", sqlite, jobs, polls, bulk);
+  }
+  {
+    LogStateStore log("bench.log");
+    run("log", log, jobs, polls, bulk);
+  }
+  unlink("bench.db3");
+  unlink("bench.log");
+  return 0;
+}
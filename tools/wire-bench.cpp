@@ -0,0 +1,158 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <json/json.h>
+#include "cbor.hpp"
+
+// Compare the cost of reading and writing jobs as JSON and as CBOR: the same
+// jobs are encoded both ways, then decoded into JobRequests the way the
+// service does it, and the results checked to give the same job key.
+
+template <typename F>
+static void measure(const char *format, const char *phase, size_t operations,
+                    F body) {
+  auto start = std::chrono::steady_clock::now();
+  body();
+  auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  printf("%-6s %-8s %10zu ops %10.3f s %12.0f ops/s\n", format, phase,
+         operations, elapsed, operations / elapsed);
+}
+
+static JobRequest makeJob(size_t i, size_t arguments) {
+  JobRequest job;
+  job.attributes()["drmaa_remote_command"] = "/usr/bin/bench";
+  job.attributes()["drmaa_job_name"] = "bench_" + std::to_string(i);
+  job.attributes()["drmaa_wd"] = "/scratch/bench/" + std::to_string(i % 100);
+  job.attributes()["drmaa_output_path"] = ":$drmaa_wd$/out";
+  job.attributes()["drmaa_native_specification"] = "-l h_vmem=4G -pe smp 4";
+  auto &argv = job.v_attributes()["drmaa_v_argv"];
+  for (size_t j = 0; j < arguments; j++) {
+    argv.push_back("--input=/data/sample_" + std::to_string(i) + "_" +
+                   std::to_string(j) + ".fastq.gz");
+  }
+  auto &env = job.v_attributes()["drmaa_v_env"];
+  for (size_t j = 0; j < arguments / 4; j++) {
+    env.push_back("BENCH_VARIABLE_" + std::to_string(j) + "=\"value\"");
+  }
+  return job;
+}
+
+static std::string writeJson(const JobRequest &job) {
+  Json::Value value(Json::objectValue);
+  for (auto &attribute : job.attributes()) {
+    value[attribute.first] = attribute.second;
+  }
+  for (auto &attribute : job.v_attributes()) {
+    Json::Value items(Json::arrayValue);
+    for (auto &item : attribute.second) {
+      items.append(item);
+    }
+    value[attribute.first] = items;
+  }
+  Json::FastWriter writer;
+  return writer.write(value);
+}
+
+// As the service reads a JSON job
+static bool readJson(const std::string &body, JobRequest &job) {
+  Json::CharReaderBuilder builder;
+  builder["collectComments"] = false;
+  JSONCPP_STRING errs;
+  Json::Value value;
+  std::istringstream is(body);
+  if (!Json::parseFromStream(builder, is, &value, &errs) || !value.isObject()) {
+    return false;
+  }
+  for (auto attribute = value.begin(); attribute != value.end();
+       attribute++) {
+    if (attribute->isString()) {
+      job.attributes()[attribute.name()] = attribute->asString();
+    } else if (attribute->isArray()) {
+      std::vector<std::string> items;
+      for (auto item : *attribute) {
+        if (!item.isString()) {
+          return false;
+        }
+        items.push_back(item.asString());
+      }
+      job.v_attributes()[attribute.name()] = std::move(items);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  size_t jobs = 20000;
+  size_t arguments = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:a:")) != -1) {
+    switch (opt) {
+    case 'n':
+      jobs = strtoul(optarg, nullptr, 10);
+      break;
+    case 'a':
+      arguments = strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      std::cerr << "Usage: " << argv[0] << " [-n jobs] [-a arguments per job]"
+                << std::endl;
+      return 1;
+    }
+  }
+  if (jobs == 0) {
+    std::cerr << "Need at least one job." << std::endl;
+    return 1;
+  }
+
+  std::vector<JobRequest> originals;
+  for (size_t i = 0; i < jobs; i++) {
+    originals.push_back(makeJob(i, arguments));
+  }
+  std::vector<std::string> json(jobs), cbor(jobs);
+  measure("json", "encode", jobs, [&] {
+    for (size_t i = 0; i < jobs; i++) {
+      json[i] = writeJson(originals[i]);
+    }
+  });
+  measure("cbor", "encode", jobs, [&] {
+    for (size_t i = 0; i < jobs; i++) {
+      cbor[i] = writeJob(originals[i]);
+    }
+  });
+
+  std::vector<JobRequest> from_json(jobs), from_cbor(jobs);
+  measure("json", "decode", jobs, [&] {
+    for (size_t i = 0; i < jobs; i++) {
+      if (!readJson(json[i], from_json[i])) {
+        std::cerr << "Cannot read JSON job " << i << std::endl;
+        exit(1);
+      }
+    }
+  });
+  measure("cbor", "decode", jobs, [&] {
+    for (size_t i = 0; i < jobs; i++) {
+      readJob(cbor[i], from_cbor[i]);
+    }
+  });
+
+  size_t json_bytes = 0, cbor_bytes = 0;
+  for (size_t i = 0; i < jobs; i++) {
+    json_bytes += json[i].size();
+    cbor_bytes += cbor[i].size();
+    auto key = originals[i].str();
+    if (from_json[i].str() != key || from_cbor[i].str() != key) {
+      std::cerr << "Job " << i << " did not survive the trip." << std::endl;
+      return 1;
+    }
+  }
+  printf("json   %zu bytes per job\ncbor   %zu bytes per job\n",
+         json_bytes / jobs, cbor_bytes / jobs);
+  return 0;
+}
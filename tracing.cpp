@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+#include "tracing.hpp"
+
+namespace tracing {
+
+// How many spans each thread keeps
+static const size_t ring_size = 4096;
+
+namespace {
+struct Event {
+  uint64_t trace;
+  const char *name;
+  int64_t start;
+  int64_t duration;
+  // Whole requests, which Chrome has to be told may cross threads
+  bool request;
+};
+
+// The lock is only ever contended by a dump
+struct Ring {
+  std::mutex lock;
+  size_t thread;
+  std::vector<Event> events;
+  size_t next;
+};
+}
+
+static double initialRate() {
+  auto value = getenv("DRMAAWS_TRACE_RATE");
+  return value == nullptr ? 0 : atof(value);
+}
+
+static std::atomic<double> sample_rate(initialRate());
+static std::mutex rings_lock;
+// Rings outlive their threads, so what they saw can still be dumped
+static std::vector<std::shared_ptr<Ring>> rings;
+static thread_local uint64_t current_trace = 0;
+
+static int64_t now() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static Ring &ring() {
+  static thread_local std::shared_ptr<Ring> mine;
+  if (!mine) {
+    mine = std::make_shared<Ring>();
+    mine->events.reserve(ring_size);
+    mine->next = 0;
+    std::unique_lock<std::mutex> guard(rings_lock);
+    mine->thread = rings.size() + 1;
+    rings.push_back(mine);
+  }
+  return *mine;
+}
+
+static void record(const Event &event) {
+  auto &mine = ring();
+  std::unique_lock<std::mutex> guard(mine.lock);
+  if (mine.events.size() < ring_size) {
+    mine.events.push_back(event);
+  } else {
+    mine.events[mine.next] = event;
+  }
+  mine.next = (mine.next + 1) % ring_size;
+}
+
+double rate() { return sample_rate; }
+
+void setRate(double rate) {
+  sample_rate = std::min(std::max(rate, 0.0), 1.0);
+}
+
+uint64_t current() { return current_trace; }
+
+Trace::Trace(const char *name_) : name(name_), trace(0), start(0) {
+  double rate = sample_rate;
+  if (rate <= 0) {
+    return;
+  }
+  static thread_local std::mt19937_64 random(std::random_device{}());
+  if (rate < 1 &&
+      std::uniform_real_distribution<double>(0, 1)(random) >= rate) {
+    return;
+  }
+  do {
+    trace = random();
+  } while (trace == 0);
+  start = now();
+}
+
+Trace::~Trace() {
+  if (trace != 0) {
+    record({trace, name, start, now() - start, true});
+  }
+}
+
+uint64_t Trace::id() const { return trace; }
+
+Scope::Scope(uint64_t trace) : previous(current_trace) {
+  current_trace = trace;
+}
+
+Scope::~Scope() { current_trace = previous; }
+
+Span::Span(const char *name_)
+    : name(name_), trace(current_trace), start(trace == 0 ? 0 : now()) {}
+
+Span::~Span() {
+  if (trace != 0) {
+    record({trace, name, start, now() - start, false});
+  }
+}
+
+void dump(std::ostream &output, uint64_t trace) {
+  std::vector<std::shared_ptr<Ring>> all;
+  {
+    std::unique_lock<std::mutex> guard(rings_lock);
+    all = rings;
+  }
+  output << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  auto first = true;
+  for (auto &thread : all) {
+    std::vector<Event> events;
+    {
+      std::unique_lock<std::mutex> guard(thread->lock);
+      events = thread->events;
+    }
+    for (auto &event : events) {
+      if (trace != 0 && event.trace != trace) {
+        continue;
+      }
+      auto id = format(event.trace);
+      auto common = std::string("\"cat\":\"drmaaws\",\"pid\":1,\"tid\":") +
+                    std::to_string(thread->thread) + ",\"name\":\"" +
+                    event.name + "\",\"args\":{\"trace\":\"" + id + "\"}";
+      output << (first ? "" : ",");
+      first = false;
+      if (event.request) {
+        // Requests are async events, so they don't have to nest with the
+        // spans of whichever thread happened to finish them
+        output << "{\"ph\":\"b\",\"id\":\"0x" << id
+               << "\",\"ts\":" << event.start << "," << common << "},"
+               << "{\"ph\":\"e\",\"id\":\"0x" << id
+               << "\",\"ts\":" << event.start + event.duration << ","
+               << common << "}";
+      } else {
+        output << "{\"ph\":\"X\",\"ts\":" << event.start
+               << ",\"dur\":" << event.duration << "," << common << "}";
+      }
+    }
+  }
+  output << "]}";
+}
+
+std::string format(uint64_t trace) {
+  static const char *digits = "0123456789abcdef";
+  std::string output(16, '0');
+  for (size_t i = 16; i > 0; i--) {
+    output[i - 1] = digits[trace & 0xF];
+    trace >>= 4;
+  }
+  return output;
+}
+
+uint64_t parse(const std::string &trace) {
+  return strtoull(trace.c_str(), nullptr, 16);
+}
+}
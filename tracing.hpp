@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Lightweight tracing of individual requests. A sampled request gets a trace
+// id, and spans timed while that trace is current on a thread go into a ring
+// buffer belonging to the thread, so threads recording spans never contend.
+// The most recent spans can be dumped in Chrome's trace event format.
+namespace tracing {
+
+// The fraction of requests that are traced
+double rate();
+void setRate(double rate);
+
+// The trace current on this thread, or 0 if there isn't one
+uint64_t current();
+
+// A request that is traced if sampled. It may start on one thread and finish
+// on another, so it is recorded when the last reference to it goes away.
+class Trace {
+public:
+  explicit Trace(const char *name);
+  ~Trace();
+  Trace(const Trace &) = delete;
+  Trace &operator=(const Trace &) = delete;
+
+  // The trace id, or 0 if the request isn't sampled
+  uint64_t id() const;
+
+private:
+  const char *name;
+  uint64_t trace;
+  int64_t start;
+};
+
+// Makes a trace current on this thread for as long as it lives
+class Scope {
+public:
+  explicit Scope(uint64_t trace);
+  ~Scope();
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+
+private:
+  uint64_t previous;
+};
+
+// Times whatever happens while it lives, if a trace is current. The name must
+// outlive the program, so use a literal.
+class Span {
+public:
+  explicit Span(const char *name);
+  ~Span();
+  Span(const Span &) = delete;
+  Span &operator=(const Span &) = delete;
+
+private:
+  const char *name;
+  uint64_t trace;
+  int64_t start;
+};
+
+// Write out the spans still in the buffers as Chrome trace event JSON, either
+// all of them or those for one trace
+void dump(std::ostream &output, uint64_t trace = 0);
+
+// Trace ids as they are shown to clients
+std::string format(uint64_t trace);
+uint64_t parse(const std::string &trace);
+}
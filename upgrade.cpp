@@ -0,0 +1,227 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "upgrade.hpp"
+
+static const char release_request[] = "release\n";
+static const char released_reply[] = "released\n";
+
+static sigset_t stopSignals() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  return set;
+}
+
+static int connectTo(const std::string &path, sockaddr_un &address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Socket path is too long: " + path);
+  }
+  strcpy(address.sun_path, path.c_str());
+  auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    throw std::runtime_error(std::string("Cannot create socket: ") +
+                             strerror(errno));
+  }
+  if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Read until the expected line arrives or the other end goes away
+static bool readLine(int fd, const char *expected) {
+  std::string line;
+  char c;
+  while (read(fd, &c, 1) == 1) {
+    line += c;
+    if (c == '\n') {
+      return line == expected;
+    }
+  }
+  return false;
+}
+
+UpgradeSocket::UpgradeSocket(const std::string &path_)
+    : path(path_), listener(-1), signals(-1), successor(-1),
+      handed_over(false) {
+  sockaddr_un address;
+  auto existing = connectTo(path, address);
+  if (existing != -1) {
+    close(existing);
+    throw std::runtime_error("Another drmaaws is listening on " + path +
+                             "; start with --upgrade to take over from it");
+  }
+  // Whoever was here has gone without cleaning up
+  unlink(path.c_str());
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1 || bind(listener, (sockaddr *)&address,
+                             sizeof(address)) != 0 ||
+      listen(listener, 4) != 0) {
+    auto error = errno;
+    if (listener != -1) {
+      close(listener);
+    }
+    throw std::runtime_error("Cannot listen on " + path + ": " +
+                             strerror(error));
+  }
+  auto set = stopSignals();
+  signals = signalfd(-1, &set, SFD_CLOEXEC);
+  if (signals == -1) {
+    auto error = errno;
+    close(listener);
+    throw std::runtime_error(std::string("Cannot watch for signals: ") +
+                             strerror(error));
+  }
+}
+
+UpgradeSocket::~UpgradeSocket() {
+  release();
+  if (!handed_over) {
+    unlink(path.c_str());
+  }
+  close(signals);
+  close(listener);
+}
+
+void UpgradeSocket::blockSignals() {
+  auto set = stopSignals();
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+
+bool UpgradeSocket::takeOver(const std::string &path) {
+  sockaddr_un address;
+  auto fd = connectTo(path, address);
+  if (fd == -1) {
+    return false;
+  }
+  std::cerr << "Asking the process on " << path << " to hand over"
+            << std::endl;
+  if (write(fd, release_request, sizeof(release_request) - 1) !=
+      sizeof(release_request) - 1) {
+    close(fd);
+    return false;
+  }
+  // If it dies rather than answering, it's out of the way all the same
+  if (!readLine(fd, released_reply)) {
+    std::cerr << "Old process went away without confirming" << std::endl;
+  }
+  close(fd);
+  return true;
+}
+
+void UpgradeSocket::wait() {
+  while (true) {
+    pollfd fds[] = {{listener, POLLIN, 0}, {signals, POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Cannot wait for upgrades: " << strerror(errno)
+                << std::endl;
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      signalfd_siginfo info;
+      if (read(signals, &info, sizeof(info)) == sizeof(info)) {
+        std::cerr << "Stopping on " << strsignal(info.ssi_signo) << std::endl;
+        return;
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      auto client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client == -1) {
+        continue;
+      }
+      // Don't let a connection that never says anything hold us up
+      timeval timeout{5, 0};
+      setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      if (readLine(client, release_request)) {
+        std::cerr << "Handing over to a new process" << std::endl;
+        successor = client;
+        return;
+      }
+      close(client);
+    }
+  }
+}
+
+void UpgradeSocket::release() {
+  if (successor == -1) {
+    return;
+  }
+  // The new process will listen on the same path, so get ours out of the way
+  // first
+  unlink(path.c_str());
+  handed_over = true;
+  if (write(successor, released_reply, sizeof(released_reply) - 1) !=
+      sizeof(released_reply) - 1) {
+    std::cerr << "Cannot tell the new process we are gone: " << strerror(errno)
+              << std::endl;
+  }
+  close(successor);
+  successor = -1;
+}
+
+void UpgradeSocket::stopAccepting(int port, const std::string &local_path) {
+  // Pistache can only shut a listener down along with every connection it
+  // accepted, so find the sockets themselves
+  std::vector<int> found;
+  auto fds = opendir("/proc/self/fd");
+  if (fds == nullptr) {
+    std::cerr << "Cannot list open sockets: " << strerror(errno) << std::endl;
+    return;
+  }
+  while (auto entry = readdir(fds)) {
+    auto fd = atoi(entry->d_name);
+    int listening = 0;
+    socklen_t length = sizeof(listening);
+    if (entry->d_name[0] == '.' || fd == dirfd(fds) ||
+        getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) != 0 ||
+        !listening) {
+      continue;
+    }
+    sockaddr_storage bound;
+    memset(&bound, 0, sizeof(bound));
+    length = sizeof(bound);
+    if (getsockname(fd, (sockaddr *)&bound, &length) != 0) {
+      continue;
+    }
+    if ((bound.ss_family == AF_INET &&
+         ntohs(((sockaddr_in *)&bound)->sin_port) == port) ||
+        (bound.ss_family == AF_INET6 &&
+         ntohs(((sockaddr_in6 *)&bound)->sin6_port) == port) ||
+        (bound.ss_family == AF_UNIX && !local_path.empty() &&
+         local_path == ((sockaddr_un *)&bound)->sun_path)) {
+      found.push_back(fd);
+    }
+  }
+  closedir(fds);
+  // Pistache will close the descriptor itself later, so leave something
+  // harmless under the same number rather than let it be reused
+  auto placeholder = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  for (auto fd : found) {
+    if (placeholder < 0 || dup3(placeholder, fd, O_CLOEXEC) < 0) {
+      std::cerr << "Cannot stop listening: " << strerror(errno) << std::endl;
+    }
+  }
+  if (placeholder >= 0) {
+    close(placeholder);
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+
+// Lets a newly started process take over from the running one. The running
+// process listens on a Unix socket; the new one connects, asks it to release
+// the port, and waits until it has drained its requests, flushed its state and
+// closed its DRMAA session.
+//
+// The same socket picks up SIGTERM and SIGINT, so a plain shutdown drains in
+// the same way. Call blockSignals() before any threads are started so those
+// signals are left for it.
+class UpgradeSocket {
+public:
+  // Throws if another process is already listening on the path
+  explicit UpgradeSocket(const std::string &path);
+  ~UpgradeSocket();
+
+  static void blockSignals();
+  // Ask the process listening on the path to get out of the way, returning
+  // once it has. Returns false if nothing was listening.
+  static bool takeOver(const std::string &path);
+
+  // Wait until we are asked to go, by a new process or a signal
+  void wait();
+  // Tell the new process, if there is one, that we are gone
+  void release();
+  // Close our listening sockets for a TCP port and, if not empty, a Unix
+  // socket path, so new connections go to the new process while those already
+  // accepted are still served
+  static void stopAccepting(int port, const std::string &local_path);
+
+private:
+  std::string path;
+  int listener;
+  int signals;
+  int successor;
+  // Whether the path now belongs to the new process
+  bool handed_over;
+};